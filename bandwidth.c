@@ -0,0 +1,298 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+
+#include "upnpglobalvars.h"
+#include "bandwidth.h"
+#include "log.h"
+
+/* Every worker streams from its own process, so the scheduler is fully
+ * distributed: each flow publishes what it is doing in a shared table,
+ * and periodically works out its own allowance from everyone else's.
+ *
+ * With an uplink limit, the limit is split by weighted max-min fairness.
+ * Without one we don't know the capacity, so Background and Interactive
+ * flows back off (AIMD) whenever a Streaming flow falls behind its
+ * bitrate, and Streaming flows are never held back. */
+#define BW_SLOTS      128
+#define BW_WINDOW_US  500000		/* allowance update interval */
+#define BW_MIN_RATE   (32*1024)		/* never throttle a flow below this */
+#define BW_INCREASE   (256*1024)	/* additive increase per window */
+#define BW_QUANTUM    (64*1024)		/* smallest send worth waiting for */
+#define BW_CHUNK      (2*1024*1024)	/* come back at least this often */
+
+struct bw_slot {
+	volatile pid_t pid;		/* owning worker, 0 = free */
+	struct in_addr client;
+	enum bw_class cls;
+	volatile uint32_t rate;		/* measured send rate, bytes per second */
+	volatile uint32_t demand;	/* what it could use; 0 = more than it gets */
+	volatile int starved;		/* Streaming flow running below its bitrate */
+};
+
+static struct bw_slot *bw_table;
+static pid_t bw_main_pid;
+
+/* Streaming comes first; splitting a class's weight between one client's
+ * flows keeps a client from winning by opening more connections. */
+static const int bw_weight[] = {
+	[BW_BACKGROUND] = 1,
+	[BW_INTERACTIVE] = 2,
+	[BW_STREAMING] = 16
+};
+
+void
+bw_init(void)
+{
+	void *p;
+
+	bw_main_pid = getpid();
+	p = mmap(NULL, BW_SLOTS * sizeof(struct bw_slot), PROT_READ|PROT_WRITE,
+	         MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+	{
+		DPRINTF(E_WARN, L_GENERAL, "Failed to map bandwidth scheduler: %s\n", strerror(errno));
+		return;
+	}
+	bw_table = p;
+}
+
+void
+bw_reap(pid_t pid)
+{
+	int i;
+
+	if (!bw_table)
+		return;
+	for (i = 0; i < BW_SLOTS; i++)
+		__sync_bool_compare_and_swap(&bw_table[i].pid, pid, 0);
+}
+
+static long
+elapsed_us(const struct timeval *from, const struct timeval *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_usec - from->tv_usec);
+}
+
+/* Weighted max-min fair share of the uplink limit.  Flows that are
+ * limited by something else (the client, the disk, pacing) get what they
+ * use, and the rest is split by weight among the others. */
+static double
+bw_fair_share(struct bw_flow *f)
+{
+	double weight[BW_SLOTS];
+	double capacity, total = 0;
+	char done[BW_SLOTS];
+	struct bw_slot *s, *t;
+	int i, j, n, changed;
+
+	capacity = (double)runtime_vars.uplink_kbps * 1000 / 8;
+	for (i = 0; i < BW_SLOTS; i++)
+	{
+		s = &bw_table[i];
+		done[i] = 1;
+		if (!s->pid)
+			continue;
+		n = 0;
+		for (j = 0; j < BW_SLOTS; j++)
+		{
+			t = &bw_table[j];
+			if (t->pid && t->cls == s->cls && t->client.s_addr == s->client.s_addr)
+				n++;
+		}
+		weight[i] = (double)bw_weight[s->cls] / MAX(n, 1);
+		total += weight[i];
+		done[i] = 0;
+	}
+	if (total <= 0)
+		return capacity;
+
+	do {
+		changed = 0;
+		for (i = 0; i < BW_SLOTS; i++)
+		{
+			if (done[i] || !bw_table[i].demand ||
+			    bw_table[i].demand > capacity * weight[i] / total)
+				continue;
+			if (i == f->slot)
+				return MAX(capacity * weight[i] / total, BW_MIN_RATE);
+			capacity -= bw_table[i].demand;
+			total -= weight[i];
+			done[i] = 1;
+			changed = 1;
+		}
+	} while (changed && total > 0);
+
+	if (total <= 0 || capacity <= 0)
+		return BW_MIN_RATE;
+	return MAX(capacity * weight[f->slot] / total, BW_MIN_RATE);
+}
+
+int
+bw_worker(void)
+{
+	return getpid() != bw_main_pid;
+}
+
+void
+bw_flow_begin(struct bw_flow *f, struct in_addr client, enum bw_class cls, int bitrate)
+{
+	struct bw_slot *s;
+	pid_t pid = getpid();
+	int i;
+
+	memset(f, 0, sizeof(*f));
+	f->slot = -1;
+	f->cls = cls;
+	f->bitrate = bitrate;
+	gettimeofday(&f->window, NULL);
+	f->last = f->window;
+	/* Holding a transfer back means sleeping, which the main process
+	 * can't do without stalling SSDP, SOAP and events along with it.
+	 * What it sends inline (art, captions, thumbnails) is small anyway. */
+	if (!bw_table || pid == bw_main_pid)
+		return;
+
+	for (i = 0; i < BW_SLOTS; i++)
+	{
+		s = &bw_table[i];
+		if (!__sync_bool_compare_and_swap(&s->pid, 0, pid))
+			continue;
+		s->client = client;
+		s->cls = cls;
+		s->rate = 0;
+		s->demand = 0;
+		s->starved = 0;
+		f->slot = i;
+		/* Don't let a new flow blow through the limit in its first window */
+		if (runtime_vars.uplink_kbps > 0)
+			f->rate = bw_fair_share(f);
+		return;
+	}
+	DPRINTF(E_DEBUG, L_HTTP, "Bandwidth scheduler is full, not scheduling transfer\n");
+}
+
+static int
+bw_any_starved(void)
+{
+	int i;
+
+	for (i = 0; i < BW_SLOTS; i++)
+	{
+		if (bw_table[i].pid && bw_table[i].starved)
+			return 1;
+	}
+	return 0;
+}
+
+static void
+bw_update(struct bw_flow *f, const struct timeval *now)
+{
+	struct bw_slot *s = &bw_table[f->slot];
+	long us = elapsed_us(&f->window, now);
+	uint32_t rate;
+
+	if (us < BW_WINDOW_US)
+		return;
+	rate = f->window_bytes * 1000000 / us;
+	s->rate = s->rate ? (s->rate + rate) / 2 : rate;
+	s->demand = f->waited ? 0 : MAX(s->rate + s->rate / 4, BW_MIN_RATE);
+	s->starved = (f->cls == BW_STREAMING && f->bitrate > 0 && !f->waited &&
+	              s->rate < (uint32_t)f->bitrate);
+
+	if (runtime_vars.uplink_kbps > 0)
+		f->rate = bw_fair_share(f);
+	else if (f->cls == BW_STREAMING)
+		f->rate = 0;
+	else if (bw_any_starved())
+	{
+		f->rate = (f->rate ? f->rate : s->rate) / 2;
+		if (f->rate < BW_MIN_RATE)
+			f->rate = BW_MIN_RATE;
+	}
+	else if (f->rate)
+	{
+		/* Only keep probing upwards while the limit is what holds us back */
+		if (f->waited)
+			f->rate += BW_INCREASE;
+		else
+			f->rate = 0;
+	}
+
+	f->window = *now;
+	f->window_bytes = 0;
+	f->waited = 0;
+}
+
+off_t
+bw_take(struct bw_flow *f, off_t want)
+{
+	struct timeval now;
+	double need, depth;
+
+	if (f->slot < 0)
+		return want;
+	want = MIN(want, BW_CHUNK);
+	for (;;)
+	{
+		gettimeofday(&now, NULL);
+		bw_update(f, &now);
+		if (!f->rate)
+			break;
+		/* Allow up to one window's worth of burst */
+		f->tokens += f->rate * elapsed_us(&f->last, &now) / 1000000;
+		depth = MAX(f->rate * BW_WINDOW_US / 1000000, BW_QUANTUM);
+		if (f->tokens > depth)
+			f->tokens = depth;
+		f->last = now;
+		need = MIN(want, BW_QUANTUM);
+		if (f->tokens >= need)
+			return MIN(want, (off_t)f->tokens);
+		f->waited = 1;
+		usleep((need - f->tokens) * 1000000 / f->rate);
+	}
+	f->last = now;
+	f->tokens = 0;
+
+	return want;
+}
+
+void
+bw_spend(struct bw_flow *f, off_t sent)
+{
+	if (f->slot < 0)
+		return;
+	f->window_bytes += sent;
+	if (f->rate)
+		f->tokens -= sent;
+}
+
+void
+bw_flow_end(struct bw_flow *f)
+{
+	if (f->slot < 0)
+		return;
+	__sync_bool_compare_and_swap(&bw_table[f->slot].pid, getpid(), 0);
+	f->slot = -1;
+}
@@ -0,0 +1,67 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __BANDWIDTH_H__
+#define __BANDWIDTH_H__
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+/* DLNA transfer modes, lowest priority first */
+enum bw_class {
+	BW_BACKGROUND,
+	BW_INTERACTIVE,
+	BW_STREAMING
+};
+
+/* A transfer's view of the scheduler.  Lives in the worker process; the
+ * shared state is a slot in a table mapped before forking. */
+struct bw_flow {
+	int slot;		/* index in the shared table, -1 if unscheduled */
+	enum bw_class cls;
+	int bitrate;		/* bytes per second the media needs, 0 if unknown */
+	double rate;		/* current allowance in bytes per second, 0 = unlimited */
+	double tokens;
+	struct timeval last;	/* last token refill */
+	struct timeval window;	/* start of the current measurement window */
+	off_t window_bytes;
+	int waited;		/* did we run out of tokens during this window */
+};
+
+/* Map the shared flow table.  Called once from the main process. */
+void bw_init(void);
+
+/* Release any slot still held by a worker that has exited.  Safe to
+ * call from a signal handler. */
+void bw_reap(pid_t pid);
+
+/* Whether we are a forked worker, and so free to block while holding a
+ * transfer back.  Transfers in the main process are never scheduled. */
+int bw_worker(void);
+
+/* Register a transfer to client.  If the table is full the transfer is
+ * simply left unscheduled. */
+void bw_flow_begin(struct bw_flow *f, struct in_addr client, enum bw_class cls, int bitrate);
+
+/* Wait until some of the wanted bytes may be sent, and return how many.
+ * The caller reports what it actually sent with bw_spend(). */
+off_t bw_take(struct bw_flow *f, off_t want);
+void bw_spend(struct bw_flow *f, off_t sent);
+
+void bw_flow_end(struct bw_flow *f);
+
+#endif /* __BANDWIDTH_H__ */
@@ -21,6 +21,7 @@
 #include "scanner.h"
 #include "upnpglobalvars.h"
 #include "containers.h"
+#include "sql.h"
 #include "log.h"
 
 #define NINETY_DAYS "7776000"
@@ -117,6 +118,30 @@ struct magic_container_s magic_containers[] =
 	{ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0 }
 };
 
+const struct sort_capability sort_capabilities[] = {
+	{ "dc:title", "SORT_TITLE" },
+	{ "dc:date", "SORT_DATE" },
+	{ "upnp:class", "CLASS" },
+	{ "upnp:album", "SORT_ALBUM" },
+	{ "upnp:originalTrackNumber", "SORT_DISC, SORT_TRACK" },
+	{ NULL }
+};
+
+/* One index for each ordering a client can sort a container by */
+void
+create_sort_indexes(void)
+{
+	const struct sort_capability *cap;
+
+	for( cap = sort_capabilities; cap->property; cap++ )
+	{
+		sql_exec(db, "create INDEX IDX_SORT_%d ON OBJECTS(PARENT_ID, %s%s, OBJECT_ID);",
+		             (int)(cap - sort_capabilities), cap->columns,
+		             strcmp(cap->columns, SORT_TIEBREAK) ? ", " SORT_TIEBREAK : "");
+	}
+	sql_exec(db, "create INDEX IDX_SORT_FORCED ON OBJECTS(PARENT_ID, " FORCE_SORT_ORDER ", OBJECT_ID);");
+}
+
 struct magic_container_s *
 in_magic_container(const char *id, int flags, const char **real_id)
 {
@@ -34,3 +34,21 @@ extern struct magic_container_s magic_containers[];
 
 struct magic_container_s *in_magic_container(const char *id, int flags, const char **real_id);
 struct magic_container_s *check_magic_container(const char *id, int flags);
+
+/* The properties clients can sort on, and the OBJECTS columns each one
+ * sorts by.  Sorts that don't otherwise end on the title are followed
+ * by SORT_TIEBREAK.  The scanner indexes PARENT_ID followed by each of
+ * these orderings, and by FORCE_SORT_ORDER, so that a sorted page of a
+ * container is read off an index instead of sorting all its children. */
+struct sort_capability {
+	const char *property;
+	const char *columns;
+};
+
+extern const struct sort_capability sort_capabilities[];
+
+#define SORT_TIEBREAK "SORT_TITLE"
+/* What clients with FLAG_FORCE_SORT always get */
+#define FORCE_SORT_ORDER "CLASS, SORT_DISC, SORT_TRACK, SORT_TITLE"
+
+void create_sort_indexes(void);
@@ -63,6 +63,7 @@
 #include "upnpglobalvars.h"
 #include "getifaddr.h"
 #include "minissdp.h"
+#include "upnphttp.h"
 #include "utils.h"
 #include "log.h"
 
@@ -317,6 +318,7 @@ reload_ifaces(int force_notify)
 		close(lan_addr[i].snotify);
 	}
 	n_lan_addr = 0;
+	InvalidateDescCache_upnphttp();
 
 	i = 0;
 	do {
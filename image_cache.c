@@ -0,0 +1,264 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "upnpglobalvars.h"
+#include "image_cache.h"
+#include "utils.h"
+#include "log.h"
+
+struct cache_file {
+	char name[64];
+	time_t used;
+	off_t size;
+};
+
+/* Bytes in the cache, shared by all worker processes */
+static off_t *cache_bytes;
+
+static int
+open_cached(const char *path, off_t *size)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if( fd < 0 )
+		return -1;
+	if( fstat(fd, &st) != 0 )
+	{
+		close(fd);
+		return -1;
+	}
+	*size = st.st_size;
+	/* The cache file's mtime records when it was last used */
+	futimens(fd, NULL);
+
+	return fd;
+}
+
+static int
+cmp_used(const void *a, const void *b)
+{
+	const struct cache_file *x = a, *y = b;
+
+	return (x->used > y->used) - (x->used < y->used);
+}
+
+/* Total up the cache and evict least recently used variants until we
+ * are back under budget, then restart the running total from there.
+ * We trim to 90% so that the next few inserts don't need a scan too. */
+static void
+image_cache_trim(void)
+{
+	char dir[PATH_MAX], path[PATH_MAX];
+	struct cache_file *files = NULL, *tmp;
+	struct dirent *dp;
+	struct stat st;
+	off_t total = 0, budget;
+	int n = 0, alloc = 0, i;
+	DIR *dh;
+
+	budget = (off_t)runtime_vars.resize_cache_mb * 1024 * 1024;
+	snprintf(dir, sizeof(dir), "%s/" IMAGE_CACHE_DIR, db_path);
+	dh = opendir(dir);
+	if( !dh )
+		return;
+	while( (dp = readdir(dh)) != NULL )
+	{
+		if( !ends_with(dp->d_name, ".jpg") || strlen(dp->d_name) >= sizeof(files->name) )
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name);
+		if( stat(path, &st) != 0 )
+			continue;
+		if( n == alloc )
+		{
+			alloc += 256;
+			tmp = realloc(files, alloc * sizeof(*files));
+			if( !tmp )
+				break;
+			files = tmp;
+		}
+		strcpy(files[n].name, dp->d_name);
+		files[n].used = st.st_mtime;
+		files[n].size = st.st_size;
+		total += st.st_size;
+		n++;
+	}
+	closedir(dh);
+
+	if( total > budget )
+	{
+		qsort(files, n, sizeof(*files), cmp_used);
+		for( i = 0; i < n && total > budget / 10 * 9; i++ )
+		{
+			snprintf(path, sizeof(path), "%s/%s", dir, files[i].name);
+			if( unlink(path) == 0 )
+				total -= files[i].size;
+		}
+		DPRINTF(E_DEBUG, L_HTTP, "Evicted %d resized images from cache\n", i);
+	}
+	free(files);
+	if( cache_bytes )
+		*cache_bytes = total;
+}
+
+void
+image_cache_init(void)
+{
+	void *p;
+
+	if( runtime_vars.resize_cache_mb <= 0 )
+		return;
+	p = mmap(NULL, sizeof(*cache_bytes), PROT_READ|PROT_WRITE,
+	         MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if( p == MAP_FAILED )
+		DPRINTF(E_WARN, L_GENERAL, "Failed to map image cache size: %s\n", strerror(errno));
+	else
+		cache_bytes = p;
+	image_cache_trim();
+}
+
+int
+image_cache_lookup(struct image_cache_entry *entry, off_t *size)
+{
+	char lock[PATH_MAX];
+	struct stat held, cur;
+	int fd;
+
+	entry->lockfd = -1;
+	if( runtime_vars.resize_cache_mb <= 0 )
+		return -1;
+
+	snprintf(entry->path, sizeof(entry->path), "%s/" IMAGE_CACHE_DIR "/%lld_%dx%d_%d_%lld.jpg",
+	         db_path, (long long)entry->id, entry->width, entry->height,
+	         entry->rotate, (long long)entry->mtime);
+	fd = open_cached(entry->path, size);
+	if( fd >= 0 )
+		return fd;
+
+	snprintf(lock, sizeof(lock), "%s/" IMAGE_CACHE_DIR, db_path);
+	make_dir(lock, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+	snprintf(lock, sizeof(lock), "%s.lock", entry->path);
+	for( ;; )
+	{
+		entry->lockfd = open(lock, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+		if( entry->lockfd < 0 )
+			return -1;
+		if( flock(entry->lockfd, LOCK_EX) != 0 )
+		{
+			close(entry->lockfd);
+			entry->lockfd = -1;
+			return -1;
+		}
+		/* The previous holder removes the lock file when it is done, and a
+		 * lock on a removed file no longer keeps anyone else out */
+		if( fstat(entry->lockfd, &held) == 0 && stat(lock, &cur) == 0 &&
+		    held.st_dev == cur.st_dev && held.st_ino == cur.st_ino )
+			break;
+		close(entry->lockfd);
+	}
+
+	/* Somebody else may have generated it while we were waiting */
+	fd = open_cached(entry->path, size);
+	if( fd >= 0 )
+	{
+		unlink(lock);
+		close(entry->lockfd);
+		entry->lockfd = -1;
+	}
+
+	return fd;
+}
+
+int
+image_cache_create(struct image_cache_entry *entry)
+{
+	int fd;
+
+	if( entry->lockfd < 0 )
+		return -1;
+	snprintf(entry->tmp, sizeof(entry->tmp), "%s.XXXXXX", entry->path);
+	fd = mkstemp(entry->tmp);
+	if( fd >= 0 )
+		fchmod(fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+
+	return fd;
+}
+
+void
+image_cache_commit(struct image_cache_entry *entry, int fd, int ok)
+{
+	char lock[PATH_MAX];
+	struct stat st;
+	off_t budget;
+
+	if( entry->lockfd < 0 )
+		return;
+
+	if( fd >= 0 )
+	{
+		if( ok && fstat(fd, &st) != 0 )
+			ok = 0;
+		close(fd);
+		if( !ok || rename(entry->tmp, entry->path) != 0 )
+		{
+			if( ok )
+				DPRINTF(E_WARN, L_HTTP, "Failed to cache resized image %s\n", entry->path);
+			unlink(entry->tmp);
+			ok = 0;
+		}
+	}
+
+	/* Waiters see that the lock file is gone and start over on a new one */
+	snprintf(lock, sizeof(lock), "%s.lock", entry->path);
+	unlink(lock);
+	close(entry->lockfd);
+	entry->lockfd = -1;
+
+	/* Only scan the cache when this insert takes it over budget */
+	budget = (off_t)runtime_vars.resize_cache_mb * 1024 * 1024;
+	if( fd >= 0 && ok &&
+	    (!cache_bytes || __sync_add_and_fetch(cache_bytes, st.st_size) > budget) )
+		image_cache_trim();
+}
+
+void
+image_cache_store(struct image_cache_entry *entry, const void *data, int size)
+{
+	int fd = -1;
+	int ok = 0;
+
+	if( data )
+	{
+		fd = image_cache_create(entry);
+		if( fd >= 0 )
+			ok = (write(fd, data, size) == size);
+	}
+	image_cache_commit(entry, fd, ok);
+}
@@ -0,0 +1,64 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __IMAGE_CACHE_H__
+#define __IMAGE_CACHE_H__
+
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define IMAGE_CACHE_DIR "resize_cache"
+
+/* A resized image variant.  The caller fills in the key fields; path,
+ * tmp and lockfd are managed by image_cache_lookup() and
+ * image_cache_store(). */
+struct image_cache_entry {
+	int64_t id;
+	int width;
+	int height;
+	int rotate;
+	time_t mtime;
+	char path[PATH_MAX];
+	char tmp[PATH_MAX];
+	int lockfd;
+};
+
+/* Set up the cache's shared size count from what is on disk, trimming it
+ * if it is already over budget.  Call once at startup, before forking. */
+void image_cache_init(void);
+
+/* Look up a cached variant.  Returns an open descriptor and its size on a
+ * hit.  On a miss returns -1; if entry->lockfd is then >= 0 the caller
+ * holds the generation lock for this variant and must hand the result
+ * (or NULL on failure) to image_cache_store().  Concurrent requests for
+ * the same variant block here until the generating process is done. */
+int image_cache_lookup(struct image_cache_entry *entry, off_t *size);
+
+/* Save a freshly generated variant, release the generation lock and trim
+ * the cache back under its size budget.  data may be NULL to only release
+ * the lock.  Safe to call more than once. */
+void image_cache_store(struct image_cache_entry *entry, const void *data, int size);
+
+/* For variants that are written out incrementally: image_cache_create()
+ * returns a descriptor to write the variant to (-1 if we don't hold the
+ * generation lock), and image_cache_commit() publishes it if ok is set,
+ * then releases the lock as image_cache_store() does. */
+int image_cache_create(struct image_cache_entry *entry);
+void image_cache_commit(struct image_cache_entry *entry, int fd, int ok);
+
+#endif /* __IMAGE_CACHE_H__ */
@@ -50,6 +50,7 @@
 #endif
 
 #define JPEG_QUALITY  96
+#define JPEG_STREAM_BUFSIZE 32768
 
 #define COL(red, green, blue) (((red) << 24) | ((green) << 16) | ((blue) << 8) | 0xFF)
 #define COL_FULL(red, green, blue, alpha) (((red) << 24) | ((green) << 16) | ((blue) << 8) | (alpha))
@@ -223,13 +224,6 @@ get_pix(image_s *pimage, int32_t x, int32_t y)
 	return(pimage->buf[(y * pimage->width) + x]);
 }
 
-void
-put_pix_alpha_replace(image_s *pimage, int32_t x, int32_t y, pix col)
-{
-	if((x >= 0) && (y >= 0) && (x < pimage->width) && (y < pimage->height))
-		pimage->buf[(y * pimage->width) + x] = col;
-}
-
 int
 image_get_jpeg_date_xmp(const char * path, char ** date)
 {
@@ -333,6 +327,64 @@ image_get_jpeg_date_xmp(const char * path, char ** date)
 	return ret;
 }
 
+/* Find where the EXIF thumbnail thumb[size] lives inside the file, so it
+ * can later be served straight from disk.  Returns the file offset, or
+ * -1 if it isn't stored verbatim in the APP1 segment. */
+off_t
+image_get_jpeg_exif_thumb_offset(const char * path, const unsigned char * thumb, int size)
+{
+	FILE *img;
+	unsigned char buf[4];
+	unsigned char *data = NULL;
+	unsigned char *match;
+	uint16_t len;
+	off_t ret = -1;
+
+	img = fopen(path, "r");
+	if( !img )
+		return -1;
+
+	if( fread(buf, 2, 1, img) < 1 || buf[0] != 0xFF || buf[1] != 0xD8 )
+	{
+		fclose(img);
+		return -1;
+	}
+
+	/* EXIF lives in the APPn segments that come before the image data */
+	while( fread(buf, 4, 1, img) == 1 && buf[0] == 0xFF &&
+	       buf[1] != 0xDA && buf[1] != 0xD9 )
+	{
+		memcpy(&len, buf+2, 2);
+		len = SWAP16(len);
+		if( len < 2 )
+			break;
+		len -= 2;
+		if( buf[1] != 0xE1 || len < 6 + size )
+		{
+			if( fseek(img, len, SEEK_CUR) != 0 )
+				break;
+			continue;
+		}
+
+		data = malloc(len);
+		if( !data || fread(data, len, 1, img) < 1 )
+			break;
+		if( memcmp(data, "Exif\0\0", 6) == 0 )
+		{
+			match = memmem(data + 6, len - 6, thumb, size);
+			if( match )
+				ret = ftello(img) - len + (match - data);
+			break;
+		}
+		free(data);
+		data = NULL;
+	}
+	free(data);
+	fclose(img);
+
+	return ret;
+}
+
 image_s *
 image_new(int32_t width, int32_t height)
 {
@@ -500,24 +552,20 @@ image_new_from_jpeg(const char *path, int is_file, const uint8_t *buf, int size,
 	return vimage;
 }
 
-void
-image_upsize(image_s * pdest, image_s * psrc, int32_t width, int32_t height)
+/* Compute row vy of psrc scaled up to width x height */
+static void
+image_upsize_row(pix * row, image_s * psrc, int32_t vy, int32_t width, int32_t height)
 {
-	int32_t vx, vy;
+	int32_t vx;
 #if !defined __i386__ && !defined __x86_64__
 	int32_t rx, ry;
 	pix vcol;
 
-	if((pdest == NULL) || (psrc == NULL))
-		return;
-
-	for(vy = 0; vy < height; vy++)
+	for(vx = 0; vx < width; vx++)
 	{
-		for(vx = 0; vx < width; vx++)
-		{
-			rx = ((vx * psrc->width) / width);
-			ry = ((vy * psrc->height) / height);
-			vcol = get_pix(psrc, rx, ry);
+		rx = ((vx * psrc->width) / width);
+		ry = ((vy * psrc->height) / height);
+		vcol = get_pix(psrc, rx, ry);
 #else
 	pix   vcol,vcol1,vcol2,vcol3,vcol4;
 	float rx,ry;
@@ -527,46 +575,56 @@ image_upsize(image_s * pdest, image_s * psrc, int32_t width, int32_t height)
 	width_scale  = (float)psrc->width  / (float)width;
 	height_scale = (float)psrc->height / (float)height;
 
-	for(vy = 0;vy < height; vy++)
+	for(vx = 0;vx < width; vx++)
 	{
-		for(vx = 0;vx < width; vx++)
-		{
-			rx = vx * width_scale;
-			ry = vy * height_scale;
-			vcol1 = get_pix(psrc, (int32_t)rx, (int32_t)ry);
-			vcol2 = get_pix(psrc, ((int32_t)rx)+1, (int32_t)ry);
-			vcol3 = get_pix(psrc, (int32_t)rx, ((int32_t)ry)+1);
-			vcol4 = get_pix(psrc, ((int32_t)rx)+1, ((int32_t)ry)+1);
-
-			x_dist = rx - ((float)((int32_t)rx));
-			y_dist = ry - ((float)((int32_t)ry));
-			vcol = COL_FULL( (uint8_t)((COL_RED(vcol1)*(1.0-x_dist)
-			                  + COL_RED(vcol2)*(x_dist))*(1.0-y_dist)
-			                  + (COL_RED(vcol3)*(1.0-x_dist)
-			                  + COL_RED(vcol4)*(x_dist))*(y_dist)),
-			                 (uint8_t)((COL_GREEN(vcol1)*(1.0-x_dist)
-			                  + COL_GREEN(vcol2)*(x_dist))*(1.0-y_dist)
-			                  + (COL_GREEN(vcol3)*(1.0-x_dist)
-			                  + COL_GREEN(vcol4)*(x_dist))*(y_dist)),
-			                 (uint8_t)((COL_BLUE(vcol1)*(1.0-x_dist)
-			                  + COL_BLUE(vcol2)*(x_dist))*(1.0-y_dist)
-			                  + (COL_BLUE(vcol3)*(1.0-x_dist)
-			                  + COL_BLUE(vcol4)*(x_dist))*(y_dist)),
-			                 (uint8_t)((COL_ALPHA(vcol1)*(1.0-x_dist)
-			                  + COL_ALPHA(vcol2)*(x_dist))*(1.0-y_dist)
-			                  + (COL_ALPHA(vcol3)*(1.0-x_dist)
-			                  + COL_ALPHA(vcol4)*(x_dist))*(y_dist))
-			               );
+		rx = vx * width_scale;
+		ry = vy * height_scale;
+		vcol1 = get_pix(psrc, (int32_t)rx, (int32_t)ry);
+		vcol2 = get_pix(psrc, ((int32_t)rx)+1, (int32_t)ry);
+		vcol3 = get_pix(psrc, (int32_t)rx, ((int32_t)ry)+1);
+		vcol4 = get_pix(psrc, ((int32_t)rx)+1, ((int32_t)ry)+1);
+
+		x_dist = rx - ((float)((int32_t)rx));
+		y_dist = ry - ((float)((int32_t)ry));
+		vcol = COL_FULL( (uint8_t)((COL_RED(vcol1)*(1.0-x_dist)
+		                  + COL_RED(vcol2)*(x_dist))*(1.0-y_dist)
+		                  + (COL_RED(vcol3)*(1.0-x_dist)
+		                  + COL_RED(vcol4)*(x_dist))*(y_dist)),
+		                 (uint8_t)((COL_GREEN(vcol1)*(1.0-x_dist)
+		                  + COL_GREEN(vcol2)*(x_dist))*(1.0-y_dist)
+		                  + (COL_GREEN(vcol3)*(1.0-x_dist)
+		                  + COL_GREEN(vcol4)*(x_dist))*(y_dist)),
+		                 (uint8_t)((COL_BLUE(vcol1)*(1.0-x_dist)
+		                  + COL_BLUE(vcol2)*(x_dist))*(1.0-y_dist)
+		                  + (COL_BLUE(vcol3)*(1.0-x_dist)
+		                  + COL_BLUE(vcol4)*(x_dist))*(y_dist)),
+		                 (uint8_t)((COL_ALPHA(vcol1)*(1.0-x_dist)
+		                  + COL_ALPHA(vcol2)*(x_dist))*(1.0-y_dist)
+		                  + (COL_ALPHA(vcol3)*(1.0-x_dist)
+		                  + COL_ALPHA(vcol4)*(x_dist))*(y_dist))
+		               );
 #endif
-			put_pix_alpha_replace(pdest, vx, vy, vcol);
-		}
+		row[vx] = vcol;
 	}
 }
 
 void
-image_downsize(image_s * pdest, image_s * psrc, int32_t width, int32_t height)
+image_upsize(image_s * pdest, image_s * psrc, int32_t width, int32_t height)
+{
+	int32_t vy;
+
+	if((pdest == NULL) || (psrc == NULL))
+		return;
+
+	for(vy = 0; vy < height; vy++)
+		image_upsize_row(pdest->buf + (vy * pdest->width), psrc, vy, width, height);
+}
+
+/* Compute row vy of psrc scaled down to width x height */
+static void
+image_downsize_row(pix * row, image_s * psrc, int32_t vy, int32_t width, int32_t height)
 {
-	int32_t vx, vy;
+	int32_t vx;
 	pix vcol;
 	int32_t i, j;
 #if !defined __i386__ && !defined __x86_64__
@@ -574,47 +632,42 @@ image_downsize(image_s * pdest, image_s * psrc, int32_t width, int32_t height)
 	int red, green, blue, alpha;
 	int factor;
 
-	if((pdest == NULL) || (psrc == NULL))
-		return;
-
-	for(vy = 0; vy < height; vy++)
+	for(vx = 0; vx < width; vx++)
 	{
-		for(vx = 0; vx < width; vx++)
-		{
 
-			rx = ((vx * psrc->width) / width);
-			ry = ((vy * psrc->height) / height);
+		rx = ((vx * psrc->width) / width);
+		ry = ((vy * psrc->height) / height);
 
-			red = green = blue = alpha = 0;
+		red = green = blue = alpha = 0;
 
-			rx_next = rx + (psrc->width / width);
-			ry_next = ry + (psrc->width / width);
-			factor = 0;
+		rx_next = rx + (psrc->width / width);
+		ry_next = ry + (psrc->width / width);
+		factor = 0;
 
-			for( j = rx; j < rx_next; j++)
+		for( j = rx; j < rx_next; j++)
+		{
+			for( i = ry; i < ry_next; i++)
 			{
-				for( i = ry; i < ry_next; i++)
-				{
-					factor += 1;
-					vcol = get_pix(psrc, j, i);
+				factor += 1;
+				vcol = get_pix(psrc, j, i);
 
-					red   += COL_RED(vcol);
-					green += COL_GREEN(vcol);
-					blue  += COL_BLUE(vcol);
-					alpha += COL_ALPHA(vcol);
-				}
+				red   += COL_RED(vcol);
+				green += COL_GREEN(vcol);
+				blue  += COL_BLUE(vcol);
+				alpha += COL_ALPHA(vcol);
 			}
+		}
 
-			red   /= factor;
-			green /= factor;
-			blue  /= factor;
-			alpha /= factor;
+		red   /= factor;
+		green /= factor;
+		blue  /= factor;
+		alpha /= factor;
 
-			/* on sature les valeurs */
-			red   = (red   > 255) ? 255 : ((red   < 0) ? 0 : red  );
-			green = (green > 255) ? 255 : ((green < 0) ? 0 : green);
-			blue  = (blue  > 255) ? 255 : ((blue  < 0) ? 0 : blue );
-			alpha = (alpha > 255) ? 255 : ((alpha < 0) ? 0 : alpha);
+		/* on sature les valeurs */
+		red   = (red   > 255) ? 255 : ((red   < 0) ? 0 : red  );
+		green = (green > 255) ? 255 : ((green < 0) ? 0 : green);
+		blue  = (blue  > 255) ? 255 : ((blue  < 0) ? 0 : blue );
+		alpha = (alpha > 255) ? 255 : ((alpha < 0) ? 0 : alpha);
 #else
 	float rx,ry;
 	float width_scale, height_scale;
@@ -622,9 +675,6 @@ image_downsize(image_s * pdest, image_s * psrc, int32_t width, int32_t height)
 	int32_t half_square_width, half_square_height;
 	float round_width, round_height;
 
-	if( (pdest == NULL) || (psrc == NULL) )
-		return;
-
 	width_scale  = (float)psrc->width  / (float)width;
 	height_scale = (float)psrc->height / (float)height;
 
@@ -641,72 +691,80 @@ image_downsize(image_s * pdest, image_s * psrc, int32_t width, int32_t height)
 	else
 		round_height = 1.0;
 
-	for(vy = 0;vy < height; vy++)  
+	for(vx = 0;vx < width; vx++)
 	{
-		for(vx = 0;vx < width; vx++)
-		{
-			rx = vx * width_scale;
-			ry = vy * height_scale;
-			vcol = get_pix(psrc, (int32_t)rx, (int32_t)ry);
+		rx = vx * width_scale;
+		ry = vy * height_scale;
+		vcol = get_pix(psrc, (int32_t)rx, (int32_t)ry);
 
-			red = green = blue = alpha = 0.0;
+		red = green = blue = alpha = 0.0;
 
-			for(j=0;j<half_square_height<<1;j++)
+		for(j=0;j<half_square_height<<1;j++)
+		{
+			for(i=0;i<half_square_width<<1;i++)
 			{
-				for(i=0;i<half_square_width<<1;i++)
-				{
-					vcol = get_pix(psrc, ((int32_t)rx)-half_square_width+i,
-					                     ((int32_t)ry)-half_square_height+j);
+				vcol = get_pix(psrc, ((int32_t)rx)-half_square_width+i,
+				                     ((int32_t)ry)-half_square_height+j);
           
-					if(((j == 0) || (j == (half_square_height<<1)-1)) && 
-					   ((i == 0) || (i == (half_square_width<<1)-1)))
-					{
-						red   += round_width*round_height*(float)COL_RED  (vcol);
-						green += round_width*round_height*(float)COL_GREEN(vcol);
-						blue  += round_width*round_height*(float)COL_BLUE (vcol);
-						alpha += round_width*round_height*(float)COL_ALPHA(vcol);
-					}
-					else if((j == 0) || (j == (half_square_height<<1)-1))
-					{
-						red   += round_height*(float)COL_RED  (vcol);
-						green += round_height*(float)COL_GREEN(vcol);
-						blue  += round_height*(float)COL_BLUE (vcol);
-						alpha += round_height*(float)COL_ALPHA(vcol);
-					}
-					else if((i == 0) || (i == (half_square_width<<1)-1))
-					{
-						red   += round_width*(float)COL_RED  (vcol);
-						green += round_width*(float)COL_GREEN(vcol);
-						blue  += round_width*(float)COL_BLUE (vcol);
-						alpha += round_width*(float)COL_ALPHA(vcol);
-					}
-					else
-					{
-						red   += (float)COL_RED  (vcol);
-						green += (float)COL_GREEN(vcol);
-						blue  += (float)COL_BLUE (vcol);
-						alpha += (float)COL_ALPHA(vcol);
-					}
+				if(((j == 0) || (j == (half_square_height<<1)-1)) && 
+				   ((i == 0) || (i == (half_square_width<<1)-1)))
+				{
+					red   += round_width*round_height*(float)COL_RED  (vcol);
+					green += round_width*round_height*(float)COL_GREEN(vcol);
+					blue  += round_width*round_height*(float)COL_BLUE (vcol);
+					alpha += round_width*round_height*(float)COL_ALPHA(vcol);
+				}
+				else if((j == 0) || (j == (half_square_height<<1)-1))
+				{
+					red   += round_height*(float)COL_RED  (vcol);
+					green += round_height*(float)COL_GREEN(vcol);
+					blue  += round_height*(float)COL_BLUE (vcol);
+					alpha += round_height*(float)COL_ALPHA(vcol);
+				}
+				else if((i == 0) || (i == (half_square_width<<1)-1))
+				{
+					red   += round_width*(float)COL_RED  (vcol);
+					green += round_width*(float)COL_GREEN(vcol);
+					blue  += round_width*(float)COL_BLUE (vcol);
+					alpha += round_width*(float)COL_ALPHA(vcol);
+				}
+				else
+				{
+					red   += (float)COL_RED  (vcol);
+					green += (float)COL_GREEN(vcol);
+					blue  += (float)COL_BLUE (vcol);
+					alpha += (float)COL_ALPHA(vcol);
 				}
 			}
+		}
       
-			red   /= width_scale*height_scale;
-			green /= width_scale*height_scale;
-			blue  /= width_scale*height_scale;
-			alpha /= width_scale*height_scale;
+		red   /= width_scale*height_scale;
+		green /= width_scale*height_scale;
+		blue  /= width_scale*height_scale;
+		alpha /= width_scale*height_scale;
       
-			/* on sature les valeurs */
-			red   = (red   > 255.0)? 255.0 : ((red   < 0.0)? 0.0:red  );
-			green = (green > 255.0)? 255.0 : ((green < 0.0)? 0.0:green);
-			blue  = (blue  > 255.0)? 255.0 : ((blue  < 0.0)? 0.0:blue );
-			alpha = (alpha > 255.0)? 255.0 : ((alpha < 0.0)? 0.0:alpha);
+		/* on sature les valeurs */
+		red   = (red   > 255.0)? 255.0 : ((red   < 0.0)? 0.0:red  );
+		green = (green > 255.0)? 255.0 : ((green < 0.0)? 0.0:green);
+		blue  = (blue  > 255.0)? 255.0 : ((blue  < 0.0)? 0.0:blue );
+		alpha = (alpha > 255.0)? 255.0 : ((alpha < 0.0)? 0.0:alpha);
 #endif
-			put_pix_alpha_replace(pdest, vx, vy,
-					      COL_FULL((uint8_t)red, (uint8_t)green, (uint8_t)blue, (uint8_t)alpha));
-		}
+		row[vx] = COL_FULL((uint8_t)red, (uint8_t)green, (uint8_t)blue, (uint8_t)alpha);
 	}
 }
 
+void
+image_downsize(image_s * pdest, image_s * psrc, int32_t width, int32_t height)
+{
+	int32_t vy;
+
+	if((pdest == NULL) || (psrc == NULL))
+		return;
+
+	for(vy = 0; vy < height; vy++)
+		image_downsize_row(pdest->buf + (vy * pdest->width), psrc, vy, width, height);
+}
+
 image_s *
 image_resize(image_s * src_image, int32_t width, int32_t height)
 {
@@ -774,6 +832,123 @@ image_save_to_jpeg_buf(image_s * pimage, int * size)
 	return dst.buf;
 }
 
+/* Destination manager to hand fixed-size buffers to a callback as they
+ * fill up, so the encoded image never has to be held in memory */
+struct stream_dst_mgr {
+	struct jpeg_destination_mgr jdst;
+	JOCTET buf[JPEG_STREAM_BUFSIZE];
+	image_write_cb write;
+	void *ctx;
+	int error;
+	int total;
+};
+
+static void
+stream_dst_mgr_flush(struct stream_dst_mgr *dst, size_t len)
+{
+	if( len && !dst->error )
+	{
+		if( dst->write(dst->ctx, dst->buf, len) < 0 )
+			dst->error = 1;
+		else
+			dst->total += len;
+	}
+	dst->jdst.next_output_byte = dst->buf;
+	dst->jdst.free_in_buffer = sizeof(dst->buf);
+}
+
+static void
+stream_dst_mgr_init(j_compress_ptr cinfo)
+{
+	stream_dst_mgr_flush((void *)cinfo->dest, 0);
+}
+
+static boolean
+stream_dst_mgr_empty(j_compress_ptr cinfo)
+{
+	struct stream_dst_mgr *dst = (void *)cinfo->dest;
+
+	/* libjpeg expects the whole buffer to be emptied, whatever free_in_buffer says */
+	stream_dst_mgr_flush(dst, sizeof(dst->buf));
+
+	return TRUE;
+}
+
+static void
+stream_dst_mgr_term(j_compress_ptr cinfo)
+{
+	struct stream_dst_mgr *dst = (void *)cinfo->dest;
+
+	stream_dst_mgr_flush(dst, sizeof(dst->buf) - dst->jdst.free_in_buffer);
+}
+
+int
+image_save_to_jpeg_stream(image_s * psrc, int32_t width, int32_t height, image_write_cb write, void *ctx)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	struct stream_dst_mgr dst;
+	JSAMPROW row_pointer[1];
+	unsigned char *data;
+	pix *row;
+	int upsize;
+	int32_t x;
+
+	data = malloc(width * 3);
+	row = malloc(width * sizeof(pix));
+	if( !data || !row )
+	{
+		DPRINTF(E_WARN, L_METADATA, "malloc failed\n");
+		free(data);
+		free(row);
+		return -1;
+	}
+	upsize = (psrc->width < width) || (psrc->height < height);
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	dst.jdst.init_destination = stream_dst_mgr_init;
+	dst.jdst.empty_output_buffer = stream_dst_mgr_empty;
+	dst.jdst.term_destination = stream_dst_mgr_term;
+	dst.write = write;
+	dst.ctx = ctx;
+	dst.error = 0;
+	dst.total = 0;
+	cinfo.dest = (void *)&dst;
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, JPEG_QUALITY, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	/* Resize one row at a time, right before it is encoded */
+	while( cinfo.next_scanline < cinfo.image_height && !dst.error )
+	{
+		if( upsize )
+			image_upsize_row(row, psrc, cinfo.next_scanline, width, height);
+		else
+			image_downsize_row(row, psrc, cinfo.next_scanline, width, height);
+		for(x = 0; x < width; x++)
+		{
+			data[x * 3]     = COL_RED(row[x]);
+			data[x * 3 + 1] = COL_GREEN(row[x]);
+			data[x * 3 + 2] = COL_BLUE(row[x]);
+		}
+		row_pointer[0] = data;
+		jpeg_write_scanlines(&cinfo, row_pointer, 1);
+	}
+	if( dst.error )
+		jpeg_abort_compress(&cinfo);
+	else
+		jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	free(data);
+	free(row);
+
+	return dst.error ? -1 : dst.total;
+}
+
 char *
 image_save_to_jpeg_file(image_s * pimage, char * path)
 {
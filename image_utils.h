@@ -21,6 +21,8 @@
  * You should have received a copy of the GNU General Public License
  * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <stddef.h>
+#include <sys/types.h>
 #include <inttypes.h>
 
 #define ROTATE_NONE 0x0
@@ -42,6 +44,9 @@ image_free(image_s *pimage);
 int
 image_get_jpeg_date_xmp(const char * path, char ** date);
 
+off_t
+image_get_jpeg_exif_thumb_offset(const char * path, const unsigned char * thumb, int size);
+
 image_s *
 image_new_from_jpeg(const char *path, int is_file, const uint8_t *ptr, int size, int scale, int resize);
 
@@ -51,5 +56,14 @@ image_resize(image_s * src_image, int32_t width, int32_t height);
 unsigned char *
 image_save_to_jpeg_buf(image_s * pimage, int * size);
 
+/* Called with each block of encoded data; return < 0 to stop encoding */
+typedef int (*image_write_cb)(void *ctx, const unsigned char *data, size_t len);
+
+/* Resize pimage to width x height and encode it as JPEG, one row at a
+ * time, passing the output to write_cb as it is produced.  Returns the
+ * number of bytes written, or -1 on error. */
+int
+image_save_to_jpeg_stream(image_s * pimage, int32_t width, int32_t height, image_write_cb write_cb, void *ctx);
+
 char *
 image_save_to_jpeg_file(image_s * pimage, char * path);
@@ -585,7 +585,7 @@ inotify_remove_file(const char * path)
 					         atoi(strrchr(result[i], '$') + 1));
 				}
 
-				children = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s'", result[i]);
+				children = sql_get_int_field(db, "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = '%s'", result[i]);
 				if( children < 0 )
 					continue;
 				if( children < 2 )
@@ -595,7 +595,7 @@ inotify_remove_file(const char * path)
 					ptr = strrchr(result[i], '$');
 					if( ptr )
 						*ptr = '\0';
-					if( sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s'", result[i]) == 0 )
+					if( sql_get_int_field(db, "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = '%s'", result[i]) == 0 )
 					{
 						sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s'", result[i]);
 					}
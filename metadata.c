@@ -429,6 +429,8 @@ GetImageMetadata(const char *path, char *name)
 	ExifEntry *e = NULL;
 	ExifLoader *l;
 	int width=0, height=0, thumb=0;
+	off_t thumb_offset = 0;
+	int thumb_size = 0;
 	char make[32], model[64] = {'\0'};
 	char b[1024];
 	struct stat file;
@@ -529,6 +531,15 @@ GetImageMetadata(const char *path, char *name)
 		}
 		else
 			thumb = 1;
+		/* Remember where the thumbnail is, so it can be sent without parsing EXIF again */
+		if( thumb )
+		{
+			thumb_offset = image_get_jpeg_exif_thumb_offset(path, ed->data, ed->size);
+			if( thumb_offset > 0 )
+				thumb_size = ed->size;
+			else
+				thumb = 0;
+		}
 	}
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * thumbnail: %d\n", thumb);
 
@@ -569,11 +580,12 @@ no_exifdata:
 
 	ret = sql_exec(db, "INSERT into DETAILS"
 	                   " (PATH, TITLE, SIZE, TIMESTAMP, DATE, RESOLUTION,"
-	                    " ROTATION, THUMBNAIL, CREATOR, DLNA_PN, MIME) "
+	                    " ROTATION, THUMBNAIL, THUMB_OFFSET, THUMB_SIZE, CREATOR, DLNA_PN, MIME) "
 	                   "VALUES"
-	                   " (%Q, '%q', %lld, %lld, %Q, %Q, %u, %d, %Q, %Q, %Q);",
+	                   " (%Q, '%q', %lld, %lld, %Q, %Q, %u, %d, %lld, %d, %Q, %Q, %Q);",
 	                   path, name, (long long)file.st_size, (long long)file.st_mtime, m.date,
-	                   m.resolution, m.rotation, thumb, m.creator, dlna_metadata.dlna_pn, dlna_metadata.mime);
+	                   m.resolution, m.rotation, thumb, (long long)thumb_offset, thumb_size,
+	                   m.creator, dlna_metadata.dlna_pn, dlna_metadata.mime);
 	if( ret != SQLITE_OK )
 	{
 		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
@@ -80,6 +80,7 @@
 #include "upnpglobalvars.h"
 #include "sql.h"
 #include "upnphttp.h"
+#include "bandwidth.h"
 #include "upnpdescgen.h"
 #include "minidlnapath.h"
 #include "getifaddr.h"
@@ -96,6 +97,10 @@
 #include "tivo_beacon.h"
 #include "tivo_utils.h"
 #include "clients.h"
+#include "uring.h"
+#include "image_cache.h"
+
+LIST_HEAD(httplisthead, upnphttp);
 
 #if SQLITE_VERSION_NUMBER < 3005001
 # warning "Your SQLite3 library appears to be too old!  Please use 3.5.1 or newer."
@@ -111,9 +116,6 @@ OpenAndConfHTTPSocket(unsigned short port)
 	int i = 1;
 	struct sockaddr_in listenname;
 
-	/* Initialize client type cache */
-	memset(&clients, 0, sizeof(struct client_cache_s));
-
 	s = socket(PF_INET, SOCK_STREAM, 0);
 	if (s < 0)
 	{
@@ -123,6 +125,9 @@ OpenAndConfHTTPSocket(unsigned short port)
 
 	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i)) < 0)
 		DPRINTF(E_WARN, L_GENERAL, "setsockopt(http, SO_REUSEADDR): %s\n", strerror(errno));
+	/* We drain the accept queue until it would block */
+	if (fcntl(s, F_SETFL, O_NONBLOCK) < 0)
+		DPRINTF(E_WARN, L_GENERAL, "fcntl(http, O_NONBLOCK): %s\n", strerror(errno));
 
 	memset(&listenname, 0, sizeof(struct sockaddr_in));
 	listenname.sin_family = AF_INET;
@@ -136,7 +141,8 @@ OpenAndConfHTTPSocket(unsigned short port)
 		return -1;
 	}
 
-	if (listen(s, 6) < 0)
+	/* Renderers open bursts of connections for thumbnails and art */
+	if (listen(s, SOMAXCONN) < 0)
 	{
 		DPRINTF(E_ERROR, L_GENERAL, "listen(http): %s\n", strerror(errno));
 		close(s);
@@ -146,6 +152,58 @@ OpenAndConfHTTPSocket(unsigned short port)
 	return s;
 }
 
+/* Accept every connection waiting on a listening socket.  The new
+ * sockets are non-blocking while the request is read, and are not
+ * inherited by transcoders. */
+static void
+AcceptHTTPConnections(int shttpl, struct httplisthead *head)
+{
+	int shttp;
+	socklen_t clientnamelen;
+	struct sockaddr_in clientname;
+	struct upnphttp *tmp;
+
+	for (;;)
+	{
+		clientnamelen = sizeof(struct sockaddr_in);
+#ifdef HAVE_ACCEPT4
+		shttp = accept4(shttpl, (struct sockaddr *)&clientname, &clientnamelen,
+		                SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+		shttp = accept(shttpl, (struct sockaddr *)&clientname, &clientnamelen);
+		if (shttp >= 0)
+		{
+			fcntl(shttp, F_SETFL, O_NONBLOCK);
+			fcntl(shttp, F_SETFD, FD_CLOEXEC);
+		}
+#endif
+		if (shttp < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				DPRINTF(E_ERROR, L_GENERAL, "accept(http): %s\n", strerror(errno));
+			break;
+		}
+		DPRINTF(E_DEBUG, L_GENERAL, "HTTP connection from %s:%d\n",
+			inet_ntoa(clientname.sin_addr),
+			ntohs(clientname.sin_port) );
+		/* Create a new upnphttp object and add it to
+		 * the active upnphttp object list */
+		tmp = New_upnphttp(shttp);
+		if (tmp)
+		{
+			tmp->clientaddr = clientname.sin_addr;
+			LIST_INSERT_HEAD(head, tmp, entries);
+		}
+		else
+		{
+			DPRINTF(E_ERROR, L_GENERAL, "New_upnphttp() failed\n");
+			close(shttp);
+		}
+	}
+}
+
 /* Handler for the SIGTERM signal (kill)
  * SIGINT is also handled */
 static void
@@ -344,6 +402,7 @@ static int
 open_db(sqlite3 **sq3)
 {
 	char path[PATH_MAX];
+	char *mode;
 	int new_db = 0;
 
 	snprintf(path, sizeof(path), "%s/files.db", db_path);
@@ -359,7 +418,19 @@ open_db(sqlite3 **sq3)
 		*sq3 = db;
 	sqlite3_busy_timeout(db, 5000);
 	sql_exec(db, "pragma page_size = 4096");
-	sql_exec(db, "pragma journal_mode = OFF");
+	/* Readers can only run alongside the writer in WAL mode */
+	if (runtime_vars.db_readers > 0)
+	{
+		mode = sql_get_text_field(db, "pragma journal_mode = WAL");
+		if (!mode || strcmp(mode, "wal") != 0)
+		{
+			DPRINTF(E_WARN, L_GENERAL, "Database can't use WAL mode; serving requests from one connection\n");
+			runtime_vars.db_readers = 0;
+		}
+		sqlite3_free(mode);
+	}
+	if (runtime_vars.db_readers == 0)
+		sql_exec(db, "pragma journal_mode = OFF");
 	sql_exec(db, "pragma synchronous = OFF;");
 	sql_exec(db, "pragma default_cache_size = 8192;");
 
@@ -408,6 +479,13 @@ check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 			}
 		}
 		sqlite3_free_table(result);
+		/* An index made with FTS5 can't be kept up to date without it */
+		if (sql_get_int_field(db, "SELECT count(*) from sqlite_master where name = 'DETAILS_FTS'") > 0 &&
+		    sqlite3_exec(db, "SELECT 1 from DETAILS_FTS limit 0", NULL, NULL, NULL) != SQLITE_OK)
+		{
+			ret = 3;
+			goto rescan;
+		}
 	}
 
 	ret = db_upgrade(db);
@@ -420,12 +498,15 @@ rescan:
 			DPRINTF(E_WARN, L_GENERAL, "New media_dir detected; rescanning...\n");
 		else if (ret == 2)
 			DPRINTF(E_WARN, L_GENERAL, "Removed media_dir detected; rescanning...\n");
+		else if (ret == 3)
+			DPRINTF(E_WARN, L_GENERAL, "Search index is unusable with this SQLite; rescanning...\n");
 		else
 			DPRINTF(E_WARN, L_GENERAL, "Database version mismatch (%d=>%d); need to recreate...\n",
 				ret, DB_VERSION);
 		sqlite3_close(db);
 
-		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/files.db-wal %s/files.db-shm %s/art_cache %s/" IMAGE_CACHE_DIR,
+		         db_path, db_path, db_path, db_path, db_path);
 		if (system(cmd) != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache!  Exiting...\n");
 
@@ -453,6 +534,41 @@ rescan:
 		start_scanner();
 #endif
 	}
+	else
+	{
+		/* With the journal off, a crash can leave the child counts
+		 * out of step with the objects */
+		rebuild_child_counts(db);
+		/* Databases from before the search index get one now */
+		create_search_index();
+	}
+}
+
+/* Hands containers whose UPDATE_ID moved past last to the event code,
+ * whichever process or thread changed them, and returns the newest
+ * UPDATE_ID seen */
+static int64_t
+check_container_updates(int64_t last)
+{
+	sqlite3 *conn = sql_checkout();
+	sqlite3_stmt *stmt;
+
+	stmt = sql_prepare_cached(conn, "SELECT OBJECT_ID, UPDATE_ID from OBJECTS"
+	                                " where UPDATE_ID > ? order by UPDATE_ID");
+	if (stmt)
+	{
+		sqlite3_bind_int64(stmt, 1, last);
+		while (sql_step(stmt) == SQLITE_ROW)
+		{
+			last = sqlite3_column_int64(stmt, 1);
+			upnp_event_container_update((const char *)sqlite3_column_text(stmt, 0),
+			                            (uint32_t)last);
+		}
+		sql_release_cached(stmt);
+	}
+	sql_checkin(conn);
+
+	return last;
 }
 
 static int
@@ -527,6 +643,57 @@ static int strtobool(const char *str)
 		(atoi(str) == 1));
 }
 
+/* socket_profile=<mode>:<setting>=<value>[,<setting>=<value>...] */
+static void
+parse_socket_profile(const char *value)
+{
+	static const char * const names[SOCK_PROFILES] = {
+		[SOCK_PROFILE_BACKGROUND] = "background",
+		[SOCK_PROFILE_INTERACTIVE] = "interactive",
+		[SOCK_PROFILE_STREAMING] = "streaming",
+		[SOCK_PROFILE_SOAP] = "soap"
+	};
+	struct sock_profile *p = NULL;
+	char *buf, *item, *key, *val, *saveptr;
+	int i;
+
+	buf = strdup(value);
+	item = strchr(buf, ':');
+	if (item)
+	{
+		*item++ = '\0';
+		for (i = 0; i < SOCK_PROFILES; i++)
+		{
+			if (strcasecmp(buf, names[i]) == 0)
+				p = &sock_profiles[i];
+		}
+	}
+	if (!p)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Socket profile not understood [%s]\n", value);
+		free(buf);
+		return;
+	}
+	for (item = strtok_r(item, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr))
+	{
+		val = item;
+		key = strsep(&val, "=");
+		if (!val)
+			DPRINTF(E_ERROR, L_GENERAL, "Socket profile setting needs a value [%s]\n", key);
+		else if (strcasecmp(key, "sndbuf") == 0)
+			p->sndbuf = atoi(val) * 1024;
+		else if (strcasecmp(key, "notsent_lowat") == 0)
+			p->notsent_lowat = atoi(val) * 1024;
+		else if (strcasecmp(key, "cork") == 0)
+			p->cork = strtobool(val);
+		else if (strcasecmp(key, "nodelay") == 0)
+			p->nodelay = strtobool(val);
+		else
+			DPRINTF(E_ERROR, L_GENERAL, "Unknown socket profile setting [%s]\n", key);
+	}
+	free(buf);
+}
+
 static void init_nls(void)
 {
 #ifdef ENABLE_NLS
@@ -593,6 +760,16 @@ init(int argc, char **argv)
 	runtime_vars.port = 8200;
 	runtime_vars.notify_interval = 895;	/* seconds between SSDP announces */
 	runtime_vars.max_connections = 50;
+	runtime_vars.readahead_secs = 10;
+	runtime_vars.resize_cache_mb = 64;
+	runtime_vars.pacing_pct = 0;
+	runtime_vars.pacing_burst_secs = 20;
+	runtime_vars.uplink_kbps = 0;
+	runtime_vars.header_timeout = 15;
+	runtime_vars.body_timeout = 30;
+	runtime_vars.send_timeout = 60;
+	runtime_vars.db_readers = 4;
+	runtime_vars.resp_cache_kb = 4096;
 	runtime_vars.root_container = NULL;
 	runtime_vars.ifaces[0] = NULL;
 
@@ -826,6 +1003,50 @@ init(int argc, char **argv)
 			specific_client = transcode_getclient(client_types, ary_options[i].value, &string);
 			client_types[specific_client].transcode_info->image_transcoder = strdup(string);
 			break;
+		case READAHEAD_SECONDS:
+			runtime_vars.readahead_secs = atoi(ary_options[i].value);
+			break;
+		case DROP_SENT_PAGES:
+			if (strtobool(ary_options[i].value))
+				SETFLAG(DROP_SENT_PAGES_MASK);
+			break;
+		case RESIZE_CACHE_SIZE:
+			runtime_vars.resize_cache_mb = atoi(ary_options[i].value);
+			break;
+		case STREAM_PACING:
+			runtime_vars.pacing_pct = (int)(strtod(ary_options[i].value, NULL) * 100);
+			if (runtime_vars.pacing_pct && runtime_vars.pacing_pct < 100)
+			{
+				DPRINTF(E_WARN, L_GENERAL, "stream_pacing below 1 would starve playback, using 1\n");
+				runtime_vars.pacing_pct = 100;
+			}
+			break;
+		case PACING_BURST_SECONDS:
+			runtime_vars.pacing_burst_secs = atoi(ary_options[i].value);
+			break;
+		case UPLINK_LIMIT:
+			runtime_vars.uplink_kbps = (int)(strtod(ary_options[i].value, NULL) * 1000);
+			break;
+		case SOCKET_PROFILE:
+			parse_socket_profile(ary_options[i].value);
+			break;
+		case HEADER_TIMEOUT:
+			runtime_vars.header_timeout = atoi(ary_options[i].value);
+			break;
+		case BODY_TIMEOUT:
+			runtime_vars.body_timeout = atoi(ary_options[i].value);
+			break;
+		case SEND_TIMEOUT:
+			runtime_vars.send_timeout = atoi(ary_options[i].value);
+			break;
+		case DB_READERS:
+			runtime_vars.db_readers = atoi(ary_options[i].value);
+			runtime_vars.db_readers = MAX(runtime_vars.db_readers, 0);
+			runtime_vars.db_readers = MIN(runtime_vars.db_readers, MAX_DB_READERS);
+			break;
+		case RESPONSE_CACHE_SIZE:
+			runtime_vars.resp_cache_kb = MAX(atoi(ary_options[i].value), 0);
+			break;
 		default:
 			DPRINTF(E_ERROR, L_GENERAL, "Unknown option in file %s\n",
 				optionsfile);
@@ -926,7 +1147,8 @@ init(int argc, char **argv)
 			runtime_vars.port = -1; // triggers help display
 			break;
 		case 'R':
-			snprintf(buf, sizeof(buf), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+			snprintf(buf, sizeof(buf), "rm -rf %s/files.db %s/files.db-wal %s/files.db-shm %s/art_cache %s/" IMAGE_CACHE_DIR,
+			         db_path, db_path, db_path, db_path, db_path);
 			if (system(buf) != 0)
 				DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache. EXITING\n");
 			break;
@@ -1089,7 +1311,7 @@ main(int argc, char **argv)
 	int ret, i;
 	int shttpl = -1;
 	int smonitor = -1;
-	LIST_HEAD(httplisthead, upnphttp) upnphttphead;
+	struct httplisthead upnphttphead;
 	struct upnphttp * e = 0;
 	struct upnphttp * next;
 	fd_set readset;	/* for select() */
@@ -1098,6 +1320,7 @@ main(int argc, char **argv)
 	time_t lastupdatetime = 0;
 	int max_fd = -1;
 	int last_changecnt = 0;
+	int64_t last_container_update;
 	pid_t scanner_pid = 0;
 	pthread_t inotify_thread = 0;
 #ifdef TIVO_SUPPORT
@@ -1121,6 +1344,10 @@ main(int argc, char **argv)
 		DPRINTF(E_WARN, L_GENERAL, "SQLite library is old.  Please use version 3.5.1 or newer.\n");
 	}
 
+	uring_probe();
+	InitStreamStats_upnphttp();
+	bw_init();
+
 	LIST_INIT(&upnphttphead);
 
 	ret = open_db(NULL);
@@ -1131,6 +1358,15 @@ main(int argc, char **argv)
 			ret = -1;
 	}
 	check_db(db, ret, &scanner_pid);
+	image_cache_init();
+	if (runtime_vars.db_readers > 0)
+	{
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/files.db", db_path);
+		sql_pool_open(path, runtime_vars.db_readers);
+	}
+	last_container_update = sql_get_int64_field(db, "SELECT max(UPDATE_ID) from OBJECTS");
 #ifdef HAVE_INOTIFY
 	if( GETFLAG(INOTIFY_MASK) )
 	{
@@ -1151,6 +1387,7 @@ main(int argc, char **argv)
 			DPRINTF(E_FATAL, L_GENERAL, "Failed to connect to MiniSSDPd. EXITING");
 	}
 	/* open socket for HTTP connections. */
+	memset(&clients, 0, sizeof(struct client_cache_s));
 	shttpl = OpenAndConfHTTPSocket(runtime_vars.port);
 	if (shttpl < 0)
 		DPRINTF(E_FATAL, L_GENERAL, "Failed to open socket for HTTP. EXITING\n");
@@ -1161,7 +1398,7 @@ main(int argc, char **argv)
 	{
 		DPRINTF(E_WARN, L_GENERAL, "TiVo support is enabled.\n");
 		/* Add TiVo-specific randomize function to sqlite */
-		ret = sqlite3_create_function(db, "tivorandom", 1, SQLITE_UTF8, NULL, &TiVoRandomSeedFunc, NULL, NULL);
+		ret = sql_create_function("tivorandom", 1, &TiVoRandomSeedFunc);
 		if (ret != SQLITE_OK)
 			DPRINTF(E_ERROR, L_TIVO, "ERROR: Failed to add sqlite randomize function for TiVo!\n");
 		/* open socket for sending Tivo notifications */
@@ -1176,6 +1413,7 @@ main(int argc, char **argv)
 #endif
 
 	reload_ifaces(0);
+	BuildDescCache_upnphttp();
 	lastnotifytime.tv_sec = time(NULL) + runtime_vars.notify_interval;
 
 	/* main loop */
@@ -1244,8 +1482,15 @@ main(int argc, char **argv)
 		{
 			if (!scanner_pid || kill(scanner_pid, 0) != 0)
 			{
+				/* The last stretch of the scan happened in another
+				 * process, so the periodic check below would never see
+				 * it; announce it now */
 				scanning = 0;
 				updateID++;
+				last_changecnt = sqlite3_total_changes(db);
+				last_container_update = check_container_updates(last_container_update);
+				upnp_event_var_change_notify(EContentDirectory);
+				lastupdatetime = timeofday.tv_sec;
 			}
 		}
 
@@ -1279,6 +1524,13 @@ main(int argc, char **argv)
 		i = 0;	/* active HTTP connections count */
 		for (e = upnphttphead.lh_first; e != NULL; e = e->entries.le_next)
 		{
+			/* Wake up in time to enforce the next deadline */
+			ret = CheckDeadline_upnphttp(e);
+			if (ret > 0 && ret < timeout.tv_sec)
+			{
+				timeout.tv_sec = ret;
+				timeout.tv_usec = 0;
+			}
 			if ((e->socket >= 0) && (e->state <= 2))
 			{
 				FD_SET(e->socket, &readset);
@@ -1323,6 +1575,7 @@ main(int argc, char **argv)
 			{
 				updateID++;
 				last_changecnt = sqlite3_total_changes(db);
+				last_container_update = check_container_updates(last_container_update);
 				upnp_event_var_change_notify(EContentDirectory);
 				lastupdatetime = timeofday.tv_sec;
 			}
@@ -1335,40 +1588,7 @@ main(int argc, char **argv)
 		}
 		/* process incoming HTTP connections */
 		if (shttpl >= 0 && FD_ISSET(shttpl, &readset))
-		{
-			int shttp;
-			socklen_t clientnamelen;
-			struct sockaddr_in clientname;
-			clientnamelen = sizeof(struct sockaddr_in);
-			shttp = accept(shttpl, (struct sockaddr *)&clientname, &clientnamelen);
-			if (shttp<0)
-			{
-				DPRINTF(E_ERROR, L_GENERAL, "accept(http): %s\n", strerror(errno));
-			}
-			else
-			{
-				struct upnphttp * tmp = 0;
-				DPRINTF(E_DEBUG, L_GENERAL, "HTTP connection from %s:%d\n",
-					inet_ntoa(clientname.sin_addr),
-					ntohs(clientname.sin_port) );
-				/*if (fcntl(shttp, F_SETFL, O_NONBLOCK) < 0) {
-					DPRINTF(E_ERROR, L_GENERAL, "fcntl F_SETFL, O_NONBLOCK\n");
-				}*/
-				/* Create a new upnphttp object and add it to
-				 * the active upnphttp object list */
-				tmp = New_upnphttp(shttp);
-				if (tmp)
-				{
-					tmp->clientaddr = clientname.sin_addr;
-					LIST_INSERT_HEAD(&upnphttphead, tmp, entries);
-				}
-				else
-				{
-					DPRINTF(E_ERROR, L_GENERAL, "New_upnphttp() failed\n");
-					close(shttp);
-				}
-			}
-		}
+			AcceptHTTPConnections(shttpl, &upnphttphead);
 		/* delete finished HTTP connections */
 		for (e = upnphttphead.lh_first; e != NULL; e = next)
 		{
@@ -1387,11 +1607,8 @@ shutdown:
 		kill(scanner_pid, SIGKILL);
 
 	/* remove files that that could have been left after transcoding */
-	if ( transcode_tempfile )
-	{
-		unlink(transcode_tempfile);
-		transcode_tempfile = NULL;
-	}
+	FreeFileCache_upnphttp();
+	FreeDescCache_upnphttp();
 
 	/* kill other child processes */
 	process_reap_children();
@@ -1423,6 +1640,8 @@ shutdown:
 		pthread_join(inotify_thread, NULL);
 
 	sql_exec(db, "UPDATE SETTINGS set VALUE = '%u' where KEY = 'UPDATE_ID'", updateID);
+	sql_pool_close();
+	sql_finalize_cached(db);
 	sqlite3_close(db);
 
 	upnpevents_removeSubscribers();
@@ -35,6 +35,7 @@
 #include <fcntl.h>
 
 #define MAX_LAN_ADDR 4
+#define MAX_DB_READERS 16
 /* structure for storing lan addresses
  * with ascii representation and mask */
 struct lan_addr_s {
@@ -49,10 +50,37 @@ struct runtime_vars_s {
 	int port;	/* HTTP Port */
 	int notify_interval;	/* seconds between SSDP announces */
 	int max_connections;	/* max number of simultaneous conenctions */
+	int readahead_secs;	/* seconds of media to keep hinted ahead of a stream */
+	int resize_cache_mb;	/* size budget of the resized image cache, in MB */
+	int pacing_pct;		/* stream pacing rate, in percent of the bitrate; 0 = off */
+	int pacing_burst_secs;	/* seconds of media sent unpaced at the start of a stream */
+	int uplink_kbps;	/* total streaming bandwidth limit, in kbit/s; 0 = none */
+	int header_timeout;	/* seconds to receive request headers; 0 = no limit */
+	int body_timeout;	/* seconds to receive a request body; 0 = no limit */
+	int send_timeout;	/* seconds a client may take no data; 0 = no limit */
+	int db_readers;		/* read-only database connections; 0 = share the writer */
+	int resp_cache_kb;	/* Browse/Search response cache budget, in KB; 0 = off */
 	const char *root_container;	/* root ObjectID (instead of "0") */
 	const char *ifaces[MAX_LAN_ADDR];	/* list of configured network interfaces */
 };
 
+/* Socket options for each kind of HTTP response.  The file transfer
+ * profiles are in the same order as enum bw_class. */
+enum sock_profile_type {
+	SOCK_PROFILE_BACKGROUND,
+	SOCK_PROFILE_INTERACTIVE,
+	SOCK_PROFILE_STREAMING,
+	SOCK_PROFILE_SOAP,
+	SOCK_PROFILES
+};
+
+struct sock_profile {
+	int sndbuf;		/* SO_SNDBUF in bytes, 0 = kernel default */
+	int notsent_lowat;	/* TCP_NOTSENT_LOWAT in bytes, 0 = kernel default */
+	int cork;		/* TCP_CORK the header and body into full segments */
+	int nodelay;		/* TCP_NODELAY */
+};
+
 struct string_s {
 	char *data; // ptr to start of memory area
 	size_t off;
@@ -71,7 +71,19 @@ static const struct {
 	{ TRANSCODE_VIDEO_CODECS, "transcode_video_codecs"},
 	{ TRANSCODE_VIDEOTRANSCODER, "transcode_video_transcoder"},
 	{ TRANSCODE_IMAGE, "transcode_image"},
-	{ TRANSCODE_IMAGETRANSCODER, "transcode_image_transcoder"}
+	{ TRANSCODE_IMAGETRANSCODER, "transcode_image_transcoder"},
+	{ READAHEAD_SECONDS, "readahead_seconds" },
+	{ DROP_SENT_PAGES, "drop_sent_pages" },
+	{ RESIZE_CACHE_SIZE, "resize_cache_size" },
+	{ STREAM_PACING, "stream_pacing" },
+	{ PACING_BURST_SECONDS, "pacing_burst_seconds" },
+	{ UPLINK_LIMIT, "uplink_limit" },
+	{ SOCKET_PROFILE, "socket_profile" },
+	{ HEADER_TIMEOUT, "header_timeout" },
+	{ BODY_TIMEOUT, "body_timeout" },
+	{ SEND_TIMEOUT, "send_timeout" },
+	{ DB_READERS, "db_readers" },
+	{ RESPONSE_CACHE_SIZE, "response_cache_size" }
 };
 
 int
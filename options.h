@@ -64,7 +64,19 @@ enum upnpconfigoptions {
 	TRANSCODE_VIDEO_CODECS,		/* video codecs that needs to be transcoded */
 	TRANSCODE_VIDEOTRANSCODER,	/* video transcoder */
 	TRANSCODE_IMAGE,			/* image files that needs to be transcoded */
-	TRANSCODE_IMAGETRANSCODER	/* image transcoder */
+	TRANSCODE_IMAGETRANSCODER,	/* image transcoder */
+	READAHEAD_SECONDS,		/* seconds of media to hint ahead of a stream */
+	DROP_SENT_PAGES,		/* drop streamed file pages from the page cache once sent */
+	RESIZE_CACHE_SIZE,		/* size budget of the resized image cache, in MB */
+	STREAM_PACING,			/* pace streams at this multiple of their bitrate */
+	PACING_BURST_SECONDS,		/* seconds of media sent unpaced at the start of a stream */
+	UPLINK_LIMIT,			/* total bandwidth available for serving files, in Mbit/s */
+	SOCKET_PROFILE,			/* socket options for a transfer mode */
+	HEADER_TIMEOUT,			/* seconds allowed to receive request headers */
+	BODY_TIMEOUT,			/* seconds allowed to receive a request body */
+	SEND_TIMEOUT,			/* seconds a client may go without taking data */
+	DB_READERS,			/* number of read-only database connections */
+	RESPONSE_CACHE_SIZE		/* memory budget of the Browse/Search response cache, in KB */
 };
 
 /* readoptionsfile()
@@ -40,6 +40,7 @@
 
 #include "upnpglobalvars.h"
 #include "process.h"
+#include "bandwidth.h"
 #include "config.h"
 #include "log.h"
 
@@ -76,6 +77,7 @@ remove_process_info(pid_t pid)
 		if (child->pid != pid)
 			continue;
 		child->pid = 0;
+		bw_reap(pid);
 		if (child->client)
 			child->client->connections--;
 		break;
@@ -549,9 +549,15 @@ CreateDatabase(void)
 			0 };
 
 	ret = sql_exec(db, create_objectTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = sql_exec(db, create_childCountTriggers_sqlite);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, create_detailTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = sql_exec(db, create_sortKeyTriggers_sqlite);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, create_albumArtTable_sqlite);
@@ -604,6 +610,7 @@ CreateDatabase(void)
 	sql_exec(db, "create INDEX IDX_OBJECTS_PARENT_ID ON OBJECTS(PARENT_ID);");
 	sql_exec(db, "create INDEX IDX_OBJECTS_DETAIL_ID ON OBJECTS(DETAIL_ID);");
 	sql_exec(db, "create INDEX IDX_OBJECTS_CLASS ON OBJECTS(CLASS);");
+	sql_exec(db, "create INDEX IDX_OBJECTS_UPDATE_ID ON OBJECTS(UPDATE_ID);");
 	sql_exec(db, "create INDEX IDX_DETAILS_PATH ON DETAILS(PATH);");
 	sql_exec(db, "create INDEX IDX_DETAILS_ID ON DETAILS(ID);");
 	sql_exec(db, "create INDEX IDX_ALBUM_ART ON ALBUM_ART(ID);");
@@ -615,6 +622,27 @@ sql_failed:
 	return (ret != SQLITE_OK);
 }
 
+void
+create_search_index(void)
+{
+	char *errMsg = NULL;
+
+	if( sql_get_int_field(db, "SELECT count(*) from sqlite_master where name = 'DETAILS_FTS'") != 0 )
+		return;
+	/* Needs SQLite 3.34 or later built with FTS5 */
+	if( sqlite3_exec(db, create_detailsFts_sqlite, NULL, NULL, &errMsg) != SQLITE_OK )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "Not indexing for Search [%s]\n", errMsg ? errMsg : "");
+		sqlite3_free(errMsg);
+		sql_exec(db, "DROP TRIGGER if exists DETAILS_FTS_ADD;"
+		             "DROP TRIGGER if exists DETAILS_FTS_DEL;"
+		             "DROP TRIGGER if exists DETAILS_FTS_UPD;"
+		             "DROP TABLE if exists DETAILS_FTS");
+		return;
+	}
+	DPRINTF(E_INFO, L_SCANNER, "Search index built\n");
+}
+
 static inline int
 filter_hidden(scan_filter *d)
 {
@@ -874,6 +902,9 @@ start_scanner()
 	 * This index is very useful for large libraries used with an XBox360 (or any
 	 * client that uses UPnPSearch on large containers). */
 	sql_exec(db, "create INDEX IDX_SEARCH_OPT ON OBJECTS(OBJECT_ID, CLASS, DETAIL_ID);");
+	create_sort_indexes();
+	/* Same for the full-text index, which is far quicker to build in one go */
+	create_search_index();
 
 	if( GETFLAG(NO_PLAYLIST_MASK) )
 	{
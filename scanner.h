@@ -80,6 +80,9 @@ insert_file(char *name, const char *path, const char *parentID, int object, medi
 int
 CreateDatabase(void);
 
+void
+create_search_index(void);
+
 void
 start_scanner();
 
@@ -29,7 +29,54 @@ char create_objectTable_sqlite[] = "CREATE TABLE OBJECTS ("
 					"REF_ID TEXT DEFAULT NULL, "
 					"CLASS TEXT NOT NULL, "
 					"DETAIL_ID INTEGER DEFAULT NULL, "
-                                        "NAME TEXT DEFAULT NULL);";
+                                        "NAME TEXT DEFAULT NULL, "
+					"CHILD_COUNT INTEGER DEFAULT 0, "
+					"UPDATE_ID INTEGER DEFAULT 0, "
+					"SORT_TITLE TEXT COLLATE NOCASE, "
+					"SORT_DATE DATE, "
+					"SORT_ALBUM TEXT COLLATE NOCASE, "
+					"SORT_DISC INTEGER, "
+					"SORT_TRACK INTEGER);";
+
+/* Keep each container's CHILD_COUNT in step with whatever adds or
+ * removes objects: the scanner, inotify and the playlist code.  Each
+ * change also gives the container the next UPDATE_ID, which the main
+ * process picks up to event ContainerUpdateIDs. */
+#define NEXT_UPDATE_ID "UPDATE_ID = (SELECT max(UPDATE_ID) from OBJECTS) + 1"
+char create_childCountTriggers_sqlite[] = "CREATE TRIGGER OBJECTS_ADD_CHILD AFTER INSERT ON OBJECTS BEGIN "
+					"UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT + 1, " NEXT_UPDATE_ID
+					" where OBJECT_ID = new.PARENT_ID; "
+					"END; "
+					"CREATE TRIGGER OBJECTS_DEL_CHILD AFTER DELETE ON OBJECTS BEGIN "
+					"UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT - 1, " NEXT_UPDATE_ID
+					" where OBJECT_ID = old.PARENT_ID; "
+					"END; "
+					"CREATE TRIGGER OBJECTS_MOVE_CHILD AFTER UPDATE OF PARENT_ID ON OBJECTS "
+					"WHEN old.PARENT_ID != new.PARENT_ID BEGIN "
+					"UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT - 1, " NEXT_UPDATE_ID
+					" where OBJECT_ID = old.PARENT_ID; "
+					"UPDATE OBJECTS set CHILD_COUNT = CHILD_COUNT + 1, " NEXT_UPDATE_ID
+					" where OBJECT_ID = new.PARENT_ID; "
+					"END;";
+
+/* Copy the DETAILS that clients sort on into each object that uses
+ * them, where the sort indexes on OBJECTS can hold them alongside
+ * PARENT_ID.  See sort_capabilities in containers.c. */
+#define SORT_KEYS "(SORT_TITLE, SORT_DATE, SORT_ALBUM, SORT_DISC, SORT_TRACK)"
+#define SORT_KEYS_OF_DETAIL "(SELECT TITLE, DATE, ALBUM, DISC, TRACK from DETAILS where ID = new.DETAIL_ID)"
+char create_sortKeyTriggers_sqlite[] = "CREATE TRIGGER OBJECTS_ADD_SORT_KEYS AFTER INSERT ON OBJECTS "
+					"WHEN new.DETAIL_ID is not NULL BEGIN "
+					"UPDATE OBJECTS set " SORT_KEYS " = " SORT_KEYS_OF_DETAIL
+					" where ID = new.ID; "
+					"END; "
+					"CREATE TRIGGER OBJECTS_SET_SORT_KEYS AFTER UPDATE OF DETAIL_ID ON OBJECTS BEGIN "
+					"UPDATE OBJECTS set " SORT_KEYS " = " SORT_KEYS_OF_DETAIL
+					" where ID = new.ID; "
+					"END; "
+					"CREATE TRIGGER DETAILS_SORT_KEYS AFTER UPDATE OF TITLE, DATE, ALBUM, DISC, TRACK ON DETAILS BEGIN "
+					"UPDATE OBJECTS set " SORT_KEYS " = (new.TITLE, new.DATE, new.ALBUM, new.DISC, new.TRACK)"
+					" where DETAIL_ID = new.ID; "
+					"END;";
 
 char create_detailTable_sqlite[] = "CREATE TABLE DETAILS ("
 					"ID INTEGER PRIMARY KEY AUTOINCREMENT, "
@@ -51,11 +98,35 @@ char create_detailTable_sqlite[] = "CREATE TABLE DETAILS ("
 					"DATE DATE, "
 					"RESOLUTION TEXT, "
 					"THUMBNAIL BOOL DEFAULT 0, "
+					"THUMB_OFFSET INTEGER DEFAULT 0, "
+					"THUMB_SIZE INTEGER DEFAULT 0, "
 					"ALBUM_ART INTEGER DEFAULT 0, "
 					"ROTATION INTEGER, "
 					"DLNA_PN TEXT, "
 					"MIME TEXT);";
 
+/* Substring index for Search.  The trigram tokenizer lets FTS5 answer
+ * the LIKE '%...%' that "contains" translates to, so results are the
+ * same as scanning DETAILS. */
+char create_detailsFts_sqlite[] = "CREATE VIRTUAL TABLE DETAILS_FTS USING fts5("
+					"TITLE, CREATOR, ARTIST, ALBUM, "
+					"content='DETAILS', content_rowid='ID', tokenize='trigram'); "
+					"CREATE TRIGGER DETAILS_FTS_ADD AFTER INSERT ON DETAILS BEGIN "
+					"INSERT into DETAILS_FTS (rowid, TITLE, CREATOR, ARTIST, ALBUM) "
+					"values (new.ID, new.TITLE, new.CREATOR, new.ARTIST, new.ALBUM); "
+					"END; "
+					"CREATE TRIGGER DETAILS_FTS_DEL AFTER DELETE ON DETAILS BEGIN "
+					"INSERT into DETAILS_FTS (DETAILS_FTS, rowid, TITLE, CREATOR, ARTIST, ALBUM) "
+					"values ('delete', old.ID, old.TITLE, old.CREATOR, old.ARTIST, old.ALBUM); "
+					"END; "
+					"CREATE TRIGGER DETAILS_FTS_UPD AFTER UPDATE OF TITLE, CREATOR, ARTIST, ALBUM ON DETAILS BEGIN "
+					"INSERT into DETAILS_FTS (DETAILS_FTS, rowid, TITLE, CREATOR, ARTIST, ALBUM) "
+					"values ('delete', old.ID, old.TITLE, old.CREATOR, old.ARTIST, old.ALBUM); "
+					"INSERT into DETAILS_FTS (rowid, TITLE, CREATOR, ARTIST, ALBUM) "
+					"values (new.ID, new.TITLE, new.CREATOR, new.ARTIST, new.ALBUM); "
+					"END; "
+					"INSERT into DETAILS_FTS (DETAILS_FTS) values ('rebuild');";
+
 char create_albumArtTable_sqlite[] = "CREATE TABLE ALBUM_ART ("
 					"ID INTEGER PRIMARY KEY AUTOINCREMENT, "
 					"PATH TEXT NOT NULL"
@@ -16,8 +16,10 @@
  * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "sql.h"
 #include "upnpglobalvars.h"
@@ -259,6 +261,375 @@ sql_get_text_field(sqlite3 *db, const char *fmt, ...)
 	return str;
 }
 
+/* Prepared statement cache.  Hot queries are written with bound
+ * parameters, so the same SQL text comes back again and again and only
+ * needs to be compiled once per database connection.  Statements are
+ * handed out to one user at a time; if a query is already in use (say,
+ * from inside its own row callback), the caller gets a private copy.
+ * Pooled connections may be used from any thread, so the table is
+ * locked; a statement itself is only ever used by its holder. */
+#define SQL_STMT_CACHE 24
+
+struct stmt_cache_entry {
+	sqlite3 *db;
+	char *sql;
+	sqlite3_stmt *stmt;
+	unsigned int used;	/* LRU clock */
+	int busy;
+};
+
+static struct stmt_cache_entry stmt_cache[SQL_STMT_CACHE];
+static unsigned int stmt_clock;
+static pthread_mutex_t stmt_lock = PTHREAD_MUTEX_INITIALIZER;
+struct sql_stmt_stats sql_stmt_stats;
+
+sqlite3_stmt *
+sql_prepare_cached(sqlite3 *db, const char *sql)
+{
+	struct stmt_cache_entry *e, *victim = NULL;
+	sqlite3_stmt *stmt;
+	int i;
+
+	pthread_mutex_lock(&stmt_lock);
+	for (i = 0; i < SQL_STMT_CACHE; i++)
+	{
+		e = &stmt_cache[i];
+		if (e->stmt && e->db == db && strcmp(e->sql, sql) == 0)
+		{
+			if (e->busy)
+				break;
+			e->busy = 1;
+			e->used = ++stmt_clock;
+			sql_stmt_stats.hits++;
+			pthread_mutex_unlock(&stmt_lock);
+			return e->stmt;
+		}
+		if (e->busy)
+			continue;
+		if (!victim || !e->stmt || (victim->stmt && e->used < victim->used))
+			victim = e;
+	}
+	sql_stmt_stats.compiles++;
+	/* Claim the slot while compiling without the lock */
+	if (i == SQL_STMT_CACHE && victim)
+		victim->busy = 1;
+	else
+		victim = NULL;
+	pthread_mutex_unlock(&stmt_lock);
+
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "prepare failed: %s\n%s\n", sqlite3_errmsg(db), sql);
+		stmt = NULL;
+	}
+	/* Already handed out, so this one is private */
+	if (!victim)
+		return stmt;
+
+	pthread_mutex_lock(&stmt_lock);
+	if (victim->stmt)
+	{
+		sqlite3_finalize(victim->stmt);
+		free(victim->sql);
+		victim->stmt = NULL;
+	}
+	victim->sql = stmt ? strdup(sql) : NULL;
+	if (victim->sql)
+	{
+		victim->db = db;
+		victim->stmt = stmt;
+		victim->used = ++stmt_clock;
+	}
+	else
+		victim->busy = 0;
+	pthread_mutex_unlock(&stmt_lock);
+
+	return stmt;
+}
+
+void
+sql_release_cached(sqlite3_stmt *stmt)
+{
+	int i;
+
+	if (!stmt)
+		return;
+	pthread_mutex_lock(&stmt_lock);
+	for (i = 0; i < SQL_STMT_CACHE; i++)
+	{
+		if (stmt_cache[i].stmt == stmt)
+		{
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+			stmt_cache[i].busy = 0;
+			pthread_mutex_unlock(&stmt_lock);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&stmt_lock);
+	sqlite3_finalize(stmt);
+}
+
+void
+sql_finalize_cached(sqlite3 *db)
+{
+	struct stmt_cache_entry *e;
+	int i;
+
+	pthread_mutex_lock(&stmt_lock);
+	for (i = 0; i < SQL_STMT_CACHE; i++)
+	{
+		e = &stmt_cache[i];
+		if (!e->stmt || e->db != db)
+			continue;
+		sqlite3_finalize(e->stmt);
+		free(e->sql);
+		memset(e, 0, sizeof(*e));
+	}
+	pthread_mutex_unlock(&stmt_lock);
+}
+
+int
+sql_step(sqlite3_stmt *stmt)
+{
+	int counter, result;
+
+	for (counter = 0;
+	     ((result = sqlite3_step(stmt)) == SQLITE_BUSY || result == SQLITE_LOCKED) && counter < 2;
+	     counter++)
+	{
+		/* While SQLITE_BUSY has a built in timeout,
+		 * SQLITE_LOCKED does not, so sleep */
+		if (result == SQLITE_LOCKED)
+			sleep(1);
+	}
+
+	return result;
+}
+
+int
+sql_exec_cached(sqlite3_stmt *stmt, sqlite3_callback callback, void *arg)
+{
+	char *argv[64];
+	int argc, i, result;
+
+	argc = sqlite3_column_count(stmt);
+	if (argc > 64)
+		argc = 64;
+	while ((result = sql_step(stmt)) == SQLITE_ROW)
+	{
+		for (i = 0; i < argc; i++)
+			argv[i] = (char *)sqlite3_column_text(stmt, i);
+		if (callback(arg, argc, argv, NULL) != 0)
+		{
+			result = SQLITE_ABORT;
+			break;
+		}
+	}
+	if (result == SQLITE_DONE)
+		result = SQLITE_OK;
+	else if (result != SQLITE_ABORT)
+		DPRINTF(E_WARN, L_DB_SQL, "SQL step failed: %s\n%s\n",
+			sqlite3_errmsg(sqlite3_db_handle(stmt)), sqlite3_sql(stmt));
+	sql_release_cached(stmt);
+
+	return result;
+}
+
+int64_t
+sql_get_int64_cached(sqlite3_stmt *stmt)
+{
+	int64_t ret;
+
+	switch (sql_step(stmt))
+	{
+		case SQLITE_DONE:
+			ret = 0;
+			break;
+		case SQLITE_ROW:
+			ret = sqlite3_column_int64(stmt, 0);
+			break;
+		default:
+			DPRINTF(E_WARN, L_DB_SQL, "SQL step failed: %s\n%s\n",
+				sqlite3_errmsg(sqlite3_db_handle(stmt)), sqlite3_sql(stmt));
+			ret = -1;
+			break;
+	}
+	sql_release_cached(stmt);
+
+	return ret;
+}
+
+char *
+sql_get_text_cached(sqlite3_stmt *stmt)
+{
+	char *str = NULL;
+	int len;
+
+	switch (sql_step(stmt))
+	{
+		case SQLITE_DONE:
+			break;
+		case SQLITE_ROW:
+			if (sqlite3_column_type(stmt, 0) == SQLITE_NULL)
+				break;
+			len = sqlite3_column_bytes(stmt, 0);
+			if ((str = sqlite3_malloc(len + 1)) == NULL)
+			{
+				DPRINTF(E_ERROR, L_DB_SQL, "malloc failed\n");
+				break;
+			}
+			memcpy(str, sqlite3_column_text(stmt, 0), len + 1);
+			break;
+		default:
+			DPRINTF(E_WARN, L_DB_SQL, "SQL step failed: %s\n%s\n",
+				sqlite3_errmsg(sqlite3_db_handle(stmt)), sqlite3_sql(stmt));
+			break;
+	}
+	sql_release_cached(stmt);
+
+	return str;
+}
+
+/* Connection pool.  The global db is the one connection that writes;
+ * the scanner, inotify and the odd update made while serving all go
+ * through it.  Requests read through connections of their own, opened
+ * read-only on the same file.  In WAL mode each of those reads from its
+ * own snapshot with its own page cache, so readers wait neither for the
+ * writer nor for each other. */
+struct pool_conn {
+	sqlite3 *conn;
+	int busy;
+};
+
+static struct pool_conn sql_pool[MAX_DB_READERS];
+static int sql_pool_size;
+static pthread_mutex_t sql_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int
+sql_pool_open(const char *path, int readers)
+{
+	sqlite3 *conn;
+	int i;
+
+	for (i = 0; i < readers && i < MAX_DB_READERS; i++)
+	{
+		if (sqlite3_open_v2(path, &conn, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+		{
+			DPRINTF(E_WARN, L_DB_SQL, "Failed to open database reader: %s\n",
+				conn ? sqlite3_errmsg(conn) : "out of memory");
+			sqlite3_close(conn);
+			break;
+		}
+		sqlite3_busy_timeout(conn, 5000);
+		sql_pool[i].conn = conn;
+		sql_pool[i].busy = 0;
+	}
+	sql_pool_size = i;
+	DPRINTF(E_DEBUG, L_DB_SQL, "Opened %d database readers\n", i);
+
+	return i;
+}
+
+sqlite3 *
+sql_checkout(void)
+{
+	sqlite3 *conn = db;
+	int i;
+
+	pthread_mutex_lock(&sql_pool_lock);
+	for (i = 0; i < sql_pool_size; i++)
+	{
+		if (!sql_pool[i].busy)
+		{
+			sql_pool[i].busy = 1;
+			conn = sql_pool[i].conn;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sql_pool_lock);
+
+	return conn;
+}
+
+void
+sql_checkin(sqlite3 *conn)
+{
+	int i;
+
+	pthread_mutex_lock(&sql_pool_lock);
+	for (i = 0; i < sql_pool_size; i++)
+	{
+		if (sql_pool[i].conn == conn)
+		{
+			sql_pool[i].busy = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sql_pool_lock);
+}
+
+int
+sql_create_function(const char *name, int nargs,
+                    void (*func)(sqlite3_context *, int, sqlite3_value **))
+{
+	int i, ret;
+
+	ret = sqlite3_create_function(db, name, nargs, SQLITE_UTF8, NULL, func, NULL, NULL);
+	for (i = 0; i < sql_pool_size && ret == SQLITE_OK; i++)
+		ret = sqlite3_create_function(sql_pool[i].conn, name, nargs, SQLITE_UTF8, NULL, func, NULL, NULL);
+
+	return ret;
+}
+
+/* In a process forked from the server, start over with no statements
+ * and no readers.  The parent's connections can't be used across a
+ * fork, so they are left as they are instead of being finalized or
+ * closed, and the locks are set up again in case a thread held one. */
+void
+sql_forget(void)
+{
+	memset(stmt_cache, 0, sizeof(stmt_cache));
+	memset(sql_pool, 0, sizeof(sql_pool));
+	sql_pool_size = 0;
+	pthread_mutex_init(&stmt_lock, NULL);
+	pthread_mutex_init(&sql_pool_lock, NULL);
+}
+
+void
+sql_pool_close(void)
+{
+	int i;
+
+	pthread_mutex_lock(&sql_pool_lock);
+	for (i = 0; i < sql_pool_size; i++)
+	{
+		sql_finalize_cached(sql_pool[i].conn);
+		sqlite3_close(sql_pool[i].conn);
+		sql_pool[i].conn = NULL;
+	}
+	sql_pool_size = 0;
+	pthread_mutex_unlock(&sql_pool_lock);
+}
+
+int
+rebuild_child_counts(sqlite3 *db)
+{
+	int ret;
+
+	ret = sql_exec(db, "UPDATE OBJECTS set CHILD_COUNT ="
+	                   " (SELECT count(*) from OBJECTS c where c.PARENT_ID = OBJECTS.OBJECT_ID)"
+	                   " where CHILD_COUNT !="
+	                   " (SELECT count(*) from OBJECTS c where c.PARENT_ID = OBJECTS.OBJECT_ID)");
+	if (ret != SQLITE_OK)
+		return -1;
+	ret = sqlite3_changes(db);
+	if (ret)
+		DPRINTF(E_WARN, L_DB_SQL, "Fixed the child count of %d objects\n", ret);
+
+	return ret;
+}
+
 int
 db_upgrade(sqlite3 *db)
 {
@@ -272,7 +643,7 @@ db_upgrade(sqlite3 *db)
 		return -2;
 	if (db_vers < 1)
 		return -1;
-	if (db_vers < 9)
+	if (db_vers < 13)
 		return db_vers;
 	sql_exec(db, "PRAGMA user_version = %d", DB_VERSION);
 
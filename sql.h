@@ -39,6 +39,41 @@ int sql_get_table(sqlite3 *db, const char *zSql, char ***pazResult, int *pnRow,
 int sql_get_int_field(sqlite3 *db, const char *fmt, ...);
 int64_t sql_get_int64_field(sqlite3 *db, const char *fmt, ...);
 char * sql_get_text_field(sqlite3 *db, const char *fmt, ...);
+
+/* Cached prepared statements.  sql_prepare_cached() returns a statement
+ * ready for binding; the sql_*_cached() runners step it and give it back
+ * to the cache, as does sql_release_cached() for statements stepped by
+ * hand.  sql_finalize_cached() must be called before closing db. */
+struct sql_stmt_stats {
+	unsigned long hits;
+	unsigned long compiles;
+};
+extern struct sql_stmt_stats sql_stmt_stats;
+
+sqlite3_stmt * sql_prepare_cached(sqlite3 *db, const char *sql);
+void sql_release_cached(sqlite3_stmt *stmt);
+void sql_finalize_cached(sqlite3 *db);
+int sql_step(sqlite3_stmt *stmt);
+int sql_exec_cached(sqlite3_stmt *stmt, sqlite3_callback callback, void *arg);
+int64_t sql_get_int64_cached(sqlite3_stmt *stmt);
+char * sql_get_text_cached(sqlite3_stmt *stmt);
+
+/* Read-only connections for serving requests, opened once the database
+ * is in WAL mode.  sql_checkout() hands out a free one, or the writer db
+ * when there is none; give it back with sql_checkin().  Writes always
+ * go through db. */
+int sql_pool_open(const char *path, int readers);
+sqlite3 * sql_checkout(void);
+void sql_checkin(sqlite3 *conn);
+void sql_pool_close(void);
+/* Drop, without using, what a forked child inherited from the server */
+void sql_forget(void);
+/* Add an SQL function to the writer and every reader */
+int sql_create_function(const char *name, int nargs,
+                        void (*func)(sqlite3_context *, int, sqlite3_value **));
+
+/* Recount every container's children, returning how many were wrong */
+int rebuild_child_counts(sqlite3 *db);
 int db_upgrade(sqlite3 *db);
 
 #endif
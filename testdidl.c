@@ -0,0 +1,186 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark of the DIDL-Lite serializer.  A synthetic result of video,
+ * audio and image rows, some with captions, bookmarks or album art, is
+ * fed straight to the Browse row callback for a set of client quirk
+ * configurations, and the time per item is reported.  With "dump", the
+ * generated DIDL-Lite is written to stdout instead, one configuration
+ * per line, so that output can be compared between revisions.
+ *
+ * usage: testdidl [runs | dump] */
+#include "upnpsoap.c"
+
+#include <time.h>
+
+#define ROWS 10000
+
+/* The HTTP side of a SOAP response is never reached: the buffer below
+ * is large enough that callback() never has to flush it. */
+void BuildHeader_upnphttp(struct upnphttp *h, int respcode, const char *respmsg, int bodylen) { }
+void BuildResp2_upnphttp(struct upnphttp *h, int respcode, const char *respmsg, const char *body, int bodylen) { }
+void SendResp_upnphttp(struct upnphttp *h) { }
+int SendChunk_upnphttp(struct upnphttp *h, const char *data, int len) { return -1; }
+void CloseSocket_upnphttp(struct upnphttp *h) { }
+void Send500(struct upnphttp *h) { }
+pid_t ForkResp_upnphttp(struct upnphttp *h) { return -1; }
+
+static const struct {
+	const char *name;
+	enum client_types client;
+	uint32_t flags;
+	uint32_t filter;
+} configs[] = {
+	{ "generic", EStandardDLNA150, 0, 0xFFFFFFFF & ~FILTER_PV_SUBTITLE },
+	{ "Samsung", ESamsungSeriesCDE, FLAG_DLNA|FLAG_SAMSUNG|FLAG_CAPTION_RES, 0xFFFFFFFF },
+	{ "LG", ELGDevice, FLAG_DLNA|FLAG_MIME_AVI_DIVX|FLAG_MIME_FLAC_FLAC|FLAG_MIME_WAV_WAV, 0xFFFFFFFF },
+	{ "Xbox", EXbox, FLAG_DLNA|FLAG_MIME_AVI_AVI|FLAG_MS_PFS, 0xFFFFFFFF },
+	{ "Toshiba", EToshibaTV, FLAG_DLNA, 0xFFFFFFFF },
+	{ "Bravia", ESonyBravia, FLAG_DLNA|FLAG_RESIZE_THUMBS, 0xFFFFFFFF },
+	{ "Sony BDP", ESonyBDP, FLAG_DLNA, 0xFFFFFFFF },
+	{ "Asus", EAsusOPlay, FLAG_DLNA|FLAG_CAPTION_RES, 0xFFFFFFFF },
+	{ "Freebox", EFreeBox, 0, FILTER_RES|FILTER_DC_CREATOR },
+};
+#define CONFIGS (sizeof(configs) / sizeof(configs[0]))
+
+/* Columns in the order of SELECT_COLUMNS */
+#define NCOLUMNS 28
+static char *rows[ROWS][NCOLUMNS];
+
+static char *
+column(const char *fmt, int n)
+{
+	char buf[128];
+
+	snprintf(buf, sizeof(buf), fmt, n);
+	return strdup(buf);
+}
+
+static void
+make_rows(void)
+{
+	static const char *mimes[] = { "video/x-msvideo", "video/x-matroska", "video/mp4",
+	                               "video/vnd.dlna.mpeg-tts", "audio/mpeg", "audio/x-flac",
+	                               "audio/x-wav", "image/jpeg" };
+	static const char *pns[] = { NULL, NULL, "AVC_MP4_MP_SD_AAC_MULT5", "MPEG_TS_HD_NA",
+	                             "MP3", NULL, NULL, "JPEG_LRG" };
+	char **r;
+	int i, k;
+
+	for (i = 0; i < ROWS; i++)
+	{
+		r = rows[i];
+		k = i % 8;
+		r[0] = column("64$%X", i);
+		r[1] = strdup("64");
+		if (i % 5 == 0)
+			r[2] = strdup("1$4$2");
+		r[3] = column("%d", i + 1);
+		r[4] = strdup(k < 4 ? "item.videoItem" : k < 7 ? "item.audioItem.musicTrack" : "item.imageItem.photo");
+		r[5] = column("%d", 1000000 + i * 37);
+		r[6] = column("A fairly typical title &amp; number %d", i);
+		if (k < 7)
+		{
+			r[7] = strdup("0:03:25.120");
+			r[8] = strdup("320000");
+		}
+		if (k >= 4 && k < 7)
+		{
+			r[9] = strdup("44100");
+			r[14] = strdup("2");
+			r[15] = column("%d", i % 20);
+		}
+		r[10] = strdup("Some Artist");
+		r[11] = strdup("Some Album");
+		r[12] = strdup("Rock");
+		if (i % 3 == 0)
+			r[13] = strdup("A long comment that goes on and on");
+		r[16] = strdup("2011-05-03");
+		if (k < 4 || k == 7)
+			r[17] = strdup(k == 7 ? "4000x3000" : "1920x1080");
+		if (k == 7)
+			r[18] = strdup(i % 2 ? "1" : "0");
+		if (k == 1)
+			r[19] = strdup("Creator");
+		if (pns[k])
+			r[20] = strdup(pns[k]);
+		r[21] = strdup(mimes[k]);
+		if (i % 4 == 0)
+			r[22] = strdup("77");
+		r[23] = strdup("0");
+		r[24] = strdup("1");
+		if (k < 4 && i % 16 == 0)
+			r[25] = strdup("5");
+		if (i % 7 == 0)
+			r[26] = strdup("120");
+		r[27] = strdup("0");
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct string_s str;
+	struct Response args;
+	double start, total = 0;
+	int dump = (argc > 1 && strcmp(argv[1], "dump") == 0);
+	int runs = (argc > 1 && !dump) ? atoi(argv[1]) : 20;
+	unsigned int c;
+	int i, n;
+
+	strcpy(lan_addr[0].str, "192.168.1.10");
+	runtime_vars.port = 8200;
+	make_rows();
+	str.size = 64 << 20;
+	str.data = malloc(str.size);
+	if (dump)
+		runs = 1;
+
+	for (c = 0; c < CONFIGS; c++)
+	{
+		for (n = 0; n < runs; n++)
+		{
+			memset(&args, 0, sizeof(args));
+			args.str = &str;
+			args.client = configs[c].client;
+			args.flags = configs[c].flags;
+			args.filter = configs[c].filter;
+			args.requested = -1;
+			str.off = 0;
+			start = now();
+			for (i = 0; i < ROWS; i++)
+				callback(&args, NCOLUMNS, rows[i], NULL);
+			total += now() - start;
+		}
+		if (dump)
+			printf("%.*s\n", (int)str.off, str.data);
+	}
+	if (!dump)
+		printf("%.0f ns per item (%d items x %d client configurations x %d runs)\n",
+		       total / ((double)ROWS * CONFIGS * runs) * 1e9, ROWS, (int)CONFIGS, runs);
+
+	return 0;
+}
@@ -0,0 +1,227 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Check that sorted Browse pages are read off the sort indexes.  The
+ * database schema and the scanner's sort indexes are set up in memory,
+ * then a container is browsed with each sort capability in both
+ * directions, with a few combinations, with the forced sort order and
+ * without any sort, two pages each so that the cursor seek is covered
+ * too.  Every query Browse runs is put through EXPLAIN QUERY PLAN, and
+ * a plan that sorts into a temporary b-tree is a failure.
+ *
+ * usage: testsortplan [-v] */
+#include "upnpsoap.c"
+
+#include "scanner_sqlite.h"
+
+#define CHILDREN 200
+#define MAX_QUERIES 64
+
+/* Responses are built and thrown away, only the queries matter */
+void
+BuildHeader_upnphttp(struct upnphttp *h, int respcode, const char *respmsg, int bodylen)
+{
+	h->res_buf = realloc(h->res_buf, bodylen > 0 ? bodylen : 1);
+	h->res_buflen = 0;
+}
+
+void BuildResp2_upnphttp(struct upnphttp *h, int respcode, const char *respmsg, const char *body, int bodylen) { }
+void SendResp_upnphttp(struct upnphttp *h) { }
+int SendChunk_upnphttp(struct upnphttp *h, const char *data, int len) { return 0; }
+void CloseSocket_upnphttp(struct upnphttp *h) { }
+void Send500(struct upnphttp *h) { }
+pid_t ForkResp_upnphttp(struct upnphttp *h) { return -1; }
+
+static char *queries[MAX_QUERIES];
+static int nqueries;
+
+/* Collect the distinct sorted queries Browse steps through */
+static int
+trace_query(unsigned int type, void *ctx, void *p, void *x)
+{
+	const char *sql = sqlite3_sql((sqlite3_stmt *)p);
+	int i;
+
+	if (!sql || !strstr(sql, " where ") || !strstr(sql, " order by "))
+		return 0;
+	for (i = 0; i < nqueries; i++)
+		if (strcmp(queries[i], sql) == 0)
+			return 0;
+	if (nqueries < MAX_QUERIES)
+		queries[nqueries++] = strdup(sql);
+	return 0;
+}
+
+static int
+fill_db(void)
+{
+	static const char *classes[] = { "item.audioItem.musicTrack", "item.videoItem",
+	                                 "container.album.musicAlbum" };
+	int i;
+
+	if (sql_exec(db, create_objectTable_sqlite) != SQLITE_OK ||
+	    sql_exec(db, create_childCountTriggers_sqlite) != SQLITE_OK ||
+	    sql_exec(db, create_detailTable_sqlite) != SQLITE_OK ||
+	    sql_exec(db, create_sortKeyTriggers_sqlite) != SQLITE_OK ||
+	    sql_exec(db, create_captionTable_sqlite) != SQLITE_OK ||
+	    sql_exec(db, create_bookmarkTable_sqlite) != SQLITE_OK)
+		return -1;
+	sql_exec(db, "BEGIN");
+	sql_exec(db, "INSERT into DETAILS (ID, TITLE) values (1, 'Music')");
+	sql_exec(db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, DETAIL_ID, CLASS, NAME)"
+	             " values ('1', '0', 1, 'container.storageFolder', 'Music')");
+	for (i = 0; i < CHILDREN; i++)
+	{
+		sql_exec(db, "INSERT into DETAILS (ID, TITLE, DATE, ALBUM, DISC, TRACK, MIME)"
+		             " values (%d, 'Title %d', '20%02d-01-01', 'Album %d', %d, %d, 'audio/mpeg')",
+		             i + 2, (i * 37) % CHILDREN, i % 20, i / 12, 1 + i % 2, 1 + i % 12);
+		sql_exec(db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID, NAME)"
+		             " values ('1$%X', '1', '%s', %d, 'Title %d')",
+		             i, classes[i % 3], i + 2, (i * 37) % CHILDREN);
+	}
+	sql_exec(db, "COMMIT");
+	/* The indexes a scan leaves behind */
+	sql_exec(db, "create INDEX IDX_OBJECTS_OBJECT_ID ON OBJECTS(OBJECT_ID);");
+	sql_exec(db, "create INDEX IDX_OBJECTS_PARENT_ID ON OBJECTS(PARENT_ID);");
+	sql_exec(db, "create INDEX IDX_OBJECTS_DETAIL_ID ON OBJECTS(DETAIL_ID);");
+	sql_exec(db, "create INDEX IDX_OBJECTS_CLASS ON OBJECTS(CLASS);");
+	sql_exec(db, "create INDEX IDX_OBJECTS_UPDATE_ID ON OBJECTS(UPDATE_ID);");
+	sql_exec(db, "create INDEX IDX_DETAILS_ID ON DETAILS(ID);");
+	sql_exec(db, "create INDEX IDX_SCANNER_OPT ON OBJECTS(PARENT_ID, NAME, OBJECT_ID);");
+	sql_exec(db, "create INDEX IDX_SEARCH_OPT ON OBJECTS(OBJECT_ID, CLASS, DETAIL_ID);");
+	create_sort_indexes();
+
+	return 0;
+}
+
+static void
+browse(const char *sort, int force, int start)
+{
+	static struct client_type_s type;
+	static struct client_cache_s client;
+	struct upnphttp h;
+	char req[1024];
+
+	snprintf(req, sizeof(req), "<s:Envelope><s:Body><u:Browse>"
+	         "<ObjectID>1</ObjectID><BrowseFlag>BrowseDirectChildren</BrowseFlag>"
+	         "<Filter>*</Filter><StartingIndex>%d</StartingIndex>"
+	         "<RequestedCount>20</RequestedCount>%s%s%s"
+	         "</u:Browse></s:Body></s:Envelope>",
+	         start, sort ? "<SortCriteria>" : "", THISORNUL(sort), sort ? "</SortCriteria>" : "");
+	memset(&h, 0, sizeof(h));
+	strcpy(h.HttpVer, "HTTP/1.1");
+	h.req_buf = req;
+	h.req_contentlen = strlen(req);
+	h.db = db;
+	if (force)
+	{
+		type.flags = FLAG_FORCE_SORT;
+		client.type = &type;
+		h.req_client = &client;
+	}
+	BrowseContentDirectory(&h, "Browse");
+	free(h.res_buf);
+}
+
+/* Returns the number of sorts that need a temporary b-tree */
+static int
+check_plan(const char *sql, int verbose)
+{
+	sqlite3_stmt *stmt;
+	char *explain;
+	const char *detail;
+	int bad = 0;
+
+	explain = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql);
+	if (sqlite3_prepare_v2(db, explain, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		printf("FAIL: %s\n  %s\n", sqlite3_errmsg(db), sql);
+		sqlite3_free(explain);
+		return 1;
+	}
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		detail = (const char *)sqlite3_column_text(stmt, 3);
+		if (detail && strstr(detail, "USE TEMP B-TREE"))
+			bad = 1;
+		if (verbose || bad)
+			printf("  %s\n", THISORNUL(detail));
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_free(explain);
+	printf("%s: %s\n", bad ? "FAIL" : "ok", strstr(sql, " where ") + 1);
+
+	return bad;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *combinations[] = {
+		"+upnp:class,+upnp:originalTrackNumber,+dc:title",
+		"+upnp:class,+dc:title",
+		"-upnp:album,-dc:title",
+		NULL
+	};
+	const struct sort_capability *cap;
+	char sort[128];
+	int verbose = (argc > 1 && strcmp(argv[1], "-v") == 0);
+	int i, failed = 0;
+
+	strcpy(lan_addr[0].str, "192.168.1.10");
+	runtime_vars.port = 8200;
+	if (sqlite3_open(":memory:", &db) != SQLITE_OK || fill_db() != 0)
+	{
+		fprintf(stderr, "Failed to set up the test database\n");
+		return 1;
+	}
+	sqlite3_trace_v2(db, SQLITE_TRACE_STMT, trace_query, NULL);
+
+	for (cap = sort_capabilities; cap->property; cap++)
+	{
+		for (i = 0; i < 2; i++)
+		{
+			snprintf(sort, sizeof(sort), "%c%s", i ? '-' : '+', cap->property);
+			browse(sort, 0, 0);
+			browse(sort, 0, 20);
+		}
+	}
+	for (i = 0; combinations[i]; i++)
+	{
+		browse(combinations[i], 0, 0);
+		browse(combinations[i], 0, 20);
+	}
+	browse(NULL, 1, 0);
+	browse(NULL, 1, 20);
+	browse(NULL, 0, 0);
+	browse(NULL, 0, 20);
+	sqlite3_trace_v2(db, 0, NULL, NULL);
+
+	if (!nqueries)
+	{
+		printf("FAIL: Browse ran no sorted queries\n");
+		return 1;
+	}
+	for (i = 0; i < nqueries; i++)
+		failed += check_plan(queries[i], verbose);
+	printf("%d of %d sorted Browse queries need a temporary b-tree (SQLite %s)\n",
+	       failed, nqueries, sqlite3_libversion());
+
+	sql_finalize_cached(db);
+	sqlite3_close(db);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,131 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark of the prepared statement cache in sql.c.  Each round does
+ * what a metadata Browse of one item used to cost in queries: the item
+ * itself, the child count of its parent, and an existence check.  It is
+ * run once with the SQL formatted and compiled for every call, as before
+ * the cache, and once through sql_prepare_cached() with bound values.
+ *
+ * usage: testsqlcache [rounds] */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "upnpglobalvars.h"
+#include "scanner_sqlite.h"
+#include "sql.h"
+#include "log.h"
+
+#define CHILDREN 1000
+
+#define ITEM_SQL "SELECT o.OBJECT_ID, o.PARENT_ID, o.REF_ID, o.DETAIL_ID, o.CLASS," \
+                 " d.SIZE, d.TITLE, d.DURATION, d.BITRATE, d.SAMPLERATE, d.ARTIST," \
+                 " d.ALBUM, d.GENRE, d.COMMENT, d.CHANNELS, d.TRACK, d.DATE, d.RESOLUTION," \
+                 " d.THUMBNAIL, d.CREATOR, d.DLNA_PN, d.MIME, d.ALBUM_ART, d.ROTATION, d.DISC" \
+                 " from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID) where OBJECT_ID = "
+
+static int
+count_row(void *arg, int argc, char **argv, char **azColName)
+{
+	(*(int *)arg)++;
+	return 0;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+fill_db(void)
+{
+	int i;
+
+	if (sql_exec(db, create_objectTable_sqlite) != SQLITE_OK ||
+	    sql_exec(db, create_detailTable_sqlite) != SQLITE_OK)
+		return -1;
+	sql_exec(db, "create INDEX IDX_OBJECTS_OBJECT_ID ON OBJECTS(OBJECT_ID);");
+	sql_exec(db, "create INDEX IDX_OBJECTS_PARENT_ID ON OBJECTS(PARENT_ID);");
+	sql_exec(db, "BEGIN");
+	for (i = 0; i < CHILDREN; i++)
+	{
+		sql_exec(db, "INSERT into DETAILS (ID, TITLE, MIME) values (%d, 'Track %d', 'audio/mpeg')", i + 1, i);
+		sql_exec(db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID)"
+		             " values ('64$%X', '64', 'item.audioItem.musicTrack', %d)", i, i + 1);
+	}
+	sql_exec(db, "COMMIT");
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	sqlite3_stmt *stmt;
+	char *sql;
+	double start, formatted, cached;
+	int rounds = (argc > 1) ? atoi(argv[1]) : 20000;
+	int i, rows = 0;
+
+	if (sqlite3_open(":memory:", &db) != SQLITE_OK || fill_db() != 0)
+	{
+		fprintf(stderr, "Failed to set up the test database\n");
+		return 1;
+	}
+
+	start = now();
+	for (i = 0; i < rounds; i++)
+	{
+		sql = sqlite3_mprintf(ITEM_SQL "'%q'", "64$5");
+		sqlite3_exec(db, sql, count_row, &rows, NULL);
+		sqlite3_free(sql);
+		sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%q'", "64");
+		sql_get_int_field(db, "SELECT count(*) from OBJECTS where OBJECT_ID = '%q'", "64$5");
+	}
+	formatted = (now() - start) / rounds;
+
+	start = now();
+	for (i = 0; i < rounds; i++)
+	{
+		stmt = sql_prepare_cached(db, ITEM_SQL "?");
+		sqlite3_bind_text(stmt, 1, "64$5", -1, SQLITE_STATIC);
+		sql_exec_cached(stmt, count_row, &rows);
+		stmt = sql_prepare_cached(db, "SELECT count(*) from OBJECTS where PARENT_ID = ?");
+		sqlite3_bind_text(stmt, 1, "64", -1, SQLITE_STATIC);
+		sql_get_int64_cached(stmt);
+		stmt = sql_prepare_cached(db, "SELECT count(*) from OBJECTS where OBJECT_ID = ?");
+		sqlite3_bind_text(stmt, 1, "64$5", -1, SQLITE_STATIC);
+		sql_get_int64_cached(stmt);
+	}
+	cached = (now() - start) / rounds;
+
+	printf("%d rounds over a container of %d items, SQLite %s\n", rounds, CHILDREN, sqlite3_libversion());
+	printf("  formatted and compiled per call: %6.1f us per Browse\n", formatted * 1e6);
+	printf("  cached prepared statements:      %6.1f us per Browse (%lu compiles)\n",
+	       cached * 1e6, sql_stmt_stats.compiles);
+
+	sql_finalize_cached(db);
+	sqlite3_close(db);
+	return 0;
+}
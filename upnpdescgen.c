@@ -351,6 +351,7 @@ static const struct stateVar ContentDirectoryVars[] =
 	{"SearchCapabilities", 0, 0},
 	{"SortCapabilities", 0, 0},
 	{"SystemUpdateID", 3|EVENTED, 0, 0, 255},
+	{"ContainerUpdateIDs", 0|EVENTED, 0, 0, 255},
 	{0, 0}
 };
 
@@ -593,6 +594,33 @@ genRootDescSamsung(int * len)
 	return str;
 }
 
+/* The Xbox 360 only recognizes servers whose friendly name has a
+ * ": 1" style suffix, and wants model number 1. */
+char *
+genRootDescXbox(int * len)
+{
+	char * str;
+	int tmplen;
+	char name[FRIENDLYNAME_MAX_LEN];
+	struct XMLElt xboxRootDesc[sizeof(rootDesc)/sizeof(struct XMLElt)];
+	tmplen = 2560;
+	str = (char *)malloc(tmplen);
+	if(str == NULL)
+		return NULL;
+	* len = strlen(xmlver);
+	memcpy(str, xmlver, *len + 1);
+	memcpy(&xboxRootDesc, &rootDesc, sizeof(rootDesc));
+	if(!strchr(friendly_name, ':'))
+	{
+		snprintf(name, sizeof(name), "%s: 1", friendly_name);
+		xboxRootDesc[6+PNPX].data = name;
+	}
+	xboxRootDesc[11+PNPX].data = "1";
+	str = genXML(str, len, &tmplen, xboxRootDesc);
+	str[*len] = '\0';
+	return str;
+}
+
 /* genServiceDesc() :
  * Generate service description with allowed methods and 
  * related variables. */
@@ -722,7 +750,8 @@ genX_MS_MediaReceiverRegistrar(int * len)
 }
 
 static char *
-genEventVars(int * len, const struct serviceDesc * s, const char * servns)
+genEventVars(int * len, const struct serviceDesc * s, const char * servns,
+             const char * container_update_ids)
 {
 	const struct stateVar * v;
 	char * str;
@@ -750,6 +779,10 @@ genEventVars(int * len, const struct serviceDesc * s, const char * servns)
 					snprintf(buf, sizeof(buf), "%d", updateID);
 					str = strcat_str(str, len, &tmplen, buf);
 				}
+				else if( strcmp(v->name, "ContainerUpdateIDs") == 0 && container_update_ids )
+				{
+					str = strcat_str(str, len, &tmplen, container_update_ids);
+				}
 				break;
 			default:
 				str = strcat_str(str, len, &tmplen, upnpallowedvalues[v->ieventvalue]);
@@ -770,11 +803,12 @@ genEventVars(int * len, const struct serviceDesc * s, const char * servns)
 }
 
 char *
-getVarsContentDirectory(int * l)
+getVarsContentDirectory(int * l, const char * container_update_ids)
 {
 	return genEventVars(l,
                         &scpdContentDirectory,
-	                    "urn:schemas-upnp-org:service:ContentDirectory:1");
+	                    "urn:schemas-upnp-org:service:ContentDirectory:1",
+	                    container_update_ids);
 }
 
 char *
@@ -782,7 +816,7 @@ getVarsConnectionManager(int * l)
 {
 	return genEventVars(l,
                         &scpdConnectionManager,
-	                    "urn:schemas-upnp-org:service:ConnectionManager:1");
+	                    "urn:schemas-upnp-org:service:ConnectionManager:1", NULL);
 }
 
 char *
@@ -790,6 +824,6 @@ getVarsX_MS_MediaReceiverRegistrar(int * l)
 {
 	return genEventVars(l,
                         &scpdX_MS_MediaReceiverRegistrar,
-	                    "urn:microsoft.com:service:X_MS_MediaReceiverRegistrar:1");
+	                    "urn:microsoft.com:service:X_MS_MediaReceiverRegistrar:1", NULL);
 }
 
@@ -78,6 +78,9 @@ genRootDesc(int * len);
 char *
 genRootDescSamsung(int * len);
 
+char *
+genRootDescXbox(int * len);
+
 /* for the two following functions */
 char *
 genContentDirectory(int * len);
@@ -88,8 +91,9 @@ genConnectionManager(int * len);
 char *
 genX_MS_MediaReceiverRegistrar(int * len);
 
+/* container_update_ids is the ContainerUpdateIDs value, "id,updateid,..." */
 char *
-getVarsContentDirectory(int * len);
+getVarsContentDirectory(int * len, const char * container_update_ids);
 
 char *
 getVarsConnectionManager(int * len);
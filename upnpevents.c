@@ -76,6 +76,7 @@ struct subscriber {
 	struct upnp_event_notify * notify;
 	time_t timeout;
 	uint32_t seq;
+	uint32_t container_seq;	/* last container update it was sent */
 	enum subscriber_service_enum service;
 	char uuid[42];
 	char callback[];
@@ -104,6 +105,24 @@ struct upnp_event_notify {
 static void
 upnp_event_create_notify(struct subscriber * sub);
 
+/* Containers that changed lately, oldest first, each with the update ID
+ * it last got.  A subscriber's event lists the ones that changed since
+ * its previous event, so a container that keeps changing in between is
+ * only listed once.  When more containers change than we keep, the oldest
+ * are forgotten, and a subscriber that hadn't been told about them gets
+ * an empty list; the SystemUpdateID change still reaches it. */
+#define CONTAINER_UPDATES 256
+
+struct container_update {
+	char * id;
+	uint32_t update_id;
+};
+
+static struct container_update container_updates[CONTAINER_UPDATES];
+static int container_updates_len;
+static uint32_t container_updates_lost;	/* updates up to this may be missing */
+static uint32_t container_updates_last;
+
 /* Subscriber list */
 LIST_HEAD(listhead, subscriber) subscriberlist = { NULL };
 
@@ -130,6 +149,7 @@ newSubscriber(const char * eventurl, const char * callback, int callbacklen)
 	}
 	memcpy(tmp->callback, callback, callbacklen);
 	tmp->callback[callbacklen] = '\0';
+	tmp->container_seq = container_updates_last;
 	/* make a dummy uuid */
 	strncpyt(tmp->uuid, uuidvalue, sizeof(tmp->uuid));
 	if( get_uuid_string(tmp->uuid+5) != 0 )
@@ -217,6 +237,64 @@ upnp_event_var_change_notify(enum subscriber_service_enum service)
 	}
 }
 
+/* records that a container changed, in update ID order */
+void
+upnp_event_container_update(const char * id, uint32_t update_id)
+{
+	int i;
+
+	for(i = 0; i < container_updates_len; i++) {
+		if(strcmp(container_updates[i].id, id) == 0)
+			break;
+	}
+	if(i == container_updates_len && i == CONTAINER_UPDATES) {
+		i = 0;
+		container_updates_lost = container_updates[0].update_id;
+	}
+	if(i < container_updates_len) {
+		free(container_updates[i].id);
+		memmove(&container_updates[i], &container_updates[i+1],
+		        (container_updates_len - i - 1) * sizeof(container_updates[0]));
+		container_updates_len--;
+	}
+	container_updates[container_updates_len].id = strdup(id);
+	container_updates[container_updates_len].update_id = update_id;
+	if(container_updates[container_updates_len].id)
+		container_updates_len++;
+	container_updates_last = update_id;
+}
+
+/* the ContainerUpdateIDs value for a subscriber's next event */
+static char *
+container_update_ids(struct subscriber * sub)
+{
+	struct string_s str;
+	int i;
+
+	if(sub->container_seq < container_updates_lost)
+	{
+		sub->container_seq = container_updates_last;
+		return NULL;
+	}
+	str.size = 1;
+	for(i = 0; i < container_updates_len; i++)
+		str.size += strlen(container_updates[i].id) + 12;
+	str.data = malloc(str.size);
+	str.off = 0;
+	if(!str.data)
+		return NULL;
+	str.data[0] = '\0';
+	for(i = 0; i < container_updates_len; i++) {
+		if(container_updates[i].update_id <= sub->container_seq)
+			continue;
+		strcatf(&str, "%s%s,%u", str.off ? "," : "",
+		        container_updates[i].id, container_updates[i].update_id);
+	}
+	sub->container_seq = container_updates_last;
+
+	return str.data;
+}
+
 /* create and add the notify object to the list */
 static void
 upnp_event_create_notify(struct subscriber * sub)
@@ -322,7 +400,7 @@ static void upnp_event_prepare(struct upnp_event_notify * obj)
 		"Cache-Control: no-cache\r\n"
 		"\r\n"
 		"%.*s\r\n";
-	char * xml;
+	char * xml, * ids;
 	int l;
 	if(obj->sub == NULL) {
 		obj->state = EError;
@@ -330,7 +408,9 @@ static void upnp_event_prepare(struct upnp_event_notify * obj)
 	}
 	switch(obj->sub->service) {
 	case EContentDirectory:
-		xml = getVarsContentDirectory(&l);
+		ids = container_update_ids(obj->sub);
+		xml = getVarsContentDirectory(&l, ids);
+		free(ids);
 		break;
 	case EConnectionManager:
 		xml = getVarsConnectionManager(&l);
@@ -56,6 +56,12 @@ enum subscriber_service_enum {
 void
 upnp_event_var_change_notify(enum subscriber_service_enum service);
 
+/* upnp_event_container_update()
+ * notes the new update ID of a changed container, for the
+ * ContainerUpdateIDs of the next ContentDirectory events */
+void
+upnp_event_container_update(const char * id, uint32_t update_id);
+
 const char *
 upnpevents_addSubscriber(const char * eventurl,
                          const char * callback, int callbacklen,
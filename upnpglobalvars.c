@@ -59,6 +59,12 @@
 time_t startup_time = 0;
 
 struct runtime_vars_s runtime_vars;
+struct sock_profile sock_profiles[SOCK_PROFILES] = {
+	[SOCK_PROFILE_BACKGROUND] = { .cork = 1 },
+	[SOCK_PROFILE_INTERACTIVE] = { .cork = 1 },
+	[SOCK_PROFILE_STREAMING] = { .cork = 1 },
+	[SOCK_PROFILE_SOAP] = { .nodelay = 1 },
+};
 uint32_t runtime_flags = INOTIFY_MASK;
 
 const char *pidfilename = "/var/run/minidlna/minidlna.pid";
@@ -89,7 +95,6 @@ char db_path[PATH_MAX] = {'\0'};
 char log_path[PATH_MAX] = {'\0'};
 struct media_dir_s * media_dirs = NULL;
 struct album_art_name_s * album_art_names = NULL;
-char *transcode_tempfile = NULL;
 short int scanning = 0;
 volatile short int quitting = 0;
 volatile uint32_t updateID = 0;
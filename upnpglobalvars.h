@@ -66,7 +66,7 @@
 #endif
 
 #define USE_FORK 1
-#define DB_VERSION 9
+#define DB_VERSION 13
 
 #ifdef ENABLE_NLS
 #define _(string) gettext(string)
@@ -183,6 +183,7 @@
 extern time_t startup_time;
 
 extern struct runtime_vars_s runtime_vars;
+extern struct sock_profile sock_profiles[];
 /* runtime boolean flags */
 extern uint32_t runtime_flags;
 #define INOTIFY_MASK          0x0001
@@ -191,6 +192,7 @@ extern uint32_t runtime_flags;
 #define NO_PLAYLIST_MASK      0x0008
 #define SYSTEMD_MASK          0x0010
 #define MERGE_MEDIA_DIRS_MASK 0x0020
+#define DROP_SENT_PAGES_MASK  0x0040
 
 #define SETFLAG(mask)	runtime_flags |= mask
 #define GETFLAG(mask)	(runtime_flags & mask)
@@ -231,7 +233,6 @@ extern char db_path[];
 extern char log_path[];
 extern struct media_dir_s *media_dirs;
 extern struct album_art_name_s *album_art_names;
-extern char *transcode_tempfile;
 extern short int scanning;
 extern volatile short int quitting;
 extern volatile uint32_t updateID;
@@ -67,6 +67,9 @@
 #include <signal.h>
 #include <poll.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <netinet/tcp.h>
 
 #include "config.h"
 #include "upnpglobalvars.h"
@@ -81,7 +84,6 @@
 #include "transcode.h"
 #include "log.h"
 #include "sql.h"
-#include <libexif/exif-loader.h>
 #include "tivo_utils.h"
 #include "tivo_commands.h"
 #include "clients.h"
@@ -89,15 +91,172 @@
 #include "libav.h"
 #include "dlnameta.h"
 #include "sendfile.h"
+#include "uring.h"
+#include "image_cache.h"
+#include "bandwidth.h"
 
 #define MAX_BUFFER_SIZE_TRANSCODE 1048576 /* 1MB */
 #define MAX_BUFFER_SIZE 2147483647
 #define MIN_BUFFER_SIZE 65536
 
+/* Bounds for the per-stream readahead window, in bytes */
+#define MIN_READAHEAD     (1*1024*1024)
+#define DEFAULT_READAHEAD (8*1024*1024)
+#define MAX_READAHEAD     (64*1024*1024)
+/* Reads slower than this are logged as stalls */
+#define STALL_THRESHOLD_MS 20
+/* Paced streams send at least this much at a time, and always get at
+ * least a burst of this size up front */
+#define PACING_QUANTUM    (64*1024)
+#define PACING_MIN_BURST  (1*1024*1024)
+
 #define INIT_STR(s, d) { s.data = d; s.size = sizeof(d); s.off = 0; }
 
 #include "icons.c"
 
+/* Each stage of a connection has its own deadline, so that clients that
+ * stall or vanish don't hold on to a connection slot. */
+enum http_deadline {
+	DEADLINE_HEADERS,
+	DEADLINE_BODY,
+	DEADLINE_SEND,
+	DEADLINES
+};
+
+/* Streaming totals, shared by all worker processes */
+struct stream_stats {
+	uint64_t streams;
+	uint64_t paced;
+	uint64_t sent;		/* bytes written to the socket */
+	uint64_t consumed;	/* bytes the client actually took */
+	struct {
+		uint64_t responses;
+		uint64_t bytes;
+		uint64_t usec;
+	} profile[SOCK_PROFILES];
+	uint64_t expired[DEADLINES];	/* connections closed by each deadline */
+};
+static struct stream_stats *stream_stats;
+
+static const char * const deadline_names[DEADLINES] = {
+	[DEADLINE_HEADERS] = "Request headers",
+	[DEADLINE_BODY] = "Request body",
+	[DEADLINE_SEND] = "Send progress"
+};
+
+static const char * const sock_profile_names[SOCK_PROFILES] = {
+	[SOCK_PROFILE_BACKGROUND] = "Background",
+	[SOCK_PROFILE_INTERACTIVE] = "Interactive",
+	[SOCK_PROFILE_STREAMING] = "Streaming",
+	[SOCK_PROFILE_SOAP] = "SOAP"
+};
+
+static time_t
+monotonic_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void
+deadline_expired(enum http_deadline which)
+{
+	if (stream_stats)
+		__sync_fetch_and_add(&stream_stats->expired[which], 1);
+}
+
+/* Start the clock on the stage the connection just entered */
+static void
+set_deadline(struct upnphttp *h, int seconds)
+{
+	h->deadline = (seconds > 0) ? monotonic_time() + seconds : 0;
+}
+
+/* Once we start answering, the socket is blocking and we give up on a
+ * client that takes no data for send_timeout seconds.  SO_SNDTIMEO covers
+ * plain sends, and TCP_USER_TIMEOUT covers sends that don't honour it
+ * (io_uring) as well as clients that vanished without a reset. */
+static void
+set_send_deadline(struct upnphttp *h)
+{
+	struct timeval tv;
+#ifdef TCP_USER_TIMEOUT
+	unsigned int ms;
+#endif
+
+	h->deadline = 0;
+	if (runtime_vars.send_timeout <= 0)
+		return;
+	tv.tv_sec = runtime_vars.send_timeout;
+	tv.tv_usec = 0;
+	if (setsockopt(h->socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+		DPRINTF(E_DEBUG, L_HTTP, "setsockopt(SO_SNDTIMEO): %s\n", strerror(errno));
+#ifdef TCP_USER_TIMEOUT
+	ms = runtime_vars.send_timeout * 1000;
+	if (setsockopt(h->socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &ms, sizeof(ms)) < 0)
+		DPRINTF(E_DEBUG, L_HTTP, "setsockopt(TCP_USER_TIMEOUT): %s\n", strerror(errno));
+#endif
+}
+
+/* Count sends that failed because the client stopped taking data */
+static void
+check_send_error(int err)
+{
+	if (err == EAGAIN || err == EWOULDBLOCK || err == ETIMEDOUT)
+	{
+		DPRINTF(E_INFO, L_HTTP, "Client stopped taking data, giving up\n");
+		deadline_expired(DEADLINE_SEND);
+	}
+}
+
+static long
+elapsed_us(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000L +
+	       (now.tv_usec - start->tv_usec);
+}
+
+static void
+profile_stats_add(enum sock_profile_type type, off_t bytes, long usec)
+{
+	if( !stream_stats || bytes <= 0 )
+		return;
+	__sync_fetch_and_add(&stream_stats->profile[type].responses, 1);
+	__sync_fetch_and_add(&stream_stats->profile[type].bytes, bytes);
+	__sync_fetch_and_add(&stream_stats->profile[type].usec, MAX(usec, 1));
+}
+
+/* Apply the configured socket options for this kind of response.
+ * A corked socket is uncorked again by CloseSocket_upnphttp(). */
+static void
+set_socket_profile(struct upnphttp *h, enum sock_profile_type type)
+{
+	const struct sock_profile *p = &sock_profiles[type];
+	int on = 1;
+
+	if( p->sndbuf &&
+	    setsockopt(h->socket, SOL_SOCKET, SO_SNDBUF, &p->sndbuf, sizeof(p->sndbuf)) < 0 )
+		DPRINTF(E_DEBUG, L_HTTP, "setsockopt(SO_SNDBUF): %s\n", strerror(errno));
+#ifdef TCP_NOTSENT_LOWAT
+	if( p->notsent_lowat &&
+	    setsockopt(h->socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &p->notsent_lowat, sizeof(p->notsent_lowat)) < 0 )
+		DPRINTF(E_DEBUG, L_HTTP, "setsockopt(TCP_NOTSENT_LOWAT): %s\n", strerror(errno));
+#endif
+	if( p->nodelay &&
+	    setsockopt(h->socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0 )
+		DPRINTF(E_DEBUG, L_HTTP, "setsockopt(TCP_NODELAY): %s\n", strerror(errno));
+#ifdef TCP_CORK
+	if( p->cork && !h->res_corked &&
+	    setsockopt(h->socket, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0 )
+		h->res_corked = 1;
+#endif
+}
+
 enum event_type {
 	E_INVALID,
 	E_SUBSCRIBE,
@@ -122,12 +281,20 @@ New_upnphttp(int s)
 		return NULL;
 	memset(ret, 0, sizeof(struct upnphttp));
 	ret->socket = s;
+	set_deadline(ret, runtime_vars.header_timeout);
 	return ret;
 }
 
 void
 CloseSocket_upnphttp(struct upnphttp * h)
 {
+#ifdef TCP_CORK
+	int off = 0;
+
+	/* Push out the last partial segment right away */
+	if(h->res_corked)
+		setsockopt(h->socket, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+#endif
 	if(close(h->socket) < 0)
 	{
 		DPRINTF(E_ERROR, L_HTTP, "CloseSocket_upnphttp: close(%d): %s\n", h->socket, strerror(errno));
@@ -136,6 +303,24 @@ CloseSocket_upnphttp(struct upnphttp * h)
 	h->state = 100;
 }
 
+int
+CheckDeadline_upnphttp(struct upnphttp * h)
+{
+	time_t left;
+
+	if(h->socket < 0 || h->state > 2 || !h->deadline)
+		return -1;
+	left = h->deadline - monotonic_time();
+	if(left > 0)
+		return left;
+
+	DPRINTF(E_WARN, L_HTTP, "Closing connection from %s: %s not received in time\n",
+		inet_ntoa(h->clientaddr), h->state ? "request body" : "request headers");
+	deadline_expired(h->state ? DEADLINE_BODY : DEADLINE_HEADERS);
+	CloseSocket_upnphttp(h);
+	return 0;
+}
+
 void
 Delete_upnphttp(struct upnphttp * h)
 {
@@ -266,6 +451,27 @@ ParseHttpHeaders(struct upnphttp * h)
 						h->req_RangeEnd ? (long long)h->req_RangeEnd : -1);
 				}
 			}
+			else if(strncasecmp(line, "If-None-Match", 13)==0)
+			{
+				p = colon + 1;
+				while(isspace(*p))
+					p++;
+				n = 0;
+				while(p[n] >= ' ')
+					n++;
+				h->req_IfNoneMatch = p;
+				h->req_IfNoneMatchLen = n;
+			}
+			else if(strncasecmp(line, "If-Modified-Since", 17)==0)
+			{
+				struct tm tm;
+				p = colon + 1;
+				while(isspace(*p))
+					p++;
+				memset(&tm, 0, sizeof(tm));
+				if(strptime(p, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+					h->req_IfModifiedSince = timegm(&tm);
+			}
 			else if(strncasecmp(line, "Host", 4)==0)
 			{
 				int i;
@@ -588,23 +794,139 @@ Send501(struct upnphttp * h)
 	CloseSocket_upnphttp(h);
 }
 
-/* Sends the description generated by the parameter */
+enum desc_doc {
+	DESC_ROOT,
+	DESC_ROOT_SAMSUNG,
+	DESC_ROOT_XBOX,
+	DESC_CONTENTDIRECTORY,
+	DESC_CONNECTIONMGR,
+	DESC_MSMEDIARECEIVERREGISTRAR,
+	DESC_DOCS
+};
+
+/* The description documents only depend on settings which can't change
+ * until the next reload, and they carry no per-interface data (all URLs
+ * in them are relative), so each variant is generated once and then
+ * served as is. */
+static struct {
+	char * (*gen)(int *);
+	char *data;
+	int len;
+	char etag[12];
+} desc_cache[DESC_DOCS] = {
+	{ genRootDesc },
+	{ genRootDescSamsung },
+	{ genRootDescXbox },
+	{ genContentDirectory },
+	{ genConnectionManager },
+	{ genX_MS_MediaReceiverRegistrar },
+};
+static volatile sig_atomic_t desc_cache_stale = 1;
+
+/* FNV-1a, used to derive entity tags from content */
+static uint32_t
+hash_data(const char *data, int len)
+{
+	uint32_t hash = 2166136261U;
+	int i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)data[i]) * 16777619U;
+
+	return hash;
+}
+
+void
+BuildDescCache_upnphttp(void)
+{
+	char *desc;
+	int len, i;
+
+	/* Cleared first, so that an invalidation while we are busy sticks */
+	desc_cache_stale = 0;
+	for (i = 0; i < DESC_DOCS; i++)
+	{
+		desc = desc_cache[i].gen(&len);
+		if (!desc)
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Failed to generate XML description\n");
+			continue;
+		}
+		free(desc_cache[i].data);
+		desc_cache[i].data = desc;
+		desc_cache[i].len = len;
+		snprintf(desc_cache[i].etag, sizeof(desc_cache[i].etag), "\"%08x\"",
+		         hash_data(desc, len));
+	}
+}
+
+void
+InvalidateDescCache_upnphttp(void)
+{
+	desc_cache_stale = 1;
+}
+
+void
+FreeDescCache_upnphttp(void)
+{
+	int i;
+
+	for (i = 0; i < DESC_DOCS; i++)
+	{
+		free(desc_cache[i].data);
+		desc_cache[i].data = NULL;
+	}
+	desc_cache_stale = 1;
+}
+
+/* Check the request's If-None-Match list against our entity tag.
+ * If-None-Match uses the weak comparison, so W/ prefixes are ignored. */
+static int
+etag_matches(struct upnphttp *h, const char *etag)
+{
+	const char *p = h->req_IfNoneMatch;
+	const char *end = p + h->req_IfNoneMatchLen;
+	int len = strlen(etag);
+	int n;
+
+	if (!p)
+		return 0;
+	while (p < end)
+	{
+		while (p < end && (*p == ',' || isspace(*p)))
+			p++;
+		if (end - p >= 2 && strncmp(p, "W/", 2) == 0)
+			p += 2;
+		n = 0;
+		while (p + n < end && p[n] != ',' && !isspace(p[n]))
+			n++;
+		if ((n == 1 && *p == '*') ||
+		    (n == len && strncmp(p, etag, len) == 0))
+			return 1;
+		p += n;
+	}
+
+	return 0;
+}
+
+/* Sends a cached description document */
 static void
-sendXMLdesc(struct upnphttp * h, char * (f)(int *))
+sendXMLdesc(struct upnphttp * h, enum desc_doc doc)
 {
-	char * desc;
-	int len;
-	desc = f(&len);
-	if(!desc)
+	if (desc_cache_stale)
+		BuildDescCache_upnphttp();
+	if (!desc_cache[doc].data)
 	{
-		DPRINTF(E_ERROR, L_HTTP, "Failed to generate XML description\n");
 		Send500(h);
 		return;
 	}
-	BuildResp_upnphttp(h, desc, len);
+	h->res_etag = desc_cache[doc].etag;
+	if (etag_matches(h, desc_cache[doc].etag))
+		BuildResp2_upnphttp(h, 304, "Not Modified", NULL, 0);
+	else
+		BuildResp_upnphttp(h, desc_cache[doc].data, desc_cache[doc].len);
 	SendResp_upnphttp(h);
 	CloseSocket_upnphttp(h);
-	free(desc);
 }
 
 #ifdef READYNAS
@@ -628,16 +950,16 @@ static void
 SendResp_presentation(struct upnphttp * h)
 {
 	struct string_s str;
-	char body[4096];
+	char body[8192];
 	int a, v, p, i;
 
 	INIT_STR(str, body);
 
 	h->respflags = FLAG_HTML;
 
-	a = sql_get_int_field(db, "SELECT count(*) from DETAILS where MIME glob 'a*'");
-	v = sql_get_int_field(db, "SELECT count(*) from DETAILS where MIME glob 'v*'");
-	p = sql_get_int_field(db, "SELECT count(*) from DETAILS where MIME glob 'i*'");
+	a = sql_get_int_field(h->db, "SELECT count(*) from DETAILS where MIME glob 'a*'");
+	v = sql_get_int_field(h->db, "SELECT count(*) from DETAILS where MIME glob 'v*'");
+	p = sql_get_int_field(h->db, "SELECT count(*) from DETAILS where MIME glob 'i*'");
 	strcatf(&str,
 		"<HTML><HEAD><TITLE>" SERVER_NAME " " MINIDLNA_VERSION "</TITLE></HEAD>"
 		"<BODY><div style=\"text-align: center\">"
@@ -671,6 +993,54 @@ SendResp_presentation(struct upnphttp * h)
 	strcatf(&str, "</table>");
 
 	strcatf(&str, "<br>%d connection%s currently open<br>", number_of_children, (number_of_children == 1 ? "" : "s"));
+	strcatf(&str, "%lu SQL queries reused a prepared statement, %lu were compiled<br>",
+		sql_stmt_stats.hits, sql_stmt_stats.compiles);
+	strcatf(&str, "%lu Browse/Search requests were answered from the response cache, %lu were not "
+		"(%d responses cached, %lu KB)<br>",
+		resp_cache_stats.hits, resp_cache_stats.misses,
+		resp_cache_stats.entries, (unsigned long)(resp_cache_stats.bytes >> 10));
+
+	if (stream_stats)
+		strcatf(&str,
+			"<h3>Streaming</h3>"
+			"<table border=1 cellpadding=10>"
+			"<tr><td>Transfers</td><td>%llu (%llu paced)</td></tr>"
+			"<tr><td>MB sent</td><td>%llu</td></tr>"
+			"<tr><td>MB consumed by clients</td><td>%llu</td></tr>"
+			"</table>",
+			(unsigned long long)stream_stats->streams,
+			(unsigned long long)stream_stats->paced,
+			(unsigned long long)(stream_stats->sent >> 20),
+			(unsigned long long)(stream_stats->consumed >> 20));
+	if (stream_stats)
+	{
+		strcatf(&str,
+			"<h3>Socket profiles</h3>"
+			"<table border=1 cellpadding=10>"
+			"<tr><td>Profile</td><td>Responses</td><td>MB</td><td>Average Mbit/s</td></tr>");
+		for (i = 0; i < SOCK_PROFILES; i++)
+		{
+			uint64_t usec = stream_stats->profile[i].usec;
+			strcatf(&str, "<tr><td>%s</td><td>%llu</td><td>%llu</td><td>%.1f</td></tr>",
+				sock_profile_names[i],
+				(unsigned long long)stream_stats->profile[i].responses,
+				(unsigned long long)(stream_stats->profile[i].bytes >> 20),
+				usec ? (double)stream_stats->profile[i].bytes * 8 / usec : 0.0);
+		}
+		strcatf(&str, "</table>");
+
+		strcatf(&str,
+			"<h3>Connection deadlines</h3>"
+			"<table border=1 cellpadding=10>"
+			"<tr><td>Stage</td><td>Timeout (s)</td><td>Connections closed</td></tr>");
+		for (i = 0; i < DEADLINES; i++)
+			strcatf(&str, "<tr><td>%s</td><td>%d</td><td>%llu</td></tr>",
+				deadline_names[i],
+				i == DEADLINE_HEADERS ? runtime_vars.header_timeout :
+				i == DEADLINE_BODY ? runtime_vars.body_timeout : runtime_vars.send_timeout,
+				(unsigned long long)stream_stats->expired[i]);
+		strcatf(&str, "</table>");
+	}
 	strcatf(&str, "</BODY></HTML>\r\n");
 
 	BuildResp_upnphttp(h, str.data, str.off);
@@ -688,10 +1058,15 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 		if(h->req_soapAction)
 		{
 			/* we can process the request */
+			struct timeval start;
+
 			DPRINTF(E_DEBUG, L_HTTP, "SOAPAction: %.*s\n", h->req_soapActionLen, h->req_soapAction);
+			set_socket_profile(h, SOCK_PROFILE_SOAP);
+			gettimeofday(&start, NULL);
 			ExecuteSoapAction(h,
 				h->req_soapAction,
 				h->req_soapActionLen);
+			profile_stats_add(SOCK_PROFILE_SOAP, h->res_buflen + h->res_sent, elapsed_us(&start));
 		}
 		else
 		{
@@ -709,6 +1084,7 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 	{
 		/* waiting for remaining data */
 		h->state = 1;
+		set_deadline(h, runtime_vars.body_timeout);
 	}
 }
 
@@ -890,6 +1266,7 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 		if( h->req_chunklen )
 		{
 			h->state = 2;
+			set_deadline(h, runtime_vars.body_timeout);
 			return;
 		}
 		char *chunkstart, *chunk, *endptr, *endbuf;
@@ -950,40 +1327,28 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 			/* If it's a Xbox360, we might need a special friendly_name to be recognized */
 			if( h->req_client && h->req_client->type->type == EXbox )
 			{
-				char model_sav[2];
-				i = 0;
-				memcpy(model_sav, modelnumber, 2);
-				strcpy(modelnumber, "1");
-				if( !strchr(friendly_name, ':') )
-				{
-					i = strlen(friendly_name);
-					snprintf(friendly_name+i, FRIENDLYNAME_MAX_LEN-i, ": 1");
-				}
-				sendXMLdesc(h, genRootDesc);
-				if( i )
-					friendly_name[i] = '\0';
-				memcpy(modelnumber, model_sav, 2);
+				sendXMLdesc(h, DESC_ROOT_XBOX);
 			}
 			else if( h->req_client && h->req_client->type->flags & FLAG_SAMSUNG_DCM10 )
 			{
-				sendXMLdesc(h, genRootDescSamsung);
+				sendXMLdesc(h, DESC_ROOT_SAMSUNG);
 			}
 			else
 			{
-				sendXMLdesc(h, genRootDesc);
+				sendXMLdesc(h, DESC_ROOT);
 			}
 		}
 		else if(strcmp(CONTENTDIRECTORY_PATH, HttpUrl) == 0)
 		{
-			sendXMLdesc(h, genContentDirectory);
+			sendXMLdesc(h, DESC_CONTENTDIRECTORY);
 		}
 		else if(strcmp(CONNECTIONMGR_PATH, HttpUrl) == 0)
 		{
-			sendXMLdesc(h, genConnectionManager);
+			sendXMLdesc(h, DESC_CONNECTIONMGR);
 		}
 		else if(strcmp(X_MS_MEDIARECEIVERREGISTRAR_PATH, HttpUrl) == 0)
 		{
-			sendXMLdesc(h, genX_MS_MediaReceiverRegistrar);
+			sendXMLdesc(h, DESC_MSMEDIARECEIVERREGISTRAR);
 		}
 		else if(strncmp(HttpUrl, "/MediaItems/", 12) == 0)
 		{
@@ -1075,12 +1440,17 @@ Process_upnphttp(struct upnphttp *h)
 	int n;
 	if(!h)
 		return;
+	/* Whatever this event gets to serve reads through its own connection */
+	h->db = sql_checkout();
 	switch(h->state)
 	{
 	case 0:
 		n = recv(h->socket, buf, 2048, 0);
 		if(n<0)
 		{
+			/* Accepted sockets are non-blocking until the headers are in */
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				break;
 			DPRINTF(E_ERROR, L_HTTP, "recv (state0): %s\n", strerror(errno));
 			h->state = 100;
 		}
@@ -1118,6 +1488,9 @@ Process_upnphttp(struct upnphttp *h)
 			{
 				h->req_contentoff = endheaders - h->req_buf + 4;
 				h->req_contentlen = h->req_buflen - h->req_contentoff;
+				/* Responses are written with blocking sends */
+				fcntl(h->socket, F_SETFL, fcntl(h->socket, F_GETFL) & ~O_NONBLOCK);
+				set_send_deadline(h);
 				ProcessHttpQuery_upnphttp(h);
 			}
 		}
@@ -1127,6 +1500,8 @@ Process_upnphttp(struct upnphttp *h)
 		n = recv(h->socket, buf, sizeof(buf), 0);
 		if(n < 0)
 		{
+			if(errno == EINTR)
+				break;
 			DPRINTF(E_ERROR, L_HTTP, "recv (state%d): %s\n", h->state, strerror(errno));
 			h->state = 100;
 		}
@@ -1166,6 +1541,8 @@ Process_upnphttp(struct upnphttp *h)
 	default:
 		DPRINTF(E_WARN, L_HTTP, "Unexpected state: %d\n", h->state);
 	}
+	sql_checkin(h->db);
+	h->db = NULL;
 }
 
 /* with response code and response message
@@ -1179,13 +1556,21 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	static const char httpresphead[] =
 		"%s %d %s\r\n"
 		"Content-Type: %s\r\n"
-		"Connection: close\r\n"
-		"Content-Length: %d\r\n"
-		"Server: " MINIDLNA_SERVER_STRING "\r\n";
+		"Connection: close\r\n";
 	time_t curtime = time(NULL);
 	char date[30];
 	int templen;
 	struct string_s res;
+	/* A body of unknown length goes out through SendChunk_upnphttp(),
+	 * chunked unless the client only speaks HTTP/1.0 */
+	if(bodylen < 0)
+	{
+		bodylen = 0;
+		h->respflags |= FLAG_STREAMED;
+		if(strcmp(h->HttpVer, "HTTP/1.0") != 0)
+			h->respflags |= FLAG_CHUNKED;
+		h->res_sent = 0;
+	}
 	if(!h->res_buf)
 	{
 		templen = sizeof(httpresphead) + 256 + bodylen;
@@ -1197,8 +1582,12 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	res.off = 0;
 	strcatf(&res, httpresphead, "HTTP/1.1",
 	              respcode, respmsg,
-	              (h->respflags&FLAG_HTML)?"text/html":"text/xml; charset=\"utf-8\"",
-							 bodylen);
+	              (h->respflags&FLAG_HTML)?"text/html":"text/xml; charset=\"utf-8\"");
+	if(h->respflags & FLAG_CHUNKED)
+		strcatf(&res, "Transfer-Encoding: chunked\r\n");
+	else if(!(h->respflags & FLAG_STREAMED))
+		strcatf(&res, "Content-Length: %d\r\n", bodylen);
+	strcatf(&res, "Server: %s\r\n", MINIDLNA_SERVER_STRING);
 	/* Additional headers */
 	if(h->respflags & FLAG_TIMEOUT) {
 		strcatf(&res, "Timeout: Second-");
@@ -1214,6 +1603,9 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	if(h->reqflags & FLAG_LANGUAGE) {
 		strcatf(&res, "Content-Language: en\r\n");
 	}
+	if(h->res_etag) {
+		strcatf(&res, "ETag: %s\r\n", h->res_etag);
+	}
 	strftime(date, 30,"%a, %d %b %Y %H:%M:%S GMT" , gmtime(&curtime));
 	strcatf(&res, "Date: %s\r\n", date);
 	strcatf(&res, "EXT:\r\n");
@@ -1273,12 +1665,13 @@ send_data(struct upnphttp * h, char * header, size_t size, int flags)
 	if(n<0)
 	{
 		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %s\n", strerror(errno));
+		check_send_error(errno);
 	}
-	else if(n < h->res_buflen)
+	else if(n < size)
 	{
 		/* TODO : handle correctly this case */
-		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %d bytes sent (out of %d)\n",
-						n, h->res_buflen);
+		DPRINTF(E_ERROR, L_HTTP, "send(res_buf): %d bytes sent (out of %zu)\n",
+						n, size);
 	}
 	else
 	{
@@ -1287,22 +1680,323 @@ send_data(struct upnphttp * h, char * header, size_t size, int flags)
 	return 1;
 }
 
+int
+SendChunk_upnphttp(struct upnphttp * h, const char * data, int len)
+{
+	char buf[16];
+	int n;
+
+	/* HTTP/1.0 gets the data as it is, ended by closing the connection */
+	if(!(h->respflags & FLAG_CHUNKED))
+	{
+		if(len <= 0)
+			return 0;
+		if(send_data(h, (char *)data, len, MSG_MORE) != 0)
+			return 1;
+		h->res_sent += len;
+		return 0;
+	}
+	if(len <= 0)
+		return send_data(h, "0\r\n\r\n", 5, 0);
+	n = snprintf(buf, sizeof(buf), "%x\r\n", len);
+	if(send_data(h, buf, n, MSG_MORE) != 0 ||
+	   send_data(h, (char *)data, len, MSG_MORE) != 0 ||
+	   send_data(h, "\r\n", 2, MSG_MORE) != 0)
+		return 1;
+	h->res_sent += len;
+
+	return 0;
+}
+
+pid_t
+ForkResp_upnphttp(struct upnphttp * h)
+{
+#if USE_FORK
+	char path[PATH_MAX];
+	sqlite3 *conn = NULL;
+	pid_t pid;
+
+	pid = process_fork(h->req_client);
+	if( pid > 0 )
+	{
+		/* Leave the socket options to the worker */
+		h->res_corked = 0;
+		CloseSocket_upnphttp(h);
+	}
+	if( pid != 0 )
+		return pid;
+
+	sql_forget();
+	snprintf(path, sizeof(path), "%s/files.db", db_path);
+	if( sqlite3_open_v2(path, &conn, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK )
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Failed to open database for response: %s\n",
+			conn ? sqlite3_errmsg(conn) : "out of memory");
+		Send500(h);
+		_exit(0);
+	}
+	sqlite3_busy_timeout(conn, 5000);
+	h->db = conn;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/* Page cache management for streamed files.  We keep a window of hinted
+ * pages ahead of the send offset, sized from the item's bitrate, and
+ * optionally drop pages we have already sent so large streams don't push
+ * the database and art cache out of memory. */
+struct stream_readahead {
+	off_t window;		/* bytes to keep hinted ahead; 0 = disabled */
+	off_t hinted;		/* end of the last WILLNEED window */
+	off_t dropped;		/* pages below this offset have been dropped */
+	int stalls;
+	long stall_ms;
+	long max_stall_ms;
+};
+
+static long
+elapsed_ms(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_usec - start->tv_usec) / 1000;
+}
+
+static void
+readahead_begin(struct stream_readahead *ra, int fd, off_t offset, off_t end_offset, int bitrate)
+{
+	memset(ra, 0, sizeof(*ra));
+	if( runtime_vars.readahead_secs <= 0 )
+		return;
+	ra->window = (bitrate > 0) ? (off_t)bitrate * runtime_vars.readahead_secs : DEFAULT_READAHEAD;
+	if( ra->window < MIN_READAHEAD )
+		ra->window = MIN_READAHEAD;
+	else if( ra->window > MAX_READAHEAD )
+		ra->window = MAX_READAHEAD;
+	/* Small files are better left to the kernel */
+	if( end_offset - offset + 1 <= ra->window )
+	{
+		ra->window = 0;
+		return;
+	}
+	posix_fadvise(fd, offset, end_offset - offset + 1, POSIX_FADV_SEQUENTIAL);
+	ra->hinted = offset;
+	ra->dropped = offset;
+}
+
+static void
+readahead_advance(struct stream_readahead *ra, int fd, off_t offset, off_t end_offset)
+{
+	off_t start, len;
+
+	if( !ra->window )
+		return;
+	/* Top up the window once half of it has been consumed */
+	if( ra->hinted <= end_offset && ra->hinted - offset < ra->window / 2 )
+	{
+		start = MAX(ra->hinted, offset);
+		len = MIN(offset + ra->window, end_offset + 1) - start;
+		posix_fadvise(fd, start, len, POSIX_FADV_WILLNEED);
+		ra->hinted = start + len;
+	}
+	if( GETFLAG(DROP_SENT_PAGES_MASK) && offset - ra->dropped >= ra->window )
+	{
+		start = ra->dropped & ~((off_t)4096 - 1);
+		posix_fadvise(fd, start, offset - start, POSIX_FADV_DONTNEED);
+		ra->dropped = offset;
+	}
+}
+
+static void
+readahead_stall(struct stream_readahead *ra, struct upnphttp *h, off_t offset, long ms)
+{
+	if( ms < STALL_THRESHOLD_MS )
+		return;
+	ra->stalls++;
+	ra->stall_ms += ms;
+	if( ms > ra->max_stall_ms )
+		ra->max_stall_ms = ms;
+	DPRINTF(E_DEBUG, L_HTTP, "Read stall of %ld ms at offset %jd for %s\n",
+	        ms, (intmax_t)offset, inet_ntoa(h->clientaddr));
+}
+
+/* Wait for the page at offset to be readable, and account for the time
+ * spent if it had to come from disk.  sendfile() gives us no way to tell
+ * disk waits from socket waits, so probe the page cache up front. */
+static void
+readahead_wait(struct stream_readahead *ra, struct upnphttp *h, int fd, off_t offset)
+{
+#ifdef RWF_NOWAIT
+	struct timeval start;
+	struct iovec iov;
+	char c;
+
+	if( !ra->window )
+		return;
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	if( preadv2(fd, &iov, 1, offset, RWF_NOWAIT) >= 0 || errno != EAGAIN )
+		return;
+	gettimeofday(&start, NULL);
+	if( pread(fd, &c, 1, offset) < 0 )
+		return;
+	readahead_stall(ra, h, offset, elapsed_ms(&start));
+#endif
+}
+
 static void
-send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
+readahead_end(struct stream_readahead *ra, struct upnphttp *h, int fd, off_t offset)
+{
+	if( !ra->window )
+		return;
+	if( GETFLAG(DROP_SENT_PAGES_MASK) && offset > ra->dropped )
+		posix_fadvise(fd, ra->dropped & ~((off_t)4096 - 1),
+		              offset - (ra->dropped & ~((off_t)4096 - 1)), POSIX_FADV_DONTNEED);
+	if( ra->stalls )
+		DPRINTF(E_INFO, L_HTTP, "Stream to %s had %d read stalls (%ld ms total, %ld ms max)\n",
+		        inet_ntoa(h->clientaddr), ra->stalls, ra->stall_ms, ra->max_stall_ms);
+}
+
+void
+InitStreamStats_upnphttp(void)
+{
+	void *p;
+
+	p = mmap(NULL, sizeof(struct stream_stats), PROT_READ|PROT_WRITE,
+	         MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if( p == MAP_FAILED )
+	{
+		DPRINTF(E_WARN, L_GENERAL, "Failed to map stream statistics: %s\n", strerror(errno));
+		return;
+	}
+	stream_stats = p;
+}
+
+/* Record a finished transfer.  If we stopped early, whatever is still
+ * sitting unacknowledged in the socket's send queue was thrown away by
+ * the client. */
+static void
+stream_stats_add(struct upnphttp *h, off_t sent, int finished, int paced)
+{
+	off_t consumed = sent;
+#ifdef SIOCOUTQ
+	int outq;
+
+	if( !finished && ioctl(h->socket, SIOCOUTQ, &outq) == 0 && outq > 0 )
+		consumed = MAX(0, sent - outq);
+#endif
+	if( !finished )
+		DPRINTF(E_DEBUG, L_HTTP, "Stream to %s ended early: %jd bytes sent, %jd consumed\n",
+		        inet_ntoa(h->clientaddr), (intmax_t)sent, (intmax_t)consumed);
+	if( !stream_stats )
+		return;
+	__sync_fetch_and_add(&stream_stats->streams, 1);
+	if( paced )
+		__sync_fetch_and_add(&stream_stats->paced, 1);
+	__sync_fetch_and_add(&stream_stats->sent, sent);
+	__sync_fetch_and_add(&stream_stats->consumed, consumed);
+}
+
+/* Token bucket pacing at a multiple of the item's bitrate.  The bucket
+ * starts out full, so the renderer can fill its buffer right away; after
+ * that, we only send as fast as tokens come in.  Renderers that give up
+ * after a few seconds then don't drag the rest of the file off disk. */
+struct stream_pacer {
+	double rate;		/* bytes per second; 0 = unpaced */
+	double depth;		/* bucket size, in bytes */
+	double tokens;
+	struct timeval last;
+};
+
+static void
+pacer_begin(struct stream_pacer *p, int bitrate)
+{
+	memset(p, 0, sizeof(*p));
+	if( runtime_vars.pacing_pct <= 0 || bitrate <= 0 )
+		return;
+	p->rate = (double)bitrate * runtime_vars.pacing_pct / 100;
+	p->depth = (double)bitrate * runtime_vars.pacing_burst_secs;
+	if( p->depth < PACING_MIN_BURST )
+		p->depth = PACING_MIN_BURST;
+	p->tokens = p->depth;
+	gettimeofday(&p->last, NULL);
+}
+
+/* Wait until some of the wanted bytes may be sent, and return how many */
+static off_t
+pacer_take(struct stream_pacer *p, off_t want)
+{
+	struct timeval now;
+	double need;
+
+	if( !p->rate )
+		return want;
+	for (;;)
+	{
+		gettimeofday(&now, NULL);
+		p->tokens += p->rate * ((now.tv_sec - p->last.tv_sec) +
+		                        (now.tv_usec - p->last.tv_usec) / 1000000.0);
+		if( p->tokens > p->depth )
+			p->tokens = p->depth;
+		p->last = now;
+		need = MIN(want, PACING_QUANTUM);
+		if( p->tokens >= need )
+			break;
+		usleep((need - p->tokens) * 1000000 / p->rate);
+	}
+
+	return MIN(want, (off_t)p->tokens);
+}
+
+static void
+pacer_spend(struct stream_pacer *p, off_t sent)
+{
+	if( p->rate )
+		p->tokens -= sent;
+}
+
+static void
+send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset, int bitrate, enum bw_class cls)
 {
 	off_t send_size;
 	off_t ret;
+	off_t start_offset = offset;
 	char *buf = NULL;
+	struct stream_readahead ra;
+	struct stream_pacer pacer;
+	struct bw_flow flow;
+	struct timeval start, begin;
 #if HAVE_SENDFILE
 	int try_sendfile = 1;
 #endif
+#ifdef HAVE_LIBURING
+	struct uring_stream *ring = NULL;
+	int try_uring = 1;
+#endif
 
+	gettimeofday(&begin, NULL);
+	readahead_begin(&ra, sendfd, offset, end_offset, bitrate);
+	/* Only pace from a worker; the main process must not sleep */
+	pacer_begin(&pacer, bw_worker() ? bitrate : 0);
+	bw_flow_begin(&flow, h->clientaddr, cls, bitrate);
 	while( offset <= end_offset )
 	{
+		readahead_advance(&ra, sendfd, offset, end_offset);
 #if HAVE_SENDFILE
 		if( try_sendfile )
 		{
 			send_size = ( ((end_offset - offset) < MAX_BUFFER_SIZE) ? (end_offset - offset + 1) : MAX_BUFFER_SIZE);
+			/* Come back between chunks to keep the readahead window moving */
+			if( ra.window && send_size > ra.window / 2 )
+				send_size = ra.window / 2;
+			send_size = pacer_take(&pacer, send_size);
+			send_size = bw_take(&flow, send_size);
+			readahead_wait(&ra, h, sendfd, offset);
 			ret = sys_sendfile(h->socket, sendfd, &offset, send_size);
 			if( ret == -1 )
 			{
@@ -1310,22 +2004,60 @@ send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
 				/* If sendfile isn't supported on the filesystem, don't bother trying to use it again. */
 				if( errno == EOVERFLOW || errno == EINVAL )
 					try_sendfile = 0;
-				else if( errno != EAGAIN )
+				else
+				{
+					check_send_error(errno);
 					break;
+				}
 			}
 			else
 			{
 				//DPRINTF(E_DEBUG, L_HTTP, "sent %lld bytes to %d. offset is now %lld.\n", ret, h->socket, offset);
+				pacer_spend(&pacer, ret);
+				bw_spend(&flow, ret);
+				continue;
+			}
+		}
+#endif
+#ifdef HAVE_LIBURING
+		if( try_uring && !ring && !(ring = uring_open(h->socket, sendfd)) )
+			try_uring = 0;
+		if( try_uring )
+		{
+			/* Paced and scheduled streams go out in slices, all through one ring */
+			send_size = pacer_take(&pacer, end_offset - offset + 1);
+			send_size = bw_take(&flow, send_size);
+			ret = offset;
+			if( uring_send_file(ring, &offset, offset + send_size - 1) == 0 )
+			{
+				pacer_spend(&pacer, offset - ret);
+				bw_spend(&flow, offset - ret);
 				continue;
 			}
+			pacer_spend(&pacer, offset - ret);
+			bw_spend(&flow, offset - ret);
+			DPRINTF(E_DEBUG, L_HTTP, "io_uring error :: error no. %d [%s]\n", errno, strerror(errno));
+			/* Pick up where io_uring left off, using regular I/O */
+			if( errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP )
+			{
+				check_send_error(errno);
+				break;
+			}
+			try_uring = 0;
+			continue;
 		}
 #endif
 		/* Fall back to regular I/O */
 		if( !buf )
 			buf = malloc(MIN_BUFFER_SIZE);
 		send_size = (((end_offset - offset) < MIN_BUFFER_SIZE) ? (end_offset - offset + 1) : MIN_BUFFER_SIZE);
+		send_size = pacer_take(&pacer, send_size);
+		send_size = bw_take(&flow, send_size);
 		lseek(sendfd, offset, SEEK_SET);
+		gettimeofday(&start, NULL);
 		ret = read(sendfd, buf, send_size);
+		if( ra.window )
+			readahead_stall(&ra, h, offset, elapsed_ms(&start));
 		if( ret == -1 ) {
 			DPRINTF(E_DEBUG, L_HTTP, "read error :: error no. %d [%s]\n", errno, strerror(errno));
 			if( errno == EAGAIN )
@@ -1336,13 +2068,22 @@ send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
 		ret = write(h->socket, buf, ret);
 		if( ret == -1 ) {
 			DPRINTF(E_DEBUG, L_HTTP, "write error :: error no. %d [%s]\n", errno, strerror(errno));
-			if( errno == EAGAIN )
+			if( errno == EINTR )
 				continue;
-			else
-				break;
+			check_send_error(errno);
+			break;
 		}
 		offset += ret;
+		pacer_spend(&pacer, ret);
+		bw_spend(&flow, ret);
 	}
+#ifdef HAVE_LIBURING
+	uring_close(ring);
+#endif
+	bw_flow_end(&flow);
+	readahead_end(&ra, h, sendfd, offset);
+	stream_stats_add(h, offset - start_offset, offset > end_offset, pacer.rate > 0);
+	profile_stats_add((enum sock_profile_type)cls, offset - start_offset, elapsed_us(&begin));
 	free(buf);
 }
 
@@ -1365,6 +2106,77 @@ start_dlna_header(struct string_s *str, int respcode, const char *tmode, const c
 	             respcode, date, tmode, mime);
 }
 
+/* Art and icon URLs keep pointing at the same bytes until a rescan,
+ * so renderers may reuse them for a day without asking again. */
+#define ART_MAX_AGE 86400
+
+/* Cache validators for a response body */
+struct http_validator {
+	char etag[64];
+	time_t mtime;		/* 0 for no Last-Modified */
+	int max_age;		/* 0 for no Cache-Control */
+};
+
+static void
+set_validator(struct http_validator *v, long long id, time_t mtime, off_t size, int max_age)
+{
+	snprintf(v->etag, sizeof(v->etag), "\"%llx-%lx-%jx\"",
+	         id, (long)mtime, (intmax_t)size);
+	v->mtime = mtime;
+	v->max_age = max_age;
+}
+
+static void
+add_validator_headers(struct string_s *str, const struct http_validator *v)
+{
+	char date[30];
+
+	strcatf(str, "ETag: %s\r\n", v->etag);
+	if( v->mtime )
+	{
+		strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&v->mtime));
+		strcatf(str, "Last-Modified: %s\r\n", date);
+	}
+	if( v->max_age )
+		strcatf(str, "Cache-Control: max-age=%d\r\n", v->max_age);
+}
+
+/* If the client already holds the current representation, answer with
+ * 304 Not Modified and return 1.  If-None-Match takes precedence over
+ * If-Modified-Since, as RFC 7232 requires. */
+static int
+send_not_modified(struct upnphttp *h, const struct http_validator *v)
+{
+	char header[512];
+	char date[30];
+	struct string_s str;
+	time_t now;
+
+	if( h->req_IfNoneMatch )
+	{
+		if( !etag_matches(h, v->etag) )
+			return 0;
+	}
+	else if( !h->req_IfModifiedSince || !v->mtime || v->mtime > h->req_IfModifiedSince )
+		return 0;
+
+	DPRINTF(E_DEBUG, L_HTTP, "Client copy is current, responding 304\n");
+	now = time(NULL);
+	strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&now));
+	INIT_STR(str, header);
+	strcatf(&str, "HTTP/1.1 304 Not Modified\r\n"
+	              "Connection: close\r\n"
+	              "Date: %s\r\n"
+	              "Server: " MINIDLNA_SERVER_STRING "\r\n"
+	              "EXT:\r\n", date);
+	add_validator_headers(&str, v);
+	strcatf(&str, "\r\n");
+	send_data(h, str.data, str.off, 0);
+	CloseSocket_upnphttp(h);
+
+	return 1;
+}
+
 /* Mostly copied from Hiero's patch */
 static void
 send_file_transcode(char* transcoder, struct upnphttp * h, int offset, int end_offset, char *filename)
@@ -1429,8 +2241,11 @@ send_file_transcode(char* transcoder, struct upnphttp * h, int offset, int end_o
 		if ( send_size == -1 )
 		{
 			DPRINTF(E_DEBUG, L_HTTP, "Sendfile error :: error no. %d [%s]\n", errno, strerror(errno));
-			if( errno != EAGAIN )
+			if( errno != EINTR )
+			{
+				check_send_error(errno);
 				break;
+			}
 		}
 		/*else
 		{
@@ -1466,6 +2281,7 @@ SendResp_icon(struct upnphttp * h, char * icon)
 	char *data;
 	int size;
 	struct string_s str;
+	struct http_validator v;
 
 	if( strcmp(icon, "sm.png") == 0 )
 	{
@@ -1502,9 +2318,15 @@ SendResp_icon(struct upnphttp * h, char * icon)
 		return;
 	}
 
+	set_validator(&v, hash_data(data, size), 0, size, ART_MAX_AGE);
+	if( send_not_modified(h, &v) )
+		return;
+
 	INIT_STR(str, header);
 
+	set_socket_profile(h, SOCK_PROFILE_INTERACTIVE);
 	start_dlna_header(&str, 200, "Interactive", mime);
+	add_validator_headers(&str, &v);
 	strcatf(&str, "Content-Length: %d\r\n\r\n", size);
 
 	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
@@ -1515,6 +2337,19 @@ SendResp_icon(struct upnphttp * h, char * icon)
 	CloseSocket_upnphttp(h);
 }
 
+/* Fixed single-value lookups by numeric ID go through the statement cache */
+static char *
+get_text_by_id(sqlite3 *db, const char *sql, long long id)
+{
+	sqlite3_stmt *stmt;
+
+	stmt = sql_prepare_cached(db, sql);
+	if( !stmt )
+		return NULL;
+	sqlite3_bind_int64(stmt, 1, id);
+	return sql_get_text_cached(stmt);
+}
+
 static void
 SendResp_albumArt(struct upnphttp * h, char * object)
 {
@@ -1523,7 +2358,9 @@ SendResp_albumArt(struct upnphttp * h, char * object)
 	off_t size;
 	long long id;
 	int fd;
+	struct stat st;
 	struct string_s str;
+	struct http_validator v;
 
 	if( h->reqflags & (FLAG_XFERSTREAMING|FLAG_RANGE) )
 	{
@@ -1534,7 +2371,7 @@ SendResp_albumArt(struct upnphttp * h, char * object)
 
 	id = strtoll(object, NULL, 10);
 
-	path = sql_get_text_field(db, "SELECT PATH from ALBUM_ART where ID = '%lld'", id);
+	path = get_text_by_id(h->db, "SELECT PATH from ALBUM_ART where ID = ?", id);
 	if( !path )
 	{
 		DPRINTF(E_WARN, L_HTTP, "ALBUM_ART ID %s not found, responding ERROR 404\n", object);
@@ -1544,19 +2381,29 @@ SendResp_albumArt(struct upnphttp * h, char * object)
 	DPRINTF(E_INFO, L_HTTP, "Serving album art ID: %lld [%s]\n", id, path);
 
 	fd = open(path, O_RDONLY);
-	if( fd < 0 ) {
+	if( fd < 0 || fstat(fd, &st) != 0 ) {
 		DPRINTF(E_ERROR, L_HTTP, "Error opening %s\n", path);
+		if( fd >= 0 )
+			close(fd);
 		sqlite3_free(path);
 		Send404(h);
 		return;
 	}
 	sqlite3_free(path);
-	size = lseek(fd, 0, SEEK_END);
-	lseek(fd, 0, SEEK_SET);
+	size = st.st_size;
+
+	set_validator(&v, id, st.st_mtime, size, ART_MAX_AGE);
+	if( send_not_modified(h, &v) )
+	{
+		close(fd);
+		return;
+	}
 
 	INIT_STR(str, header);
 
+	set_socket_profile(h, SOCK_PROFILE_INTERACTIVE);
 	start_dlna_header(&str, 200, "Interactive", "image/jpeg");
+	add_validator_headers(&str, &v);
 	strcatf(&str, "Content-Length: %jd\r\n"
 	              "contentFeatures.dlna.org: DLNA.ORG_PN=JPEG_TN\r\n\r\n",
 	              (intmax_t)size);
@@ -1564,7 +2411,7 @@ SendResp_albumArt(struct upnphttp * h, char * object)
 	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
 	{
 		if( h->req_command != EHead )
-			send_file(h, fd, 0, size-1);
+			send_file(h, fd, 0, size-1, 0, BW_INTERACTIVE);
 	}
 	close(fd);
 	CloseSocket_upnphttp(h);
@@ -1578,11 +2425,13 @@ SendResp_caption(struct upnphttp * h, char * object)
 	off_t size;
 	long long id;
 	int fd;
+	struct stat st;
 	struct string_s str;
+	struct http_validator v;
 
 	id = strtoll(object, NULL, 10);
 
-	path = sql_get_text_field(db, "SELECT PATH from CAPTIONS where ID = %lld", id);
+	path = get_text_by_id(h->db, "SELECT PATH from CAPTIONS where ID = ?", id);
 	if( !path )
 	{
 		DPRINTF(E_WARN, L_HTTP, "CAPTION ID %s not found, responding ERROR 404\n", object);
@@ -1592,25 +2441,36 @@ SendResp_caption(struct upnphttp * h, char * object)
 	DPRINTF(E_INFO, L_HTTP, "Serving caption ID: %lld [%s]\n", id, path);
 
 	fd = open(path, O_RDONLY);
-	if( fd < 0 ) {
+	if( fd < 0 || fstat(fd, &st) != 0 ) {
 		DPRINTF(E_ERROR, L_HTTP, "Error opening %s\n", path);
+		if( fd >= 0 )
+			close(fd);
 		sqlite3_free(path);
 		Send404(h);
 		return;
 	}
 	sqlite3_free(path);
-	size = lseek(fd, 0, SEEK_END);
-	lseek(fd, 0, SEEK_SET);
+	size = st.st_size;
+
+	/* Subtitles get edited in place, so always revalidate */
+	set_validator(&v, id, st.st_mtime, size, 0);
+	if( send_not_modified(h, &v) )
+	{
+		close(fd);
+		return;
+	}
 
 	INIT_STR(str, header);
 
+	set_socket_profile(h, SOCK_PROFILE_INTERACTIVE);
 	start_dlna_header(&str, 200, "Interactive", "smi/caption");
+	add_validator_headers(&str, &v);
 	strcatf(&str, "Content-Length: %jd\r\n\r\n", (intmax_t)size);
 
 	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
 	{
 		if( h->req_command != EHead )
-			send_file(h, fd, 0, size-1);
+			send_file(h, fd, 0, size-1, 0, BW_INTERACTIVE);
 	}
 	close(fd);
 	CloseSocket_upnphttp(h);
@@ -1620,11 +2480,16 @@ static void
 SendResp_thumbnail(struct upnphttp * h, char * object)
 {
 	char header[512];
-	char *path;
+	char buf[128];
+	char **result;
+	char *path = NULL;
 	long long id;
-	ExifData *ed;
-	ExifLoader *l;
+	off_t offset = 0, size = 0;
+	time_t mtime = 0;
+	struct stat st;
 	struct string_s str;
+	struct http_validator v;
+	int rows = 0, fd;
 
 	if( h->reqflags & (FLAG_XFERSTREAMING|FLAG_RANGE) )
 	{
@@ -1634,53 +2499,103 @@ SendResp_thumbnail(struct upnphttp * h, char * object)
 	}
 
 	id = strtoll(object, NULL, 10);
-	path = sql_get_text_field(db, "SELECT PATH from DETAILS where ID = '%lld'", id);
+	snprintf(buf, sizeof(buf), "SELECT PATH, THUMB_OFFSET, THUMB_SIZE, TIMESTAMP from DETAILS where ID = '%lld'", id);
+	if( sql_get_table(h->db, buf, &result, &rows, NULL) != SQLITE_OK )
+	{
+		Send500(h);
+		return;
+	}
+	if( rows )
+	{
+		path = result[4];
+		offset = result[5] ? strtoll(result[5], NULL, 10) : 0;
+		size = result[6] ? strtoll(result[6], NULL, 10) : 0;
+		mtime = result[7] ? strtoll(result[7], NULL, 10) : 0;
+	}
 	if( !path )
 	{
 		DPRINTF(E_WARN, L_HTTP, "DETAIL ID %s not found, responding ERROR 404\n", object);
+		sqlite3_free_table(result);
 		Send404(h);
 		return;
 	}
 	DPRINTF(E_INFO, L_HTTP, "Serving thumbnail for ObjectId: %lld [%s]\n", id, path);
 
-	if( access(path, F_OK) != 0 )
+	/* The thumbnail only changes along with its file, so there's no
+	 * need to even open it if the client is up to date */
+	set_validator(&v, id, mtime, size, ART_MAX_AGE);
+	if( size > 0 && send_not_modified(h, &v) )
+	{
+		sqlite3_free_table(result);
+		return;
+	}
+
+	fd = open(path, O_RDONLY);
+	if( fd < 0 )
 	{
 		DPRINTF(E_ERROR, L_HTTP, "Error accessing %s\n", path);
+		sqlite3_free_table(result);
 		Send404(h);
-		sqlite3_free(path);
 		return;
 	}
+	sqlite3_free_table(result);
 
-	l = exif_loader_new();
-	exif_loader_write_file(l, path);
-	ed = exif_loader_get_data(l);
-	exif_loader_unref(l);
-	sqlite3_free(path);
-
-	if( !ed || !ed->size )
+	/* The scanner recorded where the EXIF thumbnail sits in the file */
+	if( offset <= 0 || size <= 0 ||
+	    fstat(fd, &st) != 0 || offset + size > st.st_size )
 	{
+		close(fd);
 		Send404(h);
-		if( ed )
-			exif_data_unref(ed);
 		return;
 	}
 
 	INIT_STR(str, header);
 
+	set_socket_profile(h, SOCK_PROFILE_INTERACTIVE);
 	start_dlna_header(&str, 200, "Interactive", "image/jpeg");
+	add_validator_headers(&str, &v);
 	strcatf(&str, "Content-Length: %jd\r\n"
 	              "contentFeatures.dlna.org: DLNA.ORG_PN=JPEG_TN;DLNA.ORG_CI=1\r\n\r\n",
-	              (intmax_t)ed->size);
+	              (intmax_t)size);
 
 	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
 	{
 		if( h->req_command != EHead )
-			send_data(h, (char *)ed->data, ed->size, 0);
+			send_file(h, fd, offset, offset + size - 1, 0, BW_INTERACTIVE);
 	}
-	exif_data_unref(ed);
+	close(fd);
 	CloseSocket_upnphttp(h);
 }
 
+struct jpeg_chunk_ctx {
+	struct upnphttp *h;
+	int cachefd;
+	int cache_ok;
+};
+
+/* Send each block of encoded JPEG data as an HTTP chunk, and copy it to
+ * the resized image cache if we are filling it */
+static int
+send_jpeg_chunk(void *arg, const unsigned char *data, size_t len)
+{
+	struct jpeg_chunk_ctx *ctx = arg;
+	char buf[16];
+	int n;
+
+	if( ctx->cache_ok && write(ctx->cachefd, data, len) != (ssize_t)len )
+	{
+		DPRINTF(E_WARN, L_HTTP, "Failed to write resized image cache: %s\n", strerror(errno));
+		ctx->cache_ok = 0;
+	}
+	n = snprintf(buf, sizeof(buf), "%zx\r\n", len);
+	if( send_data(ctx->h, buf, n, MSG_MORE) != 0 ||
+	    send_data(ctx->h, (char *)data, len, MSG_MORE) != 0 ||
+	    send_data(ctx->h, "\r\n", 2, MSG_MORE) != 0 )
+		return -1;
+
+	return 0;
+}
+
 static void
 SendResp_resizedimg(struct upnphttp * h, char * object)
 {
@@ -1705,10 +2620,15 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	image_s *imsrc = NULL, *imdst = NULL;
 	int scale = 1;
 	const char *tmode;
+	struct image_cache_entry cache = { .lockfd = -1 };
+	struct stat st;
+	struct http_validator v;
+	off_t cached_size;
+	int cachefd;
 
 	id = strtoll(object, &saveptr, 10);
 	snprintf(buf, sizeof(buf), "SELECT PATH, RESOLUTION, ROTATION from DETAILS where ID = '%lld'", (long long)id);
-	ret = sql_get_table(db, buf, &result, &rows, NULL);
+	ret = sql_get_table(h->db, buf, &result, &rows, NULL);
 	if( ret != SQLITE_OK )
 	{
 		Send500(h);
@@ -1720,7 +2640,7 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 		resolution = result[4];
 		rotate = result[5] ? atoi(result[5]) : 0;
 	}
-	if( !file_path || !resolution || (access(file_path, F_OK) != 0) )
+	if( !file_path || !resolution || (stat(file_path, &st) != 0) )
 	{
 		DPRINTF(E_WARN, L_HTTP, "%s not found, responding ERROR 404\n", object);
 		sqlite3_free_table(result);
@@ -1759,6 +2679,17 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 		} */
 	}
 
+	/* The output only depends on the source file and the request */
+	snprintf(v.etag, sizeof(v.etag), "\"%llx-%lx-%dx%d-%d\"",
+	         id, (long)st.st_mtime, width, height, rotate);
+	v.mtime = st.st_mtime;
+	v.max_age = ART_MAX_AGE;
+	if( send_not_modified(h, &v) )
+	{
+		sqlite3_free_table(result);
+		return;
+	}
+
 #if USE_FORK
 	pid_t newpid = 0;
 	newpid = process_fork(h->req_client);
@@ -1835,10 +2766,29 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	else
 #endif
 		tmode = "Interactive";
+	set_socket_profile(h, (h->reqflags & FLAG_XFERBACKGROUND) ? SOCK_PROFILE_BACKGROUND : SOCK_PROFILE_INTERACTIVE);
 	start_dlna_header(&str, 200, tmode, "image/jpeg");
+	add_validator_headers(&str, &v);
 	strcatf(&str, "contentFeatures.dlna.org: %sDLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\r\n",
 	              dlna_pn, dlna_flags, 0);
 
+	cache.id = id;
+	cache.width = dstw;
+	cache.height = dsth;
+	cache.rotate = rotate;
+	cache.mtime = st.st_mtime;
+	cachefd = image_cache_lookup(&cache, &cached_size);
+	if( cachefd >= 0 )
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "Serving cached resized image %s\n", cache.path);
+		strcatf(&str, "Content-Length: %jd\r\n\r\n", (intmax_t)cached_size);
+		if( (send_data(h, str.data, str.off, MSG_MORE) == 0) && (h->req_command != EHead) )
+			send_file(h, cachefd, 0, cached_size - 1, 0,
+			          (h->reqflags & FLAG_XFERBACKGROUND) ? BW_BACKGROUND : BW_INTERACTIVE);
+		close(cachefd);
+		goto resized_done;
+	}
+
 	if( strcmp(h->HttpVer, "HTTP/1.0") == 0 )
 	{
 		chunked = 0;
@@ -1861,6 +2811,7 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 
 		imdst = image_resize(imsrc, dstw, dsth);
 		data = image_save_to_jpeg_buf(imdst, &size);
+		image_cache_store(&cache, data, size);
 
 		strcatf(&str, "Content-Length: %d\r\n\r\n", size);
 	}
@@ -1869,6 +2820,8 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	{
 		if( chunked )
 		{
+			struct jpeg_chunk_ctx ctx;
+
 			imsrc = image_new_from_jpeg(file_path, 1, NULL, 0, scale, rotate);
 			if( !imsrc )
 			{
@@ -1876,19 +2829,20 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 				Send500(h);
 				goto resized_error;
 			}
-			imdst = image_resize(imsrc, dstw, dsth);
-			data = image_save_to_jpeg_buf(imdst, &size);
-
-			ret = sprintf(buf, "%x\r\n", size);
-			send_data(h, buf, ret, MSG_MORE);
-			send_data(h, (char *)data, size, MSG_MORE);
-			send_data(h, "\r\n0\r\n\r\n", 7, 0);
+			ctx.h = h;
+			ctx.cachefd = image_cache_create(&cache);
+			ctx.cache_ok = (ctx.cachefd >= 0);
+			ret = image_save_to_jpeg_stream(imsrc, dstw, dsth, send_jpeg_chunk, &ctx);
+			image_cache_commit(&cache, ctx.cachefd, ret >= 0 && ctx.cache_ok);
+			if( ret >= 0 )
+				send_data(h, "0\r\n\r\n", 5, 0);
 		}
 		else
 		{
 			send_data(h, (char *)data, size, 0);
 		}
 	}
+resized_done:
 	DPRINTF(E_INFO, L_HTTP, "Done serving %s\n", file_path);
 	if( imsrc )
 		image_free(imsrc);
@@ -1896,6 +2850,7 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 		image_free(imdst);
 	CloseSocket_upnphttp(h);
 resized_error:
+	image_cache_store(&cache, NULL, 0);
 	sqlite3_free_table(result);
 #if USE_FORK
 	if( newpid == 0 )
@@ -1903,6 +2858,94 @@ resized_error:
 #endif
 }
 
+/* Recently resolved media items, keyed by detail ID and client type.
+ * Items are resolved in the main process before forking, so every
+ * worker sees the same cache.  Any database change bumps updateID,
+ * which invalidates all entries. */
+#define FILE_CACHE_SIZE 32
+
+struct file_info {
+	int64_t id;			/* 0 = unused slot */
+	enum client_types client;
+	uint32_t update_id;
+	unsigned int used;		/* LRU clock value of last use */
+	char path[PATH_MAX];
+	char mime[32];
+	char dlna[96];
+	int duration;
+	int bitrate;			/* bytes per second */
+	int transcode;
+	char *transcoder;
+	int tempfile;			/* path is a transcoded temporary file */
+};
+
+static struct file_info file_cache[FILE_CACHE_SIZE];
+static unsigned int file_cache_clock;
+
+static void
+file_cache_drop(struct file_info *info)
+{
+	/* transcoded images live only as long as their cache entry */
+	if( info->tempfile )
+		unlink(info->path);
+	memset(info, 0, sizeof(*info));
+}
+
+static struct file_info *
+file_cache_get(int64_t id, enum client_types client)
+{
+	int i;
+
+	for( i = 0; i < FILE_CACHE_SIZE; i++ )
+	{
+		if( !file_cache[i].id || file_cache[i].id != id ||
+		    file_cache[i].client != client )
+			continue;
+		if( file_cache[i].update_id != updateID )
+		{
+			file_cache_drop(&file_cache[i]);
+			return NULL;
+		}
+		file_cache[i].used = ++file_cache_clock;
+		return &file_cache[i];
+	}
+
+	return NULL;
+}
+
+/* Get an empty slot, evicting the least recently used entry if needed.
+ * The slot only becomes visible to file_cache_get() once its id is set. */
+static struct file_info *
+file_cache_slot(void)
+{
+	struct file_info *info = &file_cache[0];
+	int i;
+
+	for( i = 0; i < FILE_CACHE_SIZE; i++ )
+	{
+		if( !file_cache[i].id )
+		{
+			info = &file_cache[i];
+			break;
+		}
+		if( file_cache[i].used < info->used )
+			info = &file_cache[i];
+	}
+	file_cache_drop(info);
+	info->used = ++file_cache_clock;
+
+	return info;
+}
+
+void
+FreeFileCache_upnphttp(void)
+{
+	int i;
+
+	for( i = 0; i < FILE_CACHE_SIZE; i++ )
+		file_cache_drop(&file_cache[i]);
+}
+
 static void
 SendResp_dlnafile(struct upnphttp *h, char *object)
 {
@@ -1922,16 +2965,10 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 	uint32_t dlna_flags = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B;
 	uint32_t cflags = h->req_client ? h->req_client->type->flags : 0;
 	const char *tmode;
+	enum bw_class cls;
 	enum client_types ctype = h->req_client ? h->req_client->type->type : 0;
-	static struct { int64_t id;
-	                enum client_types client;
-	                char path[PATH_MAX];
-	                char mime[32];
-	                char dlna[96];
-	                int duration;
-	                int transcode;
-	                char *transcoder;
-	              } last_file = { 0, 0 };
+	struct file_info *last_file;
+	char *caption = NULL;
 #if USE_FORK
 	pid_t newpid = 0;
 #endif
@@ -1942,7 +2979,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		if( strstr(object, "?albumArt=true") )
 		{
 			char *art;
-			art = sql_get_text_field(db, "SELECT ALBUM_ART from DETAILS where ID = '%lld'", id);
+			art = get_text_by_id(h->db, "SELECT ALBUM_ART from DETAILS where ID = ?", id);
 			if (art)
 			{
 				SendResp_albumArt(h, art);
@@ -1953,25 +2990,18 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			return;
 		}
 	}
-	if( id != last_file.id || ctype != last_file.client )
+	last_file = file_cache_get(id, ctype);
+	if( !last_file )
 	{
-		/* we need to remove transcode temporary file when the file is changed
-		   if this file is not deleted up here, it's deleted during minidlna shutdown */
-		if ( transcode_tempfile )
-		{
-			unlink(transcode_tempfile);
-			transcode_tempfile = NULL;
-		}
-
-		snprintf(buf, sizeof(buf), "SELECT PATH, MIME, DLNA_PN, DURATION from DETAILS where ID = '%lld'", (long long)id);
-		ret = sql_get_table(db, buf, &result, &rows, NULL);
+		snprintf(buf, sizeof(buf), "SELECT PATH, MIME, DLNA_PN, DURATION, BITRATE from DETAILS where ID = '%lld'", (long long)id);
+		ret = sql_get_table(h->db, buf, &result, &rows, NULL);
 		if( (ret != SQLITE_OK) )
 		{
 			DPRINTF(E_ERROR, L_HTTP, "Didn't find valid file for %lld!\n", (long long)id);
 			Send500(h);
 			return;
 		}
-		if( !rows || !result[4] )
+		if( !rows || !result[5] )
 		{
 			DPRINTF(E_WARN, L_HTTP, "%s not found, responding ERROR 404\n", object);
 			sqlite3_free_table(result);
@@ -1980,55 +3010,59 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		}
 
 		/* Cache the result */
-		last_file.id = id;
-		last_file.client = ctype;
-		strncpy(last_file.path, result[4], sizeof(last_file.path)-1);
-		mime = result[5];
-		dlnapn = result[6];
-		if( result[7] )
+		last_file = file_cache_slot();
+		last_file->client = ctype;
+		strncpy(last_file->path, result[5], sizeof(last_file->path)-1);
+		mime = result[6];
+		dlnapn = result[7];
+		if( result[8] )
 		{
 			int h, m, s, ss;
-			sscanf(result[7], "%d:%d:%d.%d", &h, &m, &s, &ss);
-			last_file.duration = (3600*h + 60*m + s)*1000 + ss;
+			sscanf(result[8], "%d:%d:%d.%d", &h, &m, &s, &ss);
+			last_file->duration = (3600*h + 60*m + s)*1000 + ss;
 		}
+		last_file->bitrate = result[9] ? atoi(result[9]) : 0;
+		/* The audio parsers store bits per second, libav bytes */
+		if( *mime == 'a' )
+			last_file->bitrate /= 8;
 
 		/* non-zero value means the file needs to be transcoded */
 		if ( *mime == 'i' ) /* image */
 		{
-			last_file.transcode = needs_transcode_image(last_file.path, client_types[last_file.client].type);
-			if (client_types[last_file.client].transcode_info && client_types[last_file.client].transcode_info->image_transcoder)
-				last_file.transcoder = client_types[last_file.client].transcode_info->image_transcoder;
+			last_file->transcode = needs_transcode_image(last_file->path, client_types[last_file->client].type);
+			if (client_types[last_file->client].transcode_info && client_types[last_file->client].transcode_info->image_transcoder)
+				last_file->transcoder = client_types[last_file->client].transcode_info->image_transcoder;
 			else
-				last_file.transcoder = client_types[0].transcode_info->image_transcoder;
+				last_file->transcoder = client_types[0].transcode_info->image_transcoder;
 		}
 		else if ( *mime == 'a' ) /* audio */
 		{
-			last_file.transcode = needs_transcode_audio(last_file.path, client_types[last_file.client].type);
-			if (client_types[last_file.client].transcode_info && client_types[last_file.client].transcode_info->audio_transcoder)
-				last_file.transcoder = client_types[last_file.client].transcode_info->audio_transcoder;
+			last_file->transcode = needs_transcode_audio(last_file->path, client_types[last_file->client].type);
+			if (client_types[last_file->client].transcode_info && client_types[last_file->client].transcode_info->audio_transcoder)
+				last_file->transcoder = client_types[last_file->client].transcode_info->audio_transcoder;
 			else
-				last_file.transcoder = client_types[0].transcode_info->audio_transcoder;
+				last_file->transcoder = client_types[0].transcode_info->audio_transcoder;
 		}
 		else if ( *mime == 'v' ) /* video */
 		{
-			last_file.transcode = needs_transcode_video(last_file.path, client_types[last_file.client].type);
-			if (client_types[last_file.client].transcode_info && client_types[last_file.client].transcode_info->video_transcoder)
-				last_file.transcoder = client_types[last_file.client].transcode_info->video_transcoder;
+			last_file->transcode = needs_transcode_video(last_file->path, client_types[last_file->client].type);
+			if (client_types[last_file->client].transcode_info && client_types[last_file->client].transcode_info->video_transcoder)
+				last_file->transcoder = client_types[last_file->client].transcode_info->video_transcoder;
 			else
-				last_file.transcoder = client_types[0].transcode_info->video_transcoder;
+				last_file->transcoder = client_types[0].transcode_info->video_transcoder;
 		}
 		else
 		{
-			last_file.transcode = 0;
-			last_file.transcoder = NULL;
+			last_file->transcode = 0;
+			last_file->transcoder = NULL;
 		}
 
-		if (last_file.transcode && last_file.transcoder)
+		if (last_file->transcode && last_file->transcoder)
 		{
 			DPRINTF(E_DEBUG, L_HTTP, "Executing transcode\n");
 			if ( *mime != 'i' )
 			{
-				transcode_pid = exec_transcode(last_file.transcoder, last_file.path, 0, last_file.duration > 0 ? last_file.duration : 1000, &transcode_handle);
+				transcode_pid = exec_transcode(last_file->transcoder, last_file->path, 0, last_file->duration > 0 ? last_file->duration : 1000, &transcode_handle);
 				if( transcode_pid < 0 )
 				{
 					Send500(h);
@@ -2039,8 +3073,8 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			{
 				char tmp[L_tmpnam];
 				tmpnam(tmp);
-				last_file.transcode = 0;
-				transcode_pid = exec_transcode_img(last_file.transcoder, last_file.path, tmp);
+				last_file->transcode = 0;
+				transcode_pid = exec_transcode_img(last_file->transcoder, last_file->path, tmp);
 				if( transcode_pid < 0 )
 				{
 					Send500(h);
@@ -2050,12 +3084,12 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 				/* try to open the resulting file. If that's not possible the transcoding probably failed */
 				transcode_handle = open(tmp, O_RDONLY);
 				if( transcode_handle < 0 ) {
-					DPRINTF(E_ERROR, L_HTTP, "Cannot open transcoded file %s, possibly a problem with transcoder\n", last_file.path);
+					DPRINTF(E_ERROR, L_HTTP, "Cannot open transcoded file %s, possibly a problem with transcoder\n", last_file->path);
 					Send500(h);
 					return;
 				}
-				strcpy(last_file.path, tmp);
-				transcode_tempfile = last_file.path;
+				strcpy(last_file->path, tmp);
+				last_file->tempfile = 1;
 			}
 
 			DPRINTF(E_DEBUG, L_HTTP, "Obtaining metadata\n");
@@ -2089,53 +3123,59 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		}
 
 		if( mime )
-			strncpy(last_file.mime, mime, sizeof(last_file.mime)-1);
+			strncpy(last_file->mime, mime, sizeof(last_file->mime)-1);
 		if( dlnapn )
-			snprintf(last_file.dlna, sizeof(last_file.dlna), "DLNA.ORG_PN=%s;", dlnapn);
+			snprintf(last_file->dlna, sizeof(last_file->dlna), "DLNA.ORG_PN=%s;", dlnapn);
 		else
-			last_file.dlna[0] = '\0';
+			last_file->dlna[0] = '\0';
 
 		if( mime )
 		{
 			/* From what I read, Samsung TV's expect a [wrong] MIME type of x-mkv. */
 			if( cflags & FLAG_SAMSUNG )
 			{
-				if( strcmp(last_file.mime+6, "x-matroska") == 0 )
-					strcpy(last_file.mime+8, "mkv");
+				if( strcmp(last_file->mime+6, "x-matroska") == 0 )
+					strcpy(last_file->mime+8, "mkv");
 				/* Samsung TV's such as the A750 can natively support many
 				   Xvid/DivX AVI's however, the DLNA server needs the
 				   mime type to say video/mpeg */
-				else if( ctype == ESamsungSeriesA && strcmp(last_file.mime+6, "x-msvideo") == 0 )
-					strcpy(last_file.mime+6, "mpeg");
+				else if( ctype == ESamsungSeriesA && strcmp(last_file->mime+6, "x-msvideo") == 0 )
+					strcpy(last_file->mime+6, "mpeg");
 				/* Samsung TV's are able to play quicktime, but they expect MIME type of mp4 */
-				else if( strcmp(last_file.mime+6, "quicktime") == 0 )
-					strcpy(last_file.mime+6, "mp4");
+				else if( strcmp(last_file->mime+6, "quicktime") == 0 )
+					strcpy(last_file->mime+6, "mp4");
 			}
 			/* ... and Sony BDP-S370 won't play MKV unless we pretend it's a DiVX file */
 			else if( ctype == ESonyBDP )
 			{
-				if( strcmp(last_file.mime+6, "x-matroska") == 0 ||
-				    strcmp(last_file.mime+6, "mpeg") == 0 )
-					strcpy(last_file.mime+6, "divx");
+				if( strcmp(last_file->mime+6, "x-matroska") == 0 ||
+				    strcmp(last_file->mime+6, "mpeg") == 0 )
+					strcpy(last_file->mime+6, "divx");
 			}
 		}
 
 		sqlite3_free_table(result);
+		last_file->update_id = updateID;
+		last_file->id = id;
 	}
+	/* The connection stays with the main process */
+	if( h->reqflags & FLAG_CAPTION )
+		caption = get_text_by_id(h->db, "SELECT ID from CAPTIONS where ID = ?", (long long)id);
 #if USE_FORK
 	newpid = process_fork(h->req_client);
 	if( newpid > 0 )
 	{
+		sqlite3_free(caption);
 		CloseSocket_upnphttp(h);
 		return;
 	}
 #endif
 
-	DPRINTF(E_INFO, L_HTTP, "Serving DetailID: %lld [%s]\n", (long long)id, last_file.path);
+	DPRINTF(E_INFO, L_HTTP, "Serving DetailID: %lld [%s]\n", (long long)id, last_file->path);
 
 	if( h->reqflags & FLAG_XFERSTREAMING )
 	{
-		if( strncmp(last_file.mime, "image", 5) == 0 )
+		if( strncmp(last_file->mime, "image", 5) == 0 )
 		{
 			DPRINTF(E_WARN, L_HTTP, "Client tried to specify transferMode as Streaming with an image!\n");
 			Send406(h);
@@ -2150,7 +3190,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			Send400(h);
 			goto error;
 		}
-		if( strncmp(last_file.mime, "image", 5) != 0 )
+		if( strncmp(last_file->mime, "image", 5) != 0 )
 		{
 			DPRINTF(E_WARN, L_HTTP, "Client tried to specify transferMode as Interactive without an image!\n");
 			/* Samsung TVs (well, at least the A950) do this for some reason,
@@ -2163,9 +3203,9 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		}
 	}
 
-	sendfh = open(last_file.path, O_RDONLY);
+	sendfh = open(last_file->path, O_RDONLY);
 	if( sendfh < 0 ) {
-		DPRINTF(E_ERROR, L_HTTP, "Error opening %s\n", last_file.path);
+		DPRINTF(E_ERROR, L_HTTP, "Error opening %s\n", last_file->path);
 		Send404(h);
 		goto error;
 	}
@@ -2175,33 +3215,39 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 	INIT_STR(str, header);
 
 #if USE_FORK
-	if( (h->reqflags & FLAG_XFERBACKGROUND) && (setpriority(PRIO_PROCESS, 0, 19) == 0) )
+	if( (h->reqflags & FLAG_XFERBACKGROUND) && (setpriority(PRIO_PROCESS, 0, 19) == 0) ) {
 		tmode = "Background";
+		cls = BW_BACKGROUND;
+	}
 	else
 #endif
-	if( strncmp(last_file.mime, "image", 5) == 0 ) {
+	if( strncmp(last_file->mime, "image", 5) == 0 ) {
 		tmode = "Interactive";
+		cls = BW_INTERACTIVE;
 		dlna_flags |= DLNA_FLAG_TM_I;
 	}
 	else {
 		tmode = "Streaming";
+		cls = BW_STREAMING;
 		dlna_flags |= DLNA_FLAG_TM_S;
 	}
 
-	start_dlna_header(&str, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, last_file.mime);
+	/* The file transfer profiles line up with the scheduler classes */
+	set_socket_profile(h, (enum sock_profile_type)cls);
+	start_dlna_header(&str, (h->reqflags & FLAG_RANGE ? 206 : 200), tmode, last_file->mime);
 
 	/* FLAG_TIMESEEK support partially based on Hiero's patch */
 	/* the transcoded files does not support ranges */
-	if ( (h->reqflags & FLAG_TIMESEEK) || ((h->reqflags & FLAG_RANGE) && !last_file.transcode) )
+	if ( (h->reqflags & FLAG_TIMESEEK) || ((h->reqflags & FLAG_RANGE) && !last_file->transcode) )
 	{
 		if ( (h->reqflags & FLAG_TIMESEEK) )
 		{
-			if( !h->req_RangeEnd || h->req_RangeEnd == last_file.duration )
+			if( !h->req_RangeEnd || h->req_RangeEnd == last_file->duration )
 			{
-				h->req_RangeEnd = last_file.duration-1;
+				h->req_RangeEnd = last_file->duration-1;
 			}
 
-			if( h->req_RangeEnd >= last_file.duration )
+			if( h->req_RangeEnd >= last_file->duration )
 			{
 				DPRINTF(E_WARN, L_HTTP, "Specified range was outside file boundaries!\n");
 				Send416(h);
@@ -2210,13 +3256,13 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			}
 
 			strcatf(&str, "X-AvailableSeekRange : 1 npt=0.0-%jd.%jd\r\n",
-			              (last_file.duration-1)/1000,  (last_file.duration-1)%1000);
+			              (last_file->duration-1)/1000,  (last_file->duration-1)%1000);
 			strcatf(&str, "TimeSeekRange.dlna.org : npt=%jd.%jd-%jd.%jd/%d.%d\r\n",
 			              h->req_RangeStart/1000,   h->req_RangeStart%1000,
 			              h->req_RangeEnd/1000,     h->req_RangeEnd%1000,
-			              last_file.duration/1000,  last_file.duration%1000);
+			              last_file->duration/1000,  last_file->duration%1000);
 		}
-		if( (h->reqflags & FLAG_RANGE) && !last_file.transcode )
+		if( (h->reqflags & FLAG_RANGE) && !last_file->transcode )
 		{
 			if( !h->req_RangeEnd || h->req_RangeEnd == size )
 			{
@@ -2246,10 +3292,10 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			goto error;
 		}
 	}
-	else if ( last_file.transcode )
+	else if ( last_file->transcode )
 	{
 		h->req_RangeStart = 0;
-		h->req_RangeEnd = last_file.duration-1;
+		h->req_RangeEnd = last_file->duration-1;
 	}
 	else
 	{
@@ -2260,32 +3306,29 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		strcatf(&str, "Content-Length: %jd\r\n", (intmax_t)total);
 	}
 
-	if( h->reqflags & FLAG_CAPTION )
-	{
-		if( sql_get_int_field(db, "SELECT ID from CAPTIONS where ID = '%lld'", (long long)id) > 0 )
-			strcatf(&str, "CaptionInfo.sec: http://%s:%d/Captions/%lld.srt\r\n",
-			              lan_addr[h->iface].str, runtime_vars.port, (long long)id);
-	}
+	if( caption )
+		strcatf(&str, "CaptionInfo.sec: http://%s:%d/Captions/%lld.srt\r\n",
+		              lan_addr[h->iface].str, runtime_vars.port, (long long)id);
 
 	strcatf(&str, "Accept-Ranges: %s\r\n"
 	              "contentFeatures.dlna.org: %sDLNA.ORG_OP=%02X;DLNA.ORG_CI=%X;DLNA.ORG_FLAGS=%08X%024X\r\n\r\n",
-	              last_file.transcode ? "none" : "bytes",
-	              last_file.dlna,
-	              last_file.transcode ? 0x10 : 0x01, /* 01 = only byte seek, 10 = time based, 11 = both, 00 = none */
-	              last_file.transcode ? 0x1 : 0x0, /* 1 = transcoded, 0 = native */
+	              last_file->transcode ? "none" : "bytes",
+	              last_file->dlna,
+	              last_file->transcode ? 0x10 : 0x01, /* 01 = only byte seek, 10 = time based, 11 = both, 00 = none */
+	              last_file->transcode ? 0x1 : 0x0, /* 1 = transcoded, 0 = native */
 	              dlna_flags, 0);
 
 	/*DPRINTF(E_DEBUG, L_HTTP, "RESPONSE:\n%s\n", str.data);*/
 	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
 	{
  		if( h->req_command != EHead ) {
-			if (last_file.transcode)
+			if (last_file->transcode)
 			{
-				send_file_transcode(last_file.transcoder, h, h->req_RangeStart, h->req_RangeEnd, last_file.path);
+				send_file_transcode(last_file->transcoder, h, h->req_RangeStart, h->req_RangeEnd, last_file->path);
 			}
 			else
 			{
-				send_file(h, sendfh, h->req_RangeStart, h->req_RangeEnd);
+				send_file(h, sendfh, h->req_RangeStart, h->req_RangeEnd, last_file->bitrate, cls);
 			}
 		}
 	}
@@ -2294,6 +3337,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 
 	CloseSocket_upnphttp(h);
 error:
+	sqlite3_free(caption);
 #if USE_FORK
 	if( newpid == 0 )
 		_exit(0);
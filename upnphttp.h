@@ -51,6 +51,7 @@
 
 #include <netinet/in.h>
 #include <sys/queue.h>
+#include <sys/types.h>
 
 #include "minidlnatypes.h"
 #include "config.h"
@@ -79,6 +80,7 @@ struct upnphttp {
 	struct in_addr clientaddr;	/* client address */
 	int iface;
 	int state;
+	time_t deadline;	/* monotonic time the current state must end by, 0 = none */
 	char HttpVer[16];
 	/* request */
 	char * req_buf;
@@ -87,6 +89,7 @@ struct upnphttp {
 	int req_contentoff;     /* header length */
 	enum httpCommands req_command;
 	struct client_cache_s * req_client;
+	struct sqlite3 * db;		/* pooled connection for reading */
 	const char * req_soapAction;
 	int req_soapActionLen;
 	const char * req_Callback;	/* For SUBSCRIBE */
@@ -96,6 +99,9 @@ struct upnphttp {
 	int req_Timeout;
 	const char * req_SID;		/* For UNSUBSCRIBE */
 	int req_SIDLen;
+	const char * req_IfNoneMatch;	/* For conditional GET */
+	int req_IfNoneMatchLen;
+	time_t req_IfModifiedSince;
 	off_t req_RangeStart;
 	off_t req_RangeEnd;
 	long int req_chunklen;
@@ -105,6 +111,9 @@ struct upnphttp {
 	int res_buflen;
 	int res_buf_alloclen;
 	uint32_t respflags;
+	const char * res_etag;
+	off_t res_sent;			/* body bytes sent by SendChunk_upnphttp() */
+	int res_corked;			/* TCP_CORK set by the socket profile */
 	/*int res_contentlen;*/
 	/*int res_contentoff;*/		/* header length */
 	LIST_ENTRY(upnphttp) entries;
@@ -127,6 +136,7 @@ struct upnphttp {
 #define FLAG_XFERINTERACTIVE    0x00002000
 #define FLAG_XFERBACKGROUND     0x00004000
 #define FLAG_CAPTION            0x00008000
+#define FLAG_STREAMED           0x00010000
 
 #ifndef MSG_MORE
 #define MSG_MORE 0
@@ -140,6 +150,13 @@ New_upnphttp(int);
 void
 CloseSocket_upnphttp(struct upnphttp *);
 
+/* CheckDeadline_upnphttp()
+ * closes the connection if it has overrun the deadline of its current
+ * state.  Returns the seconds left, 0 if it was closed, or -1 if there
+ * is no deadline to wait for. */
+int
+CheckDeadline_upnphttp(struct upnphttp *);
+
 /* Delete_upnphttp() */
 void
 Delete_upnphttp(struct upnphttp *);
@@ -150,7 +167,8 @@ Process_upnphttp(struct upnphttp *);
 
 /* BuildHeader_upnphttp()
  * build the header for the HTTP Response
- * also allocate the buffer for body data */
+ * also allocate the buffer for body data.
+ * A bodylen of -1 announces a body sent with SendChunk_upnphttp() */
 void
 BuildHeader_upnphttp(struct upnphttp * h, int respcode,
                      const char * respmsg,
@@ -175,9 +193,47 @@ Send500(struct upnphttp *);
 void
 Send501(struct upnphttp *);
 
+/* FreeFileCache_upnphttp()
+ * Forget all resolved media items, removing any transcoded temporary files */
+void
+FreeFileCache_upnphttp(void);
+
+/* BuildDescCache_upnphttp()
+ * Generate the device and service description documents for every
+ * client variant.  InvalidateDescCache_upnphttp() only marks them for
+ * regeneration on next use, so it is safe to call from a signal handler. */
+void
+BuildDescCache_upnphttp(void);
+void
+InvalidateDescCache_upnphttp(void);
+void
+FreeDescCache_upnphttp(void);
+
+/* InitStreamStats_upnphttp()
+ * Set up the streaming counters shared with worker processes */
+void
+InitStreamStats_upnphttp(void);
+
 /* SendResp_upnphttp() */
 void
 SendResp_upnphttp(struct upnphttp *);
 
+/* SendChunk_upnphttp()
+ * send the next part of a body of unknown length, as a chunk
+ * if the client takes them.  A len of 0 ends the body.
+ * Returns 0 on success */
+int
+SendChunk_upnphttp(struct upnphttp * h, const char * data, int len);
+
+/* ForkResp_upnphttp()
+ * Hand the rest of a long response to a worker process, as media
+ * transfers are, so a slow client doesn't hold up the main loop.
+ * Returns like fork(): the worker's pid in the parent, which has closed
+ * its copy of the connection; 0 in the worker, which reads through its
+ * own database connection in h->db and must _exit() when it is done;
+ * and -1 if there is no worker, in which case the caller carries on. */
+pid_t
+ForkResp_upnphttp(struct upnphttp * h);
+
 #endif
 
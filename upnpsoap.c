@@ -127,42 +127,78 @@ SoapError(struct upnphttp * h, int errCode, const char * errDesc)
 	CloseSocket_upnphttp(h);
 }
 
+static const char soap_beforebody[] =
+	"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+	"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	"<s:Body>";
+
+static const char soap_afterbody[] =
+	"</s:Body>"
+	"</s:Envelope>\r\n";
+
 static void
 BuildSendAndCloseSoapResp(struct upnphttp * h,
                           const char * body, int bodylen)
 {
-	static const char beforebody[] =
-		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
-		"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
-		"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-		"<s:Body>";
-
-	static const char afterbody[] =
-		"</s:Body>"
-		"</s:Envelope>\r\n";
-
 	if (!body || bodylen < 0)
 	{
 		Send500(h);
 		return;
 	}
 
-	BuildHeader_upnphttp(h, 200, "OK",  sizeof(beforebody) - 1
-		+ sizeof(afterbody) - 1 + bodylen );
+	BuildHeader_upnphttp(h, 200, "OK",  sizeof(soap_beforebody) - 1
+		+ sizeof(soap_afterbody) - 1 + bodylen );
 
-	memcpy(h->res_buf + h->res_buflen, beforebody, sizeof(beforebody) - 1);
-	h->res_buflen += sizeof(beforebody) - 1;
+	memcpy(h->res_buf + h->res_buflen, soap_beforebody, sizeof(soap_beforebody) - 1);
+	h->res_buflen += sizeof(soap_beforebody) - 1;
 
 	memcpy(h->res_buf + h->res_buflen, body, bodylen);
 	h->res_buflen += bodylen;
 
-	memcpy(h->res_buf + h->res_buflen, afterbody, sizeof(afterbody) - 1);
-	h->res_buflen += sizeof(afterbody) - 1;
+	memcpy(h->res_buf + h->res_buflen, soap_afterbody, sizeof(soap_afterbody) - 1);
+	h->res_buflen += sizeof(soap_afterbody) - 1;
 
 	SendResp_upnphttp(h);
 	CloseSocket_upnphttp(h);
 }
 
+/* Browse and Search results that outgrow their buffer are sent while
+ * the rows are still being read, then the buffer starts over.  The
+ * first flush sends the headers and opens the envelope. */
+static int
+FlushSoapResp(struct upnphttp * h, struct string_s * str)
+{
+	if (!(h->respflags & FLAG_STREAMED))
+	{
+		BuildHeader_upnphttp(h, 200, "OK", -1);
+		SendResp_upnphttp(h);
+		if (SendChunk_upnphttp(h, soap_beforebody, sizeof(soap_beforebody) - 1) != 0)
+			return -1;
+	}
+	if (SendChunk_upnphttp(h, str->data, str->off) != 0)
+		return -1;
+	str->off = 0;
+
+	return 0;
+}
+
+/* Same as BuildSendAndCloseSoapResp(), for a body that
+ * may already have been partly flushed */
+static void
+SendAndCloseSoapResp(struct upnphttp * h, struct string_s * str)
+{
+	if (!(h->respflags & FLAG_STREAMED))
+	{
+		BuildSendAndCloseSoapResp(h, str->data, str->off);
+		return;
+	}
+	if (FlushSoapResp(h, str) == 0 &&
+	    SendChunk_upnphttp(h, soap_afterbody, sizeof(soap_afterbody) - 1) == 0)
+		SendChunk_upnphttp(h, NULL, 0);
+	CloseSocket_upnphttp(h);
+}
+
 static void
 GetSystemUpdateID(struct upnphttp * h, const char * action)
 {
@@ -256,21 +292,21 @@ GetSortCapabilities(struct upnphttp * h, const char * action)
 	static const char resp[] =
 		"<u:%sResponse "
 		"xmlns:u=\"%s\">"
-		"<SortCaps>"
-		  "dc:title,"
-		  "dc:date,"
-		  "upnp:class,"
-		  "upnp:album,"
-		  "upnp:originalTrackNumber"
-		"</SortCaps>"
+		"<SortCaps>%s</SortCaps>"
 		"</u:%sResponse>";
 
+	const struct sort_capability *cap;
+	char caps[256];
+	struct string_s str = { caps, 0, sizeof(caps) };
 	char body[512];
 	int bodylen;
 
+	caps[0] = '\0';
+	for (cap = sort_capabilities; cap->property; cap++)
+		strcatf(&str, "%s%s", (cap == sort_capabilities) ? "" : ",", cap->property);
 	bodylen = snprintf(body, sizeof(body), resp,
 		action, "urn:schemas-upnp-org:service:ContentDirectory:1",
-		action);	
+		caps, action);
 	BuildSendAndCloseSoapResp(h, body, bodylen);
 }
 
@@ -567,9 +603,11 @@ set_filter_flags(char *filter, struct upnphttp *h)
 static char *
 parse_sort_criteria(char *sortCriteria, int *error)
 {
+	const struct sort_capability *cap;
+	const char *column;
 	char *order = NULL;
 	char *item, *saveptr;
-	int i, ret, reverse, title_sorted = 0;
+	int i, len, ret, reverse, last_reverse = 0, title_sorted = 0;
 	struct string_s str;
 	*error = 0;
 
@@ -605,28 +643,12 @@ parse_sort_criteria(char *sortCriteria, int *error)
 			DPRINTF(E_ERROR, L_HTTP, "No order specified [%s]\n", item);
 			goto bad_direction;
 		}
-		if( strcasecmp(item, "upnp:class") == 0 )
-		{
-			strcatf(&str, "o.CLASS");
-		}
-		else if( strcasecmp(item, "dc:title") == 0 )
-		{
-			strcatf(&str, "d.TITLE");
-			title_sorted = 1;
-		}
-		else if( strcasecmp(item, "dc:date") == 0 )
-		{
-			strcatf(&str, "d.DATE");
-		}
-		else if( strcasecmp(item, "upnp:originalTrackNumber") == 0 )
-		{
-			strcatf(&str, "d.DISC, d.TRACK");
-		}
-		else if( strcasecmp(item, "upnp:album") == 0 )
+		for( cap = sort_capabilities; cap->property; cap++ )
 		{
-			strcatf(&str, "d.ALBUM");
+			if( strcasecmp(item, cap->property) == 0 )
+				break;
 		}
-		else
+		if( !cap->property )
 		{
 			DPRINTF(E_ERROR, L_HTTP, "Unhandled SortCriteria [%s]\n", item);
 		bad_direction:
@@ -640,8 +662,17 @@ parse_sort_criteria(char *sortCriteria, int *error)
 			goto unhandled_order;
 		}
 
-		if( reverse )
-			strcatf(&str, " DESC");
+		/* Each column of the property sorts the same way */
+		for( column = cap->columns; *column; column += len )
+		{
+			column += strspn(column, ", ");
+			len = strcspn(column, ",");
+			strcatf(&str, "%s%.*s%s", (column == cap->columns) ? "" : ", ",
+			        len, column, reverse ? " DESC" : "");
+		}
+		if( strcmp(cap->columns, SORT_TIEBREAK) == 0 )
+			title_sorted = 1;
+		last_reverse = reverse;
 		unhandled_order:
 		item = strtok_r(NULL, ",", &saveptr);
 	}
@@ -652,9 +683,10 @@ parse_sort_criteria(char *sortCriteria, int *error)
 			free(sortCriteria);
 		return NULL;
 	}
-	/* Add a "tiebreaker" sort order */
+	/* Add a "tiebreaker" sort order, running the same way as the last
+	 * key so that the sort indexes can be read backwards for it */
 	if( !title_sorted )
-		strcatf(&str, ", TITLE ASC");
+		strcatf(&str, ", " SORT_TIEBREAK "%s", last_reverse ? " DESC" : "");
 
 	if( force_sort_criteria )
 		free(sortCriteria);
@@ -662,17 +694,141 @@ parse_sort_criteria(char *sortCriteria, int *error)
 	return order;
 }
 
+/* Everything in a DIDL-Lite item that only depends on who is asking: the
+ * client's quirks, the filter, and the address it reached us on.  It is
+ * worked out once per (client, flags, filter, interface), so formatting a
+ * row is mostly copying pre-escaped fragments. */
+struct didl_template {
+	enum client_types client;
+	uint32_t flags;
+	uint32_t filter;
+	int iface;
+	char addr[16];
+	char base_url[40];		/* "http://addr:port/" */
+	int base_len;
+	/* protocolInfo tails, for streamed and for interactive media */
+	char dlna_tail[2][96];		/* ";DLNA.ORG_OP=01;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=..." */
+	int dlna_tail_len[2];
+	char resized_tail[128];		/* ";DLNA.ORG_CI=1;DLNA.ORG_FLAGS=...\"&gt;http://.../Resized/" */
+	int resized_tail_len;
+	/* MIME type rewrites, NULL to leave the type alone */
+	const char *avi_mime;
+	const char *avi_creator_mime;
+	const char *tts_mime;
+	const char *mkv_mime;
+	const char *flac_mime;
+	const char *wav_mime;
+	int freebox_ts;
+	int want_captions;
+	enum {
+		TITLE_AS_IS,
+		TITLE_DOT,		/* LG: subtitles need a dot in the title */
+		TITLE_TRUNCATE		/* Asus OPlay: titles over 23 characters */
+	} caption_title;
+};
+
+#define DIDL_TEMPLATES 8
+static struct didl_template didl_templates[DIDL_TEMPLATES];
+static int didl_templates_next;
+
+static void
+init_didl_template(struct didl_template *tpl, const struct Response *args)
+{
+	const uint32_t streamed = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B|DLNA_FLAG_TM_S;
+	const uint32_t interactive = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B|DLNA_FLAG_TM_I;
+
+	memset(tpl, 0, sizeof(*tpl));
+	tpl->client = args->client;
+	tpl->flags = args->flags;
+	tpl->filter = args->filter;
+	tpl->iface = args->iface;
+	strncpyt(tpl->addr, lan_addr[args->iface].str, sizeof(tpl->addr));
+	tpl->base_len = snprintf(tpl->base_url, sizeof(tpl->base_url), "http://%s:%d/",
+	                         tpl->addr, runtime_vars.port);
+	tpl->dlna_tail_len[0] = snprintf(tpl->dlna_tail[0], sizeof(tpl->dlna_tail[0]),
+	                                 ";DLNA.ORG_OP=01;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=%08X%024X",
+	                                 streamed, 0);
+	tpl->dlna_tail_len[1] = snprintf(tpl->dlna_tail[1], sizeof(tpl->dlna_tail[1]),
+	                                 ";DLNA.ORG_OP=01;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=%08X%024X",
+	                                 interactive, 0);
+	tpl->resized_tail_len = snprintf(tpl->resized_tail, sizeof(tpl->resized_tail),
+	                                 ";DLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\"&gt;%sResized/",
+	                                 interactive, 0, tpl->base_url);
+
+	if( args->flags & FLAG_MIME_AVI_DIVX )
+	{
+		tpl->avi_mime = "video/avi";
+		tpl->avi_creator_mime = "video/divx";
+	}
+	else if( args->flags & FLAG_MIME_AVI_AVI )
+		tpl->avi_mime = tpl->avi_creator_mime = "video/avi";
+	else if( args->client == EFreeBox )
+		tpl->freebox_ts = 1;
+	if( !(args->flags & FLAG_DLNA) )
+		tpl->tts_mime = "video/mpeg";
+	if( args->flags & FLAG_MIME_FLAC_FLAC )
+		tpl->flac_mime = "audio/flac";
+	if( args->flags & FLAG_MIME_WAV_WAV )
+		tpl->wav_mime = "audio/wav";
+	tpl->want_captions = (args->flags & FLAG_CAPTION_RES) ||
+	                     (args->filter & (FILTER_SEC_CAPTION_INFO_EX|FILTER_PV_SUBTITLE));
+	/* From what I read, Samsung TV's expect a [wrong] MIME type of x-mkv. */
+	if( args->flags & FLAG_SAMSUNG )
+		tpl->mkv_mime = "video/x-mkv";
+	else if( args->client == ELGDevice )
+		tpl->caption_title = TITLE_DOT;
+	else if( args->client == EAsusOPlay )
+		tpl->caption_title = TITLE_TRUNCATE;
+}
+
+static const struct didl_template *
+get_didl_template(const struct Response *args)
+{
+	struct didl_template *tpl;
+	int i;
+
+	for( i = 0; i < DIDL_TEMPLATES; i++ )
+	{
+		tpl = &didl_templates[i];
+		if( tpl->base_len && tpl->client == args->client &&
+		    tpl->flags == args->flags && tpl->filter == args->filter &&
+		    tpl->iface == args->iface &&
+		    strcmp(tpl->addr, lan_addr[args->iface].str) == 0 )
+			return tpl;
+	}
+	tpl = &didl_templates[didl_templates_next];
+	didl_templates_next = (didl_templates_next + 1) % DIDL_TEMPLATES;
+	init_didl_template(tpl, args);
+
+	return tpl;
+}
+
+/* Append "<tag>value</tag>", with the tag given pre-escaped */
+#define add_element(str, open, value, close) do { \
+	strcatl(str, open); \
+	strcats(str, value); \
+	strcatl(str, close); \
+} while (0)
+
+/* Append one of our own URLs */
+#define add_url(str, tpl, path) do { \
+	strcatn(str, (tpl)->base_url, (tpl)->base_len); \
+	strcatl(str, path); \
+} while (0)
+
 inline static void
-add_resized_res(int srcw, int srch, int reqw, int reqh, char *dlna_pn,
-                char *detailID, struct Response *args)
+add_resized_res(int srcw, int srch, int reqw, int reqh, const char *dlna_pn,
+                const char *detailID, struct Response *args)
 {
+	const struct didl_template *tpl = args->tpl;
+	struct string_s *str = args->str;
 	int dstw = reqw;
 	int dsth = reqh;
 
 	if( (args->flags & FLAG_NO_RESIZE) && reqw > 160 && reqh > 160 )
 		return;
 
-	strcatf(args->str, "&lt;res ");
+	strcatl(str, "&lt;res ");
 	if( args->filter & FILTER_RES_RESOLUTION )
 	{
 		dstw = reqw;
@@ -681,91 +837,570 @@ add_resized_res(int srcw, int srch, int reqw, int reqh, char *dlna_pn,
 			dsth = reqh;
 			dstw = (((reqh<<10)/srch) * srcw>>10);
 		}
-		strcatf(args->str, "resolution=\"%dx%d\" ", dstw, dsth);
+		strcatl(str, "resolution=\"");
+		strcati(str, dstw);
+		strcatl(str, "x");
+		strcati(str, dsth);
+		strcatl(str, "\" ");
 	}
-	strcatf(args->str, "protocolInfo=\"http-get:*:image/jpeg:"
-	                          "DLNA.ORG_PN=%s;DLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\"&gt;"
-	                          "http://%s:%d/Resized/%s.jpg?width=%d,height=%d"
-	                          "&lt;/res&gt;",
-	                          dlna_pn, DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B|DLNA_FLAG_TM_I, 0,
-	                          lan_addr[args->iface].str, runtime_vars.port,
-	                          detailID, dstw, dsth);
+	strcatl(str, "protocolInfo=\"http-get:*:image/jpeg:DLNA.ORG_PN=");
+	strcats(str, dlna_pn);
+	strcatn(str, tpl->resized_tail, tpl->resized_tail_len);
+	strcats(str, detailID);
+	strcatl(str, ".jpg?width=");
+	strcati(str, dstw);
+	strcatl(str, ",height=");
+	strcati(str, dsth);
+	strcatl(str, "&lt;/res&gt;");
 }
 
+/* dlna_pn, if set, is written as DLNA.ORG_PN ahead of the rest of the
+ * fourth protocolInfo field, dlna_info. */
 inline static void
 add_res(char *size, char *duration, char *bitrate, char *sampleFrequency,
-        char *nrAudioChannels, char *resolution, char *dlna_pn, char *mime,
-        char *detailID, const char *ext, struct Response *args)
+        char *nrAudioChannels, char *resolution, const char *dlna_pn,
+        const char *dlna_info, int dlna_len, const char *mime,
+        char *detailID, const char *ext, int has_captions, struct Response *args)
 {
-	strcatf(args->str, "&lt;res ");
+	const struct didl_template *tpl = args->tpl;
+	struct string_s *str = args->str;
+
+	strcatl(str, "&lt;res ");
 	if( size && (args->filter & FILTER_RES_SIZE) ) {
-		strcatf(args->str, "size=\"%s\" ", size);
+		add_element(str, "size=\"", size, "\" ");
 	}
 	if( duration && (args->filter & FILTER_RES_DURATION) ) {
-		strcatf(args->str, "duration=\"%s\" ", duration);
+		add_element(str, "duration=\"", duration, "\" ");
 	}
 	if( bitrate && (args->filter & FILTER_RES_BITRATE) ) {
 		int br = atoi(bitrate);
 		if(args->flags & FLAG_MS_PFS)
 			br /= 8;
-		strcatf(args->str, "bitrate=\"%d\" ", br);
+		strcatl(str, "bitrate=\"");
+		strcati(str, br);
+		strcatl(str, "\" ");
 	}
 	if( sampleFrequency && (args->filter & FILTER_RES_SAMPLEFREQUENCY) ) {
-		strcatf(args->str, "sampleFrequency=\"%s\" ", sampleFrequency);
+		add_element(str, "sampleFrequency=\"", sampleFrequency, "\" ");
 	}
 	if( nrAudioChannels && (args->filter & FILTER_RES_NRAUDIOCHANNELS) ) {
-		strcatf(args->str, "nrAudioChannels=\"%s\" ", nrAudioChannels);
+		add_element(str, "nrAudioChannels=\"", nrAudioChannels, "\" ");
 	}
 	if( resolution && (args->filter & FILTER_RES_RESOLUTION) ) {
-		strcatf(args->str, "resolution=\"%s\" ", resolution);
+		add_element(str, "resolution=\"", resolution, "\" ");
 	}
 	if( args->filter & FILTER_PV_SUBTITLE )
 	{
-		if( args->flags & FLAG_HAS_CAPTIONS )
+		if( has_captions )
 		{
 			if( args->filter & FILTER_PV_SUBTITLE_FILE_TYPE )
-				strcatf(args->str, "pv:subtitleFileType=\"SRT\" ");
+				strcatl(str, "pv:subtitleFileType=\"SRT\" ");
 			if( args->filter & FILTER_PV_SUBTITLE_FILE_URI )
-				strcatf(args->str, "pv:subtitleFileUri=\"http://%s:%d/Captions/%s.srt\" ",
-			                lan_addr[args->iface].str, runtime_vars.port, detailID);
+			{
+				strcatl(str, "pv:subtitleFileUri=\"");
+				add_url(str, tpl, "Captions/");
+				strcats(str, detailID);
+				strcatl(str, ".srt\" ");
+			}
 		}
 	}
-	strcatf(args->str, "protocolInfo=\"http-get:*:%s:%s\"&gt;"
-	                          "http://%s:%d/MediaItems/%s.%s"
-	                          "&lt;/res&gt;",
-	                          mime, dlna_pn, lan_addr[args->iface].str,
-	                          runtime_vars.port, detailID, ext);
+	strcatl(str, "protocolInfo=\"http-get:*:");
+	strcats(str, mime);
+	strcatl(str, ":");
+	if( dlna_pn )
+	{
+		strcatl(str, "DLNA.ORG_PN=");
+		strcats(str, dlna_pn);
+	}
+	strcatn(str, dlna_info, dlna_len);
+	strcatl(str, "\"&gt;");
+	add_url(str, tpl, "MediaItems/");
+	strcats(str, detailID);
+	strcatl(str, ".");
+	strcats(str, ext);
+	strcatl(str, "&lt;/res&gt;");
+}
+
+/* Run one of the fixed single-value lookups, keyed by an ID */
+static int64_t
+get_field_by_id(sqlite3 *db, const char *sql, const char *id)
+{
+	sqlite3_stmt *stmt;
+
+	stmt = sql_prepare_cached(db, sql);
+	if (!stmt)
+		return -1;
+	sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
+	return sql_get_int64_cached(stmt);
 }
 
 static int
-get_child_count(const char *object, struct magic_container_s *magic)
+get_child_count(sqlite3 *db, const char *object, struct magic_container_s *magic)
 {
 	int ret;
 
 	if (magic && magic->child_count)
 		ret = sql_get_int_field(db, "SELECT count(*) from %s", magic->child_count);
 	else if (magic && magic->objectid && *(magic->objectid))
-		ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s';", *(magic->objectid));
+		ret = get_field_by_id(db, "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = ?", *(magic->objectid));
 	else
-		ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s';", object);
+		ret = get_field_by_id(db, "SELECT CHILD_COUNT from OBJECTS where OBJECT_ID = ?", object);
 
 	return (ret > 0) ? ret : 0;
 }
 
 static int
-object_exists(const char *object)
+object_exists(sqlite3 *db, const char *object)
 {
 	int ret;
-	ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where OBJECT_ID = '%q'",
+	ret = get_field_by_id(db, "SELECT count(*) from OBJECTS where OBJECT_ID = ?",
 				strcmp(object, "*") == 0 ? "0" : object);
 	return (ret > 0);
 }
 
+/* How many results a page will hold; a RequestedCount below 0 means all */
+static int
+page_rows(int totalMatches, int StartingIndex, int RequestedCount)
+{
+	int rows = MAX(totalMatches - StartingIndex, 0);
+
+	if( RequestedCount >= 0 )
+		rows = MIN(rows, RequestedCount);
+
+	return rows;
+}
+
 #define COLUMNS "o.DETAIL_ID, o.CLASS," \
                 " d.SIZE, d.TITLE, d.DURATION, d.BITRATE, d.SAMPLERATE, d.ARTIST," \
                 " d.ALBUM, d.GENRE, d.COMMENT, d.CHANNELS, d.TRACK, d.DATE, d.RESOLUTION," \
-                " d.THUMBNAIL, d.CREATOR, d.DLNA_PN, d.MIME, d.ALBUM_ART, d.ROTATION, d.DISC "
+                " d.THUMBNAIL, d.CREATOR, d.DLNA_PN, d.MIME, d.ALBUM_ART, d.ROTATION, d.DISC," \
+                " c.ID, b.SEC, o.CHILD_COUNT "
 #define SELECT_COLUMNS "SELECT o.OBJECT_ID, o.PARENT_ID, o.REF_ID, " COLUMNS
+/* Captions and bookmarks come along with each row, so that building a
+ * response takes a single query however many items it holds */
+#define FROM_OBJECTS "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)" \
+                     " left join CAPTIONS c on (c.ID = o.DETAIL_ID)" \
+                     " left join BOOKMARKS b on (b.ID = o.DETAIL_ID)"
+
+/* Paging cursors.  "limit offset, count" makes SQLite step through every
+ * row before the page, so scrolling to the end of a large container gets
+ * slower with every page.  For each (client, container, criteria, sort)
+ * we remember the sort key of the last row of recent pages, and start
+ * the following page with a seek past that key instead.  Any change to
+ * the database throws the marks away. */
+#define PAGE_CURSORS 16
+#define PAGE_MARKS 4
+#define PAGE_KEYS 8
+
+struct page_mark {
+	int index;			/* the row that follows the mark */
+	int nkeys;
+	char *key[PAGE_KEYS];		/* sort key of the row before it */
+};
+
+struct page_cursor {
+	char *query;
+	uint32_t update_id;
+	int changes;
+	unsigned int used;
+	int next;
+	struct page_mark mark[PAGE_MARKS];
+};
+
+/* A sort made total with a unique tiebreaker, which seeking relies on */
+struct page_keys {
+	int nkeys;
+	const char *key[PAGE_KEYS];
+	int desc[PAGE_KEYS];
+	char *copy;
+	char columns[256];		/* ", key, ..." to select them */
+	char order[256];		/* "order by key, ..." */
+};
+
+static struct page_cursor page_cursors[PAGE_CURSORS];
+static unsigned int page_clock;
+
+static void
+clear_page_mark(struct page_mark *m)
+{
+	int i;
+
+	for (i = 0; i < m->nkeys; i++)
+		free(m->key[i]);
+	memset(m, 0, sizeof(*m));
+}
+
+static void
+set_page_mark(struct page_mark *m, char **key)
+{
+	int i;
+
+	for (i = 0; i < m->nkeys; i++)
+	{
+		free(m->key[i]);
+		m->key[i] = key[i] ? strdup(key[i]) : NULL;
+	}
+}
+
+/* Only sorts on plain columns qualify: those compare against their own
+ * text in the same order they sort in */
+static int
+init_page_keys(struct page_keys *k, const char *orderBy, const char *tiebreak)
+{
+	struct string_s columns, order;
+	char *item, *saveptr, *dir;
+	int i;
+
+	memset(k, 0, sizeof(*k));
+	if (strncmp(orderBy, "order by ", 9) != 0)
+		return 0;
+	k->copy = strdup(orderBy + 9);
+	for (item = strtok_r(k->copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr))
+	{
+		while (isspace(*item))
+			item++;
+		dir = item + strcspn(item, " ");
+		if (*dir)
+		{
+			*dir++ = '\0';
+			if (strcasecmp(dir, "DESC") == 0)
+				k->desc[k->nkeys] = 1;
+			else if (strcasecmp(dir, "ASC") != 0)
+				goto unusable;
+		}
+		if (!*item || item[strspn(item, "od.ABCDEFGHIJKLMNOPQRSTUVWXYZ_")] ||
+		    k->nkeys >= PAGE_KEYS - 1)
+			goto unusable;
+		k->key[k->nkeys++] = item;
+	}
+	if (!k->nkeys)
+		goto unusable;
+	/* The tiebreaker runs the same way as the last key, which lets a
+	 * descending sort read its index backwards */
+	if (strcmp(k->key[k->nkeys - 1], tiebreak) != 0)
+	{
+		k->desc[k->nkeys] = k->desc[k->nkeys - 1];
+		k->key[k->nkeys++] = tiebreak;
+	}
+
+	columns.data = k->columns;
+	columns.size = sizeof(k->columns);
+	columns.off = 0;
+	order.data = k->order;
+	order.size = sizeof(k->order);
+	order.off = 0;
+	strcatf(&order, "order by ");
+	for (i = 0; i < k->nkeys; i++)
+	{
+		strcatf(&columns, ", %s", k->key[i]);
+		strcatf(&order, "%s%s%s", i ? ", " : "", k->key[i], k->desc[i] ? " DESC" : "");
+	}
+	if (columns.off < columns.size && order.off < order.size)
+		return k->nkeys;
+unusable:
+	free(k->copy);
+	memset(k, 0, sizeof(*k));
+	return 0;
+}
+
+/* The ORDER BY of a compound SELECT can only name result columns, so
+ * sort keys that no cursor put in the projection go in it this way */
+static char *
+order_columns(const char *orderBy)
+{
+	struct string_s str;
+	const char *item;
+	int len;
+
+	if (strncmp(orderBy, "order by ", 9) != 0)
+		return NULL;
+	str.size = strlen(orderBy) + 1;
+	str.data = malloc(str.size);
+	str.off = 0;
+	if (!str.data)
+		return NULL;
+	str.data[0] = '\0';
+	for (item = orderBy + 9; *item; item += len)
+	{
+		item += strspn(item, ", ");
+		len = strcspn(item, ",");
+		if (len)
+			strcatf(&str, ", %.*s", (int)strcspn(item, " ,"), item);
+	}
+
+	return str.data;
+}
+
+static struct page_cursor *
+get_page_cursor(const char *query)
+{
+	struct page_cursor *c, *lru = page_cursors;
+	int i;
+
+	for (i = 0; i < PAGE_CURSORS; i++)
+	{
+		c = &page_cursors[i];
+		if (c->query && strcmp(c->query, query) == 0)
+			break;
+		if (c->used < lru->used)
+			lru = c;
+	}
+	if (i == PAGE_CURSORS)
+	{
+		c = lru;
+		free(c->query);
+		for (i = 0; i < PAGE_MARKS; i++)
+			clear_page_mark(&c->mark[i]);
+		c->query = strdup(query);
+		c->update_id = updateID;
+		c->changes = sqlite3_total_changes(db);
+	}
+	/* SystemUpdateID lags changes by up to two seconds, so check both.
+	 * Changes made here all go through the writer. */
+	if (c->update_id != updateID || c->changes != sqlite3_total_changes(db))
+	{
+		for (i = 0; i < PAGE_MARKS; i++)
+			clear_page_mark(&c->mark[i]);
+		c->update_id = updateID;
+		c->changes = sqlite3_total_changes(db);
+	}
+	c->used = ++page_clock;
+
+	return c;
+}
+
+/* The nearest mark at or before start */
+static struct page_mark *
+find_page_mark(struct page_cursor *c, int start, int nkeys)
+{
+	struct page_mark *best = NULL;
+	int i;
+
+	for (i = 0; i < PAGE_MARKS; i++)
+	{
+		if (c->mark[i].nkeys == nkeys && c->mark[i].index <= start &&
+		    (!best || c->mark[i].index > best->index))
+			best = &c->mark[i];
+	}
+
+	return best;
+}
+
+static void
+store_page_mark(struct page_cursor *c, struct page_mark *m)
+{
+	int i;
+
+	for (i = 0; i < PAGE_MARKS; i++)
+	{
+		if (c->mark[i].index == m->index)
+			break;
+	}
+	if (i == PAGE_MARKS)
+	{
+		i = c->next;
+		c->next = (c->next + 1) % PAGE_MARKS;
+	}
+	clear_page_mark(&c->mark[i]);
+	c->mark[i] = *m;
+	memset(m, 0, sizeof(*m));
+}
+
+/* " and <rows after the mark>", with a ? for each key value to bind.
+ * SQLite sorts NULLs first, which the general form has to spell out. */
+static int
+page_seek_simple(const struct page_keys *k, const struct page_mark *m)
+{
+	int i;
+
+	/* Row values let SQLite seek straight to the mark in an index */
+	if (sqlite3_libversion_number() < 3015000)
+		return 0;
+	for (i = 0; i < k->nkeys; i++)
+	{
+		if (k->desc[i] || !m->key[i])
+			return 0;
+	}
+	return 1;
+}
+
+static char *
+page_seek_sql(const struct page_keys *k, const struct page_mark *m)
+{
+	struct string_s str;
+	int i, j;
+
+	str.size = 4096;
+	str.data = malloc(str.size);
+	str.off = 0;
+	if (!str.data)
+		return NULL;
+	if (page_seek_simple(k, m))
+	{
+		strcatf(&str, " and (");
+		for (i = 0; i < k->nkeys; i++)
+			strcatf(&str, "%s%s", i ? ", " : "", k->key[i]);
+		strcatf(&str, ") > (");
+		for (i = 0; i < k->nkeys; i++)
+			strcatf(&str, "%s?", i ? ", " : "");
+		strcatf(&str, ")");
+		return str.data;
+	}
+	strcatf(&str, " and (");
+	for (i = 0; i < k->nkeys; i++)
+	{
+		strcatf(&str, "%s(", i ? " or " : "");
+		for (j = 0; j < i; j++)
+			strcatf(&str, "%s IS ? and ", k->key[j]);
+		if (!k->desc[i])
+			strcatf(&str, m->key[i] ? "%s > ?" : "%s IS NOT NULL", k->key[i]);
+		else if (m->key[i])
+			strcatf(&str, "(%s < ? or %s IS NULL)", k->key[i], k->key[i]);
+		else
+			strcatf(&str, "0");
+		strcatf(&str, ")");
+	}
+	strcatf(&str, ")");
+
+	return str.data;
+}
+
+static void
+page_seek_bind(sqlite3_stmt *stmt, int *col, const struct page_keys *k, const struct page_mark *m)
+{
+	int i, j, simple = page_seek_simple(k, m);
+
+	for (i = 0; i < k->nkeys; i++)
+	{
+		if (simple)
+		{
+			sqlite3_bind_text(stmt, (*col)++, m->key[i], -1, SQLITE_STATIC);
+			continue;
+		}
+		for (j = 0; j < i; j++)
+		{
+			if (m->key[j])
+				sqlite3_bind_text(stmt, (*col)++, m->key[j], -1, SQLITE_STATIC);
+			else
+				sqlite3_bind_null(stmt, (*col)++);
+		}
+		if (m->key[i])
+			sqlite3_bind_text(stmt, (*col)++, m->key[i], -1, SQLITE_STATIC);
+	}
+}
+
+/* Recently sent Browse and Search responses, keyed by everything in the
+ * request that shapes them.  They go stale on the same changes as the
+ * page cursors.  SOAP requests are answered one at a time in the main
+ * process, so an identical request that comes in while a response is
+ * being built is only read once the entry is there; concurrent misses
+ * never get to compute the same response twice. */
+#define RESP_CACHE_SLOTS 64
+
+struct resp_entry {
+	char *key;			/* NULL = unused slot */
+	char *body;
+	int len;
+	uint32_t update_id;
+	int changes;
+	unsigned int used;
+};
+
+static struct resp_entry resp_cache[RESP_CACHE_SLOTS];
+static unsigned int resp_clock;
+struct resp_cache_stats resp_cache_stats;
+
+static void
+drop_resp(struct resp_entry *e)
+{
+	resp_cache_stats.bytes -= strlen(e->key) + 1 + e->len;
+	resp_cache_stats.entries--;
+	free(e->key);
+	free(e->body);
+	memset(e, 0, sizeof(*e));
+}
+
+/* Sends the cached response to the request, if there is one */
+static int
+send_cached_resp(struct upnphttp *h, const char *key)
+{
+	struct resp_entry *e;
+	int i;
+
+	if (!key)
+		return 0;
+	for (i = 0; i < RESP_CACHE_SLOTS; i++)
+	{
+		e = &resp_cache[i];
+		if (!e->key || strcmp(e->key, key) != 0)
+			continue;
+		if (e->update_id != updateID || e->changes != sqlite3_total_changes(db))
+		{
+			drop_resp(e);
+			break;
+		}
+		e->used = ++resp_clock;
+		resp_cache_stats.hits++;
+		DPRINTF(E_DEBUG, L_HTTP, "Response served from cache [%d bytes]\n", e->len);
+		BuildSendAndCloseSoapResp(h, e->body, e->len);
+		return 1;
+	}
+	resp_cache_stats.misses++;
+
+	return 0;
+}
+
+static void
+store_resp(const char *key, const struct string_s *str)
+{
+	size_t size, budget = (size_t)runtime_vars.resp_cache_kb << 10;
+	struct resp_entry *e, *lru;
+	int i;
+
+	if (!key)
+		return;
+	/* One response shouldn't push out everything else */
+	size = strlen(key) + 1 + str->off;
+	if (size > budget / 4)
+		return;
+	for (i = 0; i < RESP_CACHE_SLOTS; i++)
+	{
+		e = &resp_cache[i];
+		if (e->key && (e->update_id != updateID || e->changes != sqlite3_total_changes(db)))
+			drop_resp(e);
+	}
+	while (resp_cache_stats.entries == RESP_CACHE_SLOTS ||
+	       resp_cache_stats.bytes + size > budget)
+	{
+		lru = NULL;
+		for (i = 0; i < RESP_CACHE_SLOTS; i++)
+		{
+			e = &resp_cache[i];
+			if (e->key && (!lru || e->used < lru->used))
+				lru = e;
+		}
+		drop_resp(lru);
+	}
+	for (i = 0; resp_cache[i].key; i++)
+		continue;
+	e = &resp_cache[i];
+	e->body = malloc(str->off);
+	e->key = strdup(key);
+	if (!e->body || !e->key)
+	{
+		free(e->body);
+		free(e->key);
+		memset(e, 0, sizeof(*e));
+		return;
+	}
+	memcpy(e->body, str->data, str->off);
+	e->len = str->off;
+	e->update_id = updateID;
+	e->changes = sqlite3_total_changes(db);
+	e->used = ++resp_clock;
+	resp_cache_stats.bytes += size;
+	resp_cache_stats.entries++;
+}
 
 #define NON_ZERO(x) (x && atoi(x))
 #define IS_ZERO(x) (!x || !atoi(x))
@@ -777,193 +1412,156 @@ callback(void *args, int argc, char **argv, char **azColName)
 	char *id = argv[0], *parent = argv[1], *refID = argv[2], *detailID = argv[3], *class = argv[4], *size = argv[5], *title = argv[6],
 	     *duration = argv[7], *bitrate = argv[8], *sampleFrequency = argv[9], *artist = argv[10], *album = argv[11],
 	     *genre = argv[12], *comment = argv[13], *nrAudioChannels = argv[14], *track = argv[15], *date = argv[16], *resolution = argv[17],
-	     *tn = argv[18], *creator = argv[19], *dlna_pn = argv[20], *mime = argv[21], *album_art = argv[22], *rotate = argv[23];
-	char dlna_buf[128];
-	const char *ext;
+	     *tn = argv[18], *creator = argv[19], *dlna_pn = argv[20], *album_art = argv[22], *rotate = argv[23],
+	     *caption = argv[25], *bookmark = argv[26], *child_count = argv[27];
+	const char *mime = argv[21];
+	const struct didl_template *tpl;
 	struct string_s *str = passed_args->str;
-	int ret = 0;
 
-	/* Make sure we have at least 8KB left of allocated memory to finish the response. */
+	/* Make sure we have at least 8KB left of the buffer for this row.
+	 * Once it fills up, what we have so far goes out to the client. */
 	if( str->off > (str->size - 8192) )
 	{
-#if MAX_RESPONSE_SIZE > 0
-		if( (str->size+DEFAULT_RESP_SIZE) <= MAX_RESPONSE_SIZE )
-		{
-#endif
-			str->data = realloc(str->data, (str->size+DEFAULT_RESP_SIZE));
-			if( str->data )
-			{
-				str->size += DEFAULT_RESP_SIZE;
-				DPRINTF(E_DEBUG, L_HTTP, "UPnP SOAP response enlarged to %lu. [%d results so far]\n",
-					(unsigned long)str->size, passed_args->returned);
-			}
-			else
-			{
-				DPRINTF(E_ERROR, L_HTTP, "UPnP SOAP response was too big, and realloc failed!\n");
-				return -1;
-			}
-#if MAX_RESPONSE_SIZE > 0
-		}
-		else
+		if( FlushSoapResp(passed_args->h, str) != 0 )
 		{
-			DPRINTF(E_ERROR, L_HTTP, "UPnP SOAP response cut short, to not exceed the max response size [%lld]!\n", (long long int)MAX_RESPONSE_SIZE);
+			DPRINTF(E_ERROR, L_HTTP, "UPnP SOAP response failed to send, after %d results!\n",
+				passed_args->returned);
 			return -1;
 		}
-#endif
+		DPRINTF(E_DEBUG, L_HTTP, "UPnP SOAP response flushed. [%d results so far]\n",
+			passed_args->returned);
 	}
 	passed_args->returned++;
+	/* The sort key columns come after everything else */
+	if( passed_args->mark && passed_args->returned == passed_args->mark_row )
+		set_page_mark(passed_args->mark, argv + argc - passed_args->mark->nkeys);
+	if( !passed_args->tpl )
+		passed_args->tpl = get_didl_template(passed_args);
+	tpl = passed_args->tpl;
 
 	if( strncmp(class, "item", 4) == 0 )
 	{
-		uint32_t dlna_flags = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B;
-		char *alt_title = NULL;
+		const char *dlna_info, *ext;
+		char dlna_buf[128];
+		int dlna_len, title_len;
+		int streamed = 0, has_captions = 0, title_dot = 0;
+
+		title_len = strlen(title);
 		/* We may need special handling for certain MIME types */
 		if( *mime == 'v' )
 		{
-			dlna_flags |= DLNA_FLAG_TM_S;
-			if( passed_args->flags & FLAG_MIME_AVI_DIVX )
-			{
-				if( strcmp(mime, "video/x-msvideo") == 0 )
-				{
-					if( creator )
-						strcpy(mime+6, "divx");
-					else
-						strcpy(mime+6, "avi");
-				}
-			}
-			else if( passed_args->flags & FLAG_MIME_AVI_AVI )
+			streamed = 1;
+			if( tpl->avi_mime )
 			{
 				if( strcmp(mime, "video/x-msvideo") == 0 )
-				{
-					strcpy(mime+6, "avi");
-				}
+					mime = creator ? tpl->avi_creator_mime : tpl->avi_mime;
 			}
-			else if( passed_args->client == EFreeBox && dlna_pn )
+			else if( tpl->freebox_ts && dlna_pn )
 			{
 				if( strncmp(dlna_pn, "AVC_TS", 6) == 0 ||
 				    strncmp(dlna_pn, "MPEG_TS", 7) == 0 )
-				{
-					strcpy(mime+6, "mp2t");
-				}
+					mime = "video/mp2t";
 			}
-			if( !(passed_args->flags & FLAG_DLNA) )
-			{
-				if( strcmp(mime+6, "vnd.dlna.mpeg-tts") == 0 )
-				{
-					strcpy(mime+6, "mpeg");
-				}
-			}
-			if( (passed_args->flags & FLAG_CAPTION_RES) ||
-			    (passed_args->filter & (FILTER_SEC_CAPTION_INFO_EX|FILTER_PV_SUBTITLE)) )
-			{
-				if( sql_get_int_field(db, "SELECT ID from CAPTIONS where ID = '%s'", detailID) > 0 )
-					passed_args->flags |= FLAG_HAS_CAPTIONS;
-			}
-			/* From what I read, Samsung TV's expect a [wrong] MIME type of x-mkv. */
-			if( passed_args->flags & FLAG_SAMSUNG )
+			if( tpl->tts_mime && strcmp(mime+6, "vnd.dlna.mpeg-tts") == 0 )
+				mime = tpl->tts_mime;
+			if( tpl->want_captions && caption )
+				has_captions = 1;
+			if( tpl->mkv_mime )
 			{
 				if( strcmp(mime+6, "x-matroska") == 0 )
-				{
-					strcpy(mime+8, "mkv");
-				}
-			}
-			/* LG hack: subtitles won't get used unless dc:title contains a dot. */
-			else if( passed_args->client == ELGDevice && (passed_args->flags & FLAG_HAS_CAPTIONS) )
-			{
-				ret = asprintf(&alt_title, "%s.", title);
-				if( ret > 0 )
-					title = alt_title;
-				else
-					alt_title = NULL;
-			}
-			/* Asus OPlay reboots with titles longer than 23 characters with some file types. */
-			else if( passed_args->client == EAsusOPlay && (passed_args->flags & FLAG_HAS_CAPTIONS) )
-			{
-				if( strlen(title) > 23 )
-					title[23] = '\0';
+					mime = tpl->mkv_mime;
 			}
+			else if( has_captions && tpl->caption_title == TITLE_DOT )
+				title_dot = 1;
+			else if( has_captions && tpl->caption_title == TITLE_TRUNCATE )
+				title_len = MIN(title_len, 23);
 		}
 		else if( *mime == 'a' )
 		{
-			dlna_flags |= DLNA_FLAG_TM_S;
-			if( strcmp(mime+6, "x-flac") == 0 )
-			{
-				if( passed_args->flags & FLAG_MIME_FLAC_FLAC )
-				{
-					strcpy(mime+6, "flac");
-				}
-			}
-			else if( strcmp(mime+6, "x-wav") == 0 )
+			streamed = 1;
+			if( tpl->flac_mime && strcmp(mime+6, "x-flac") == 0 )
+				mime = tpl->flac_mime;
+			else if( tpl->wav_mime && strcmp(mime+6, "x-wav") == 0 )
+				mime = tpl->wav_mime;
+		}
+
+		if( dlna_pn || (passed_args->flags & FLAG_DLNA) )
+		{
+			dlna_info = tpl->dlna_tail[!streamed];
+			dlna_len = tpl->dlna_tail_len[!streamed];
+			/* Without a profile name, drop the leading separator */
+			if( !dlna_pn )
 			{
-				if( passed_args->flags & FLAG_MIME_WAV_WAV )
-				{
-					strcpy(mime+6, "wav");
-				}
+				dlna_info++;
+				dlna_len--;
 			}
 		}
 		else
-			dlna_flags |= DLNA_FLAG_TM_I;
-
-		if( dlna_pn )
-			snprintf(dlna_buf, sizeof(dlna_buf), "DLNA.ORG_PN=%s;"
-			                                     "DLNA.ORG_OP=01;"
-			                                     "DLNA.ORG_CI=0;"
-			                                     "DLNA.ORG_FLAGS=%08X%024X",
-			                                     dlna_pn, dlna_flags, 0);
-		else if( passed_args->flags & FLAG_DLNA )
-			snprintf(dlna_buf, sizeof(dlna_buf), "DLNA.ORG_OP=01;"
-			                                     "DLNA.ORG_CI=0;"
-			                                     "DLNA.ORG_FLAGS=%08X%024X",
-			                                     dlna_flags, 0);
-		else
-			strcpy(dlna_buf, "*");
-
-		ret = strcatf(str, "&lt;item id=\"%s\" parentID=\"%s\" restricted=\"1\"", id, parent);
-		if( refID && (passed_args->filter & FILTER_REFID) ) {
-			ret = strcatf(str, " refID=\"%s\"", refID);
+		{
+			dlna_info = "*";
+			dlna_len = 1;
 		}
-		ret = strcatf(str, "&gt;"
-		                   "&lt;dc:title&gt;%s&lt;/dc:title&gt;"
-		                   "&lt;upnp:class&gt;object.%s&lt;/upnp:class&gt;",
-		                   title, class);
+
+		strcatl(str, "&lt;item id=\"");
+		strcats(str, id);
+		strcatl(str, "\" parentID=\"");
+		strcats(str, parent);
+		strcatl(str, "\" restricted=\"1\"");
+		if( refID && (passed_args->filter & FILTER_REFID) ) {
+			add_element(str, " refID=\"", refID, "\"");
+		}
+		strcatl(str, "&gt;&lt;dc:title&gt;");
+		strcatn(str, title, title_len);
+		if( title_dot )
+			strcatl(str, ".");
+		strcatl(str, "&lt;/dc:title&gt;&lt;upnp:class&gt;object.");
+		strcats(str, class);
+		strcatl(str, "&lt;/upnp:class&gt;");
 		if( comment && (passed_args->filter & FILTER_DC_DESCRIPTION) ) {
-			ret = strcatf(str, "&lt;dc:description&gt;%.384s&lt;/dc:description&gt;", comment);
+			strcatl(str, "&lt;dc:description&gt;");
+			strcatn(str, comment, strnlen(comment, 384));
+			strcatl(str, "&lt;/dc:description&gt;");
 		}
 		if( creator && (passed_args->filter & FILTER_DC_CREATOR) ) {
-			ret = strcatf(str, "&lt;dc:creator&gt;%s&lt;/dc:creator&gt;", creator);
+			add_element(str, "&lt;dc:creator&gt;", creator, "&lt;/dc:creator&gt;");
 		}
 		if( date && (passed_args->filter & FILTER_DC_DATE) ) {
-			ret = strcatf(str, "&lt;dc:date&gt;%s&lt;/dc:date&gt;", date);
+			add_element(str, "&lt;dc:date&gt;", date, "&lt;/dc:date&gt;");
 		}
 		if( passed_args->filter & FILTER_SEC_DCM_INFO ) {
-			/* Get bookmark */
-			ret = strcatf(str, "&lt;sec:dcmInfo&gt;CREATIONDATE=0,FOLDER=%s,BM=%d&lt;/sec:dcmInfo&gt;",
-			              title, sql_get_int_field(db, "SELECT SEC from BOOKMARKS where ID = '%s'", detailID));
+			strcatl(str, "&lt;sec:dcmInfo&gt;CREATIONDATE=0,FOLDER=");
+			strcatn(str, title, title_len);
+			if( title_dot )
+				strcatl(str, ".");
+			strcatl(str, ",BM=");
+			strcati(str, bookmark ? atoi(bookmark) : 0);
+			strcatl(str, "&lt;/sec:dcmInfo&gt;");
 		}
 		if( artist ) {
 			if( (*mime == 'v') && (passed_args->filter & FILTER_UPNP_ACTOR) ) {
-				ret = strcatf(str, "&lt;upnp:actor&gt;%s&lt;/upnp:actor&gt;", artist);
+				add_element(str, "&lt;upnp:actor&gt;", artist, "&lt;/upnp:actor&gt;");
 			}
 			if( passed_args->filter & FILTER_UPNP_ARTIST ) {
-				ret = strcatf(str, "&lt;upnp:artist&gt;%s&lt;/upnp:artist&gt;", artist);
+				add_element(str, "&lt;upnp:artist&gt;", artist, "&lt;/upnp:artist&gt;");
 			}
 		}
 		if( album && (passed_args->filter & FILTER_UPNP_ALBUM) ) {
-			ret = strcatf(str, "&lt;upnp:album&gt;%s&lt;/upnp:album&gt;", album);
+			add_element(str, "&lt;upnp:album&gt;", album, "&lt;/upnp:album&gt;");
 		}
 		if( genre && (passed_args->filter & FILTER_UPNP_GENRE) ) {
-			ret = strcatf(str, "&lt;upnp:genre&gt;%s&lt;/upnp:genre&gt;", genre);
+			add_element(str, "&lt;upnp:genre&gt;", genre, "&lt;/upnp:genre&gt;");
 		}
 		if( strncmp(id, MUSIC_PLIST_ID, strlen(MUSIC_PLIST_ID)) == 0 ) {
 			track = strrchr(id, '$')+1;
 		}
 		if( NON_ZERO(track) && (passed_args->filter & FILTER_UPNP_ORIGINALTRACKNUMBER) ) {
-			ret = strcatf(str, "&lt;upnp:originalTrackNumber&gt;%s&lt;/upnp:originalTrackNumber&gt;", track);
+			add_element(str, "&lt;upnp:originalTrackNumber&gt;", track, "&lt;/upnp:originalTrackNumber&gt;");
 		}
 		if( passed_args->filter & FILTER_RES ) {
 			ext = mime_to_ext(mime);
 			add_res(size, duration, bitrate, sampleFrequency, nrAudioChannels,
-			        resolution, dlna_buf, mime, detailID, ext, passed_args);
+			        resolution, dlna_pn, dlna_info, dlna_len, mime, detailID, ext,
+			        has_captions, passed_args);
 			if( *mime == 'i' ) {
 				int srcw, srch;
 				if( resolution && (sscanf(resolution, "%6dx%6d", &srcw, &srch) == 2) )
@@ -976,16 +1574,20 @@ callback(void *args, int argc, char **argv, char **azColName)
 						add_resized_res(srcw, srch, 640, 480, "JPEG_SM", detailID, passed_args);
 				}
 				if( !(passed_args->flags & FLAG_RESIZE_THUMBS) && NON_ZERO(tn) && IS_ZERO(rotate) ) {
-					ret = strcatf(str, "&lt;res protocolInfo=\"http-get:*:%s:%s\"&gt;"
-					                   "http://%s:%d/Thumbnails/%s.jpg"
-					                   "&lt;/res&gt;",
-					                   mime, "DLNA.ORG_PN=JPEG_TN;DLNA.ORG_CI=1", lan_addr[passed_args->iface].str,
-					                   runtime_vars.port, detailID);
+					strcatl(str, "&lt;res protocolInfo=\"http-get:*:");
+					strcats(str, mime);
+					strcatl(str, ":DLNA.ORG_PN=JPEG_TN;DLNA.ORG_CI=1\"&gt;");
+					add_url(str, tpl, "Thumbnails/");
+					strcats(str, detailID);
+					strcatl(str, ".jpg&lt;/res&gt;");
 				}
 				else
 					add_resized_res(srcw, srch, 160, 160, "JPEG_TN", detailID, passed_args);
 			}
 			else if( *mime == 'v' ) {
+#define ALT_RES(info) add_res(size, duration, bitrate, sampleFrequency, nrAudioChannels, \
+				      resolution, NULL, info, strlen(info), mime, detailID, ext, \
+				      has_captions, passed_args)
 				switch( passed_args->client ) {
 				case EToshibaTV:
 					if( dlna_pn &&
@@ -994,9 +1596,7 @@ callback(void *args, int argc, char **argv, char **azColName)
 					     strncmp(dlna_pn, "AVC_TS_MP_HD_AC3", 16) == 0 ||
 					     strncmp(dlna_pn, "AVC_TS_HP_HD_AC3", 16) == 0))
 					{
-						sprintf(dlna_buf, "DLNA.ORG_PN=%s;DLNA.ORG_OP=01;DLNA.ORG_CI=1", "MPEG_PS_NTSC");
-						add_res(size, duration, bitrate, sampleFrequency, nrAudioChannels,
-						        resolution, dlna_buf, mime, detailID, ext, passed_args);
+						ALT_RES("DLNA.ORG_PN=MPEG_PS_NTSC;DLNA.ORG_OP=01;DLNA.ORG_CI=1");
 					}
 					break;
 				case ESonyBDP:
@@ -1006,15 +1606,11 @@ callback(void *args, int argc, char **argv, char **azColName)
 					{
 						if( strncmp(dlna_pn, "MPEG_TS_SD_NA", 13) != 0 )
 						{
-							sprintf(dlna_buf, "DLNA.ORG_PN=%s;DLNA.ORG_OP=01;DLNA.ORG_CI=1", "MPEG_TS_SD_NA");
-							add_res(size, duration, bitrate, sampleFrequency, nrAudioChannels,
-							        resolution, dlna_buf, mime, detailID, ext, passed_args);
+							ALT_RES("DLNA.ORG_PN=MPEG_TS_SD_NA;DLNA.ORG_OP=01;DLNA.ORG_CI=1");
 						}
 						if( strncmp(dlna_pn, "MPEG_TS_SD_EU", 13) != 0 )
 						{
-							sprintf(dlna_buf, "DLNA.ORG_PN=%s;DLNA.ORG_OP=01;DLNA.ORG_CI=1", "MPEG_TS_SD_EU");
-							add_res(size, duration, bitrate, sampleFrequency, nrAudioChannels,
-							        resolution, dlna_buf, mime, detailID, ext, passed_args);
+							ALT_RES("DLNA.ORG_PN=MPEG_TS_SD_EU;DLNA.ORG_OP=01;DLNA.ORG_CI=1");
 						}
 					}
 					else if( (dlna_pn &&
@@ -1024,18 +1620,14 @@ callback(void *args, int argc, char **argv, char **azColName)
 					         strcmp(mime+6, "x-msvideo") == 0 ||
 					         strcmp(mime+6, "mpeg") == 0 )
 					{
-						strcpy(mime+6, "avi");
+						mime = "video/avi";
 						if( !dlna_pn || strncmp(dlna_pn, "MPEG_PS_NTSC", 12) != 0 )
 						{
-							sprintf(dlna_buf, "DLNA.ORG_PN=%s;DLNA.ORG_OP=01;DLNA.ORG_CI=1", "MPEG_PS_NTSC");
-							add_res(size, duration, bitrate, sampleFrequency, nrAudioChannels,
-						        	resolution, dlna_buf, mime, detailID, ext, passed_args);
+							ALT_RES("DLNA.ORG_PN=MPEG_PS_NTSC;DLNA.ORG_OP=01;DLNA.ORG_CI=1");
 						}
 						if( !dlna_pn || strncmp(dlna_pn, "MPEG_PS_PAL", 11) != 0 )
 						{
-							sprintf(dlna_buf, "DLNA.ORG_PN=%s;DLNA.ORG_OP=01;DLNA.ORG_CI=1", "MPEG_PS_PAL");
-							add_res(size, duration, bitrate, sampleFrequency, nrAudioChannels,
-						        	resolution, dlna_buf, mime, detailID, ext, passed_args);
+							ALT_RES("DLNA.ORG_PN=MPEG_PS_PAL;DLNA.ORG_OP=01;DLNA.ORG_CI=1");
 						}
 					}
 					break;
@@ -1047,125 +1639,152 @@ callback(void *args, int argc, char **argv, char **azColName)
 					     strncmp(dlna_pn, "AVC_TS_MP_HD_AC3", 16) == 0 ||
 					     strncmp(dlna_pn, "AVC_TS_HP_HD_AC3", 16) == 0))
 					{
-					        sprintf(dlna_buf, "DLNA.ORG_PN=AVC_TS_HD_50_AC3%s", dlna_pn + 16);
-						add_res(size, duration, bitrate, sampleFrequency, nrAudioChannels,
-						        resolution, dlna_buf, mime, detailID, ext, passed_args);
+						snprintf(dlna_buf, sizeof(dlna_buf), "DLNA.ORG_PN=AVC_TS_HD_50_AC3%s", dlna_pn + 16);
+						ALT_RES(dlna_buf);
 					}
 					break;
 				case ESamsungSeriesCDE:
 				case ELGDevice:
 				case EAsusOPlay:
 				default:
-					if( passed_args->flags & FLAG_HAS_CAPTIONS )
+					if( has_captions )
 					{
 						if( passed_args->flags & FLAG_CAPTION_RES )
-							ret = strcatf(str, "&lt;res protocolInfo=\"http-get:*:text/srt:*\"&gt;"
-									     "http://%s:%d/Captions/%s.srt"
-									   "&lt;/res&gt;",
-									   lan_addr[passed_args->iface].str, runtime_vars.port, detailID);
+						{
+							strcatl(str, "&lt;res protocolInfo=\"http-get:*:text/srt:*\"&gt;");
+							add_url(str, tpl, "Captions/");
+							strcats(str, detailID);
+							strcatl(str, ".srt&lt;/res&gt;");
+						}
 						else if( passed_args->filter & FILTER_SEC_CAPTION_INFO_EX )
-							ret = strcatf(str, "&lt;sec:CaptionInfoEx sec:type=\"srt\"&gt;"
-							                     "http://%s:%d/Captions/%s.srt"
-							                   "&lt;/sec:CaptionInfoEx&gt;",
-							                   lan_addr[passed_args->iface].str, runtime_vars.port, detailID);
+						{
+							strcatl(str, "&lt;sec:CaptionInfoEx sec:type=\"srt\"&gt;");
+							add_url(str, tpl, "Captions/");
+							strcats(str, detailID);
+							strcatl(str, ".srt&lt;/sec:CaptionInfoEx&gt;");
+						}
 					}
-					free(alt_title);
 					break;
 				}
+#undef ALT_RES
 			}
 		}
 		if( NON_ZERO(album_art) )
 		{
 			/* Video and audio album art is handled differently */
 			if( *mime == 'v' && (passed_args->filter & FILTER_RES) && !(passed_args->flags & FLAG_MS_PFS) ) {
-				ret = strcatf(str, "&lt;res protocolInfo=\"http-get:*:image/jpeg:DLNA.ORG_PN=JPEG_TN\"&gt;"
-				                   "http://%s:%d/AlbumArt/%s-%s.jpg"
-				                   "&lt;/res&gt;",
-				                   lan_addr[passed_args->iface].str, runtime_vars.port, album_art, detailID);
+				strcatl(str, "&lt;res protocolInfo=\"http-get:*:image/jpeg:DLNA.ORG_PN=JPEG_TN\"&gt;");
+				add_url(str, tpl, "AlbumArt/");
+				strcats(str, album_art);
+				strcatl(str, "-");
+				strcats(str, detailID);
+				strcatl(str, ".jpg&lt;/res&gt;");
 			} else if( passed_args->filter & FILTER_UPNP_ALBUMARTURI ) {
-				ret = strcatf(str, "&lt;upnp:albumArtURI");
+				strcatl(str, "&lt;upnp:albumArtURI");
 				if( passed_args->filter & FILTER_UPNP_ALBUMARTURI_DLNA_PROFILEID ) {
-					ret = strcatf(str, " dlna:profileID=\"JPEG_TN\" xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\"");
+					strcatl(str, " dlna:profileID=\"JPEG_TN\" xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\"");
 				}
-				ret = strcatf(str, "&gt;http://%s:%d/AlbumArt/%s-%s.jpg&lt;/upnp:albumArtURI&gt;",
-				                   lan_addr[passed_args->iface].str, runtime_vars.port, album_art, detailID);
+				strcatl(str, "&gt;");
+				add_url(str, tpl, "AlbumArt/");
+				strcats(str, album_art);
+				strcatl(str, "-");
+				strcats(str, detailID);
+				strcatl(str, ".jpg&lt;/upnp:albumArtURI&gt;");
 			}
 		}
 		if( (passed_args->flags & FLAG_MS_PFS) && *mime == 'i' ) {
 			if( passed_args->client == EMediaRoom && !album )
-				ret = strcatf(str, "&lt;upnp:album&gt;%s&lt;/upnp:album&gt;", "[No Keywords]");
+				strcatl(str, "&lt;upnp:album&gt;[No Keywords]&lt;/upnp:album&gt;");
 
 			/* EVA2000 doesn't seem to handle embedded thumbnails */
+			strcatl(str, "&lt;upnp:albumArtURI&gt;");
 			if( !(passed_args->flags & FLAG_RESIZE_THUMBS) && NON_ZERO(tn) && IS_ZERO(rotate) ) {
-				ret = strcatf(str, "&lt;upnp:albumArtURI&gt;"
-				                   "http://%s:%d/Thumbnails/%s.jpg"
-				                   "&lt;/upnp:albumArtURI&gt;",
-				                   lan_addr[passed_args->iface].str, runtime_vars.port, detailID);
+				add_url(str, tpl, "Thumbnails/");
+				strcats(str, detailID);
+				strcatl(str, ".jpg");
 			} else {
-				ret = strcatf(str, "&lt;upnp:albumArtURI&gt;"
-				                   "http://%s:%d/Resized/%s.jpg?width=160,height=160"
-				                   "&lt;/upnp:albumArtURI&gt;",
-				                   lan_addr[passed_args->iface].str, runtime_vars.port, detailID);
+				add_url(str, tpl, "Resized/");
+				strcats(str, detailID);
+				strcatl(str, ".jpg?width=160,height=160");
 			}
+			strcatl(str, "&lt;/upnp:albumArtURI&gt;");
 		}
-		ret = strcatf(str, "&lt;/item&gt;");
+		strcatl(str, "&lt;/item&gt;");
 	}
 	else if( strncmp(class, "container", 9) == 0 )
 	{
-		ret = strcatf(str, "&lt;container id=\"%s\" parentID=\"%s\" restricted=\"1\" ", id, parent);
+		struct magic_container_s *magic = check_magic_container(id, passed_args->flags);
+
+		strcatl(str, "&lt;container id=\"");
+		strcats(str, id);
+		strcatl(str, "\" parentID=\"");
+		strcats(str, parent);
+		strcatl(str, "\" restricted=\"1\" ");
 		if( passed_args->filter & FILTER_SEARCHABLE ) {
-			ret = strcatf(str, "searchable=\"%d\" ", check_magic_container(id, passed_args->flags) ? 0 : 1);
+			strcatl(str, "searchable=\"");
+			strcats(str, magic ? "0" : "1");
+			strcatl(str, "\" ");
 		}
 		if( passed_args->filter & FILTER_CHILDCOUNT ) {
-			ret = strcatf(str, "childCount=\"%d\"", get_child_count(id, check_magic_container(id, passed_args->flags)));
+			strcatl(str, "childCount=\"");
+			if( magic )
+				strcati(str, get_child_count(passed_args->db, id, magic));
+			else
+				strcats(str, child_count ? child_count : "0");
+			strcatl(str, "\"");
 		}
 		/* If the client calls for BrowseMetadata on root, we have to include our "upnp:searchClass"'s, unless they're filtered out */
 		if( passed_args->requested == 1 && strcmp(id, "0") == 0 && (passed_args->filter & FILTER_UPNP_SEARCHCLASS) ) {
-			ret = strcatf(str, "&gt;"
-			                   "&lt;upnp:searchClass includeDerived=\"1\"&gt;object.item.audioItem&lt;/upnp:searchClass&gt;"
-			                   "&lt;upnp:searchClass includeDerived=\"1\"&gt;object.item.imageItem&lt;/upnp:searchClass&gt;"
-			                   "&lt;upnp:searchClass includeDerived=\"1\"&gt;object.item.videoItem&lt;/upnp:searchClass");
-		}
-		ret = strcatf(str, "&gt;"
-		                   "&lt;dc:title&gt;%s&lt;/dc:title&gt;"
-		                   "&lt;upnp:class&gt;object.%s&lt;/upnp:class&gt;",
-		                   title, class);
+			strcatl(str, "&gt;"
+			             "&lt;upnp:searchClass includeDerived=\"1\"&gt;object.item.audioItem&lt;/upnp:searchClass&gt;"
+			             "&lt;upnp:searchClass includeDerived=\"1\"&gt;object.item.imageItem&lt;/upnp:searchClass&gt;"
+			             "&lt;upnp:searchClass includeDerived=\"1\"&gt;object.item.videoItem&lt;/upnp:searchClass");
+		}
+		strcatl(str, "&gt;&lt;dc:title&gt;");
+		strcats(str, title);
+		strcatl(str, "&lt;/dc:title&gt;&lt;upnp:class&gt;object.");
+		strcats(str, class);
+		strcatl(str, "&lt;/upnp:class&gt;");
 		if( (passed_args->filter & FILTER_UPNP_STORAGEUSED) || strcmp(class+10, "storageFolder") == 0 ) {
 			/* TODO: Implement real folder size tracking */
-			ret = strcatf(str, "&lt;upnp:storageUsed&gt;%s&lt;/upnp:storageUsed&gt;", (size ? size : "-1"));
+			add_element(str, "&lt;upnp:storageUsed&gt;", (size ? size : "-1"), "&lt;/upnp:storageUsed&gt;");
 		}
 		if( creator && (passed_args->filter & FILTER_DC_CREATOR) ) {
-			ret = strcatf(str, "&lt;dc:creator&gt;%s&lt;/dc:creator&gt;", creator);
+			add_element(str, "&lt;dc:creator&gt;", creator, "&lt;/dc:creator&gt;");
 		}
 		if( genre && (passed_args->filter & FILTER_UPNP_GENRE) ) {
-			ret = strcatf(str, "&lt;upnp:genre&gt;%s&lt;/upnp:genre&gt;", genre);
+			add_element(str, "&lt;upnp:genre&gt;", genre, "&lt;/upnp:genre&gt;");
 		}
 		if( artist && (passed_args->filter & FILTER_UPNP_ARTIST) ) {
-			ret = strcatf(str, "&lt;upnp:artist&gt;%s&lt;/upnp:artist&gt;", artist);
+			add_element(str, "&lt;upnp:artist&gt;", artist, "&lt;/upnp:artist&gt;");
 		}
 		if( NON_ZERO(album_art) && (passed_args->filter & FILTER_UPNP_ALBUMARTURI) ) {
-			ret = strcatf(str, "&lt;upnp:albumArtURI ");
+			strcatl(str, "&lt;upnp:albumArtURI ");
 			if( passed_args->filter & FILTER_UPNP_ALBUMARTURI_DLNA_PROFILEID ) {
-				ret = strcatf(str, "dlna:profileID=\"JPEG_TN\" xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\"");
+				strcatl(str, "dlna:profileID=\"JPEG_TN\" xmlns:dlna=\"urn:schemas-dlna-org:metadata-1-0/\"");
 			}
-			ret = strcatf(str, "&gt;http://%s:%d/AlbumArt/%s-%s.jpg&lt;/upnp:albumArtURI&gt;",
-			                   lan_addr[passed_args->iface].str, runtime_vars.port, album_art, detailID);
+			strcatl(str, "&gt;");
+			add_url(str, tpl, "AlbumArt/");
+			strcats(str, album_art);
+			strcatl(str, "-");
+			strcats(str, detailID);
+			strcatl(str, ".jpg&lt;/upnp:albumArtURI&gt;");
 		}
 		if( passed_args->filter & FILTER_AV_MEDIA_CLASS ) {
-			char class;
+			const char *class;
 			if( strncmp(id, MUSIC_ID, sizeof(MUSIC_ID)) == 0 )
-				class = 'M';
+				class = "M";
 			else if( strncmp(id, VIDEO_ID, sizeof(VIDEO_ID)) == 0 )
-				class = 'V';
+				class = "V";
 			else if( strncmp(id, IMAGE_ID, sizeof(IMAGE_ID)) == 0 )
-				class = 'P';
+				class = "P";
 			else
-				class = 0;
+				class = NULL;
 			if( class )
-				ret = strcatf(str, "&lt;av:mediaClass xmlns:av=\"urn:schemas-sony-com:av\"&gt;"
-				                    "%c&lt;/av:mediaClass&gt;", class);
+				add_element(str, "&lt;av:mediaClass xmlns:av=\"urn:schemas-sony-com:av\"&gt;",
+				            class, "&lt;/av:mediaClass&gt;");
 		}
-		ret = strcatf(str, "&lt;/container&gt;");
+		strcatl(str, "&lt;/container&gt;");
 	}
 
 	return 0;
@@ -1181,25 +1800,34 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			"&lt;DIDL-Lite"
 			CONTENT_DIRECTORY_SCHEMAS;
 	struct magic_container_s *magic;
-	char *zErrMsg = NULL;
-	char *sql, *ptr;
+	sqlite3_stmt *stmt;
+	char *sql, *ptr, *key = NULL;
 	struct Response args;
 	struct string_s str;
 	int totalMatches = 0;
-	int ret;
+	int bind_parent = 0;
+	int ret, i;
 	const char *ObjectID, *BrowseFlag;
 	char *Filter, *SortCriteria;
 	const char *objectid_sql = "o.OBJECT_ID";
 	const char *parentid_sql = "o.PARENT_ID";
 	const char *refid_sql = "o.REF_ID";
 	char where[256] = "";
-	char *orderBy = NULL;
+	char *orderBy = NULL, *seek = NULL;
 	struct NameValueParserData data;
 	int RequestedCount = 0;
 	int StartingIndex = 0;
+	struct page_keys keys;
+	struct page_cursor *cursor = NULL;
+	struct page_mark *from = NULL, next;
+	pid_t worker = -1;
 
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
+	memset(&keys, 0, sizeof(keys));
+	memset(&next, 0, sizeof(next));
+	args.db = h->db;
+	args.h = h;
 
 	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
 
@@ -1235,12 +1863,20 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 		goto browse_error;
 	}
 
+	args.iface = h->iface;
+	args.filter = set_filter_flags(Filter, h);
+	args.client = h->req_client ? h->req_client->type->type : 0;
+	if( runtime_vars.resp_cache_kb > 0 )
+		key = sqlite3_mprintf("Browse\n%s\n%s\n%x\n%s\n%d\n%d\n%d\n%d", ObjectID, BrowseFlag,
+		                      args.filter, THISORNUL(SortCriteria), StartingIndex, RequestedCount,
+		                      args.client, args.iface);
+	if( send_cached_resp(h, key) )
+		goto browse_error;
+
 	str.data = malloc(DEFAULT_RESP_SIZE);
 	str.size = DEFAULT_RESP_SIZE;
 	str.off = sprintf(str.data, "%s", resp0);
 	/* See if we need to include DLNA namespace reference */
-	args.iface = h->iface;
-	args.filter = set_filter_flags(Filter, h);
 	if( args.filter & FILTER_DLNA_NAMESPACE )
 		ret = strcatf(&str, DLNA_NAMESPACE);
 	if( args.filter & FILTER_PV_SUBTITLE )
@@ -1249,7 +1885,6 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 
 	args.returned = 0;
 	args.requested = RequestedCount;
-	args.client = h->req_client ? h->req_client->type->type : 0;
 	args.flags = h->req_client ? h->req_client->type->flags : 0;
 	args.str = &str;
 	DPRINTF(E_DEBUG, L_HTTP, "Browsing ContentDirectory:\n"
@@ -1277,10 +1912,16 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 				refid_sql = magic->refid_sql;
 		}
 		sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS
-				      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-				      " where OBJECT_ID = '%q';",
-				      objectid_sql, parentid_sql, refid_sql, id);
-		ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+				      FROM_OBJECTS " where OBJECT_ID = ?",
+				      objectid_sql, parentid_sql, refid_sql);
+		stmt = sql_prepare_cached(h->db, sql);
+		if( stmt )
+		{
+			sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
+			ret = sql_exec_cached(stmt, callback, (void *) &args);
+		}
+		else
+			ret = SQLITE_ERROR;
 		totalMatches = args.returned;
 	}
 	else
@@ -1301,17 +1942,20 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			if (magic->max_count > 0)
 			{
 				int limit = MAX(magic->max_count - StartingIndex, 0);
-				ret = get_child_count(ObjectID, magic);
+				ret = get_child_count(h->db, ObjectID, magic);
 				totalMatches = MIN(ret, limit);
 				if (RequestedCount > limit || RequestedCount < 0)
 					RequestedCount = limit;
 			}
 		}
 		if (!where[0])
-			sqlite3_snprintf(sizeof(where), where, "PARENT_ID = '%q'", ObjectID);
+		{
+			strcpy(where, "PARENT_ID = ?");
+			bind_parent = 1;
+		}
 
 		if (!totalMatches)
-			totalMatches = get_child_count(ObjectID, magic);
+			totalMatches = get_child_count(h->db, ObjectID, magic);
 		ret = 0;
 		if( SortCriteria )
 		{
@@ -1323,14 +1967,14 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			if( strncmp(ObjectID, MUSIC_PLIST_ID, strlen(MUSIC_PLIST_ID)) == 0 )
 			{
 				if( strcmp(ObjectID, MUSIC_PLIST_ID) == 0 )
-					ret = xasprintf(&orderBy, "order by d.TITLE");
+					ret = xasprintf(&orderBy, "order by " SORT_TIEBREAK);
 				else
 					ret = xasprintf(&orderBy, "order by length(OBJECT_ID), OBJECT_ID");
 			}
 			else if( args.flags & FLAG_FORCE_SORT )
 			{
 				__SORT_LIMIT
-				ret = xasprintf(&orderBy, "order by o.CLASS, d.DISC, d.TRACK, d.TITLE");
+				ret = xasprintf(&orderBy, "order by " FORCE_SORT_ORDER);
 			}
 			else
 				orderBy = parse_sort_criteria(SortCriteria, &ret);
@@ -1348,26 +1992,80 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			goto browse_error;
 		}
 
-		sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS
-		                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-				      " where %s %s limit %d, %d;",
+		/* Unsorted children come in IDX_SCANNER_OPT order, so
+		 * paging can seek on that just as well */
+		if( bind_parent &&
+		    init_page_keys(&keys, orderBy ? orderBy : "order by o.NAME, o.OBJECT_ID", "o.OBJECT_ID") )
+		{
+			sql = sqlite3_mprintf("%d\n%s\n%s", args.client, ObjectID, keys.order);
+			cursor = get_page_cursor(sql);
+			sqlite3_free(sql);
+			from = find_page_mark(cursor, StartingIndex, keys.nkeys);
+			if( from )
+				seek = page_seek_sql(&keys, from);
+			if( !seek )
+				from = NULL;
+			next.nkeys = keys.nkeys;
+			args.mark = &next;
+			args.mark_row = RequestedCount;
+		}
+
+		if( page_rows(totalMatches, StartingIndex, RequestedCount) > FORK_RESP_ROWS )
+		{
+			worker = ForkResp_upnphttp(h);
+			if( worker > 0 )
+				goto browse_error;
+			args.db = h->db;
+		}
+
+		/* Only the parameters change between pages, so the
+		 * statement is compiled once per container shape */
+		sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS "%s "
+		                      FROM_OBJECTS " where %s%s %s limit ?, ?",
 				      objectid_sql, parentid_sql, refid_sql,
-				      where, THISORNUL(orderBy), StartingIndex, RequestedCount);
-		DPRINTF(E_DEBUG, L_HTTP, "Browse SQL: %s\n", sql);
-		ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+				      cursor ? keys.columns : "", where, THISORNUL(seek),
+				      cursor ? keys.order : THISORNUL(orderBy));
+		DPRINTF(E_DEBUG, L_HTTP, "Browse SQL: %s [%s, %d, %d]%s\n", sql,
+			bind_parent ? ObjectID : "", StartingIndex, RequestedCount,
+			from ? " from a cursor" : "");
+		stmt = sql_prepare_cached(h->db, sql);
+		if( stmt )
+		{
+			i = 1;
+			if( bind_parent )
+				sqlite3_bind_text(stmt, i++, ObjectID, -1, SQLITE_STATIC);
+			if( from )
+				page_seek_bind(stmt, &i, &keys, from);
+			sqlite3_bind_int(stmt, i++, from ? StartingIndex - from->index : StartingIndex);
+			sqlite3_bind_int(stmt, i++, RequestedCount);
+			ret = sql_exec_cached(stmt, callback, (void *) &args);
+		}
+		else
+			ret = SQLITE_ERROR;
+		/* Remember where the next page starts */
+		if( ret == SQLITE_OK && cursor && args.returned == RequestedCount )
+		{
+			next.index = StartingIndex + RequestedCount;
+			store_page_mark(cursor, &next);
+		}
 	}
-	if( (ret != SQLITE_OK) && (zErrMsg != NULL) )
+	if( ret != SQLITE_OK )
 	{
-		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", zErrMsg, sql);
-		sqlite3_free(zErrMsg);
-		SoapError(h, 709, "Unsupported or invalid sort criteria");
+		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", sqlite3_errmsg(h->db), sql);
+		sqlite3_free(sql);
+		/* Too late for a fault once part of the result is out, so
+		 * leave the response unfinished for the client to notice */
+		if( h->respflags & FLAG_STREAMED )
+			CloseSocket_upnphttp(h);
+		else
+			SoapError(h, 709, "Unsupported or invalid sort criteria");
 		goto browse_error;
 	}
 	sqlite3_free(sql);
 	/* Does the object even exist? */
 	if( !totalMatches )
 	{
-		if( !object_exists(ObjectID) )
+		if( !object_exists(h->db, ObjectID) )
 		{
 			SoapError(h, 701, "No such object error");
 			goto browse_error;
@@ -1379,282 +2077,509 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	                    "<UpdateID>%u</UpdateID>"
 	                    "</u:BrowseResponse>",
 	                    args.returned, totalMatches, updateID);
-	BuildSendAndCloseSoapResp(h, str.data, str.off);
+	if( !(h->respflags & FLAG_STREAMED) )
+		store_resp(key, &str);
+	SendAndCloseSoapResp(h, &str);
 browse_error:
 	ClearNameValueList(&data);
+	sqlite3_free(key);
+	clear_page_mark(&next);
+	free(keys.copy);
+	free(seek);
 	free(orderBy);
 	free(str.data);
+	if( worker == 0 )
+		_exit(0);
 }
 
-static inline void
-charcat(struct string_s *str, char c)
+/* Has the scanner built the full-text index yet? */
+static int
+search_index_ready(sqlite3 *db)
 {
-	if (str->size <= str->off)
-	{
-		str->data[str->size-1] = '\0';
+	static int ready = 0;
+
+	if (!ready && !scanning)
+		ready = sql_get_int_field(db, "SELECT count(*) from sqlite_master"
+		                              " where name = 'DETAILS_FTS'") > 0;
+	return ready;
+}
+
+/* Compiled SearchCriteria.  The criteria string is parsed into a tree of
+ * and/or nodes over property comparisons, and the tree becomes an SQL
+ * condition with a parameter in place of each literal.  Clients send the
+ * same few criteria over and over, so the compiled form is kept, keyed by
+ * the string.  The statements built around it then read the same every
+ * time, and come out of the statement cache with only the values to bind. */
+#define SEARCH_QUERIES 16
+#define SEARCH_TERMS 256	/* comparisons in one criteria */
+#define SEARCH_DEPTH 32		/* nested parentheses */
+
+#define PROP_CLASS	0x01	/* stored without the "object." prefix */
+#define PROP_ESCAPED	0x02	/* stored escaped, see escape_tag() */
+#define PROP_PARENT	0x04	/* the parent, not the object itself */
+
+static const struct search_prop {
+	const char *name;
+	const char *column;
+	const char *fts;	/* DETAILS_FTS column that can answer "contains" */
+	int flags;
+} search_props[] = {
+	{ "upnp:class",  "o.CLASS",   NULL,      PROP_CLASS },
+	{ "dc:title",    "d.TITLE",   "TITLE",   PROP_ESCAPED },
+	{ "dc:creator",  "d.CREATOR", "CREATOR", PROP_ESCAPED },
+	{ "upnp:artist", "d.ARTIST",  "ARTIST",  PROP_ESCAPED },
+	{ "upnp:actor",  "d.ARTIST",  "ARTIST",  PROP_ESCAPED },
+	{ "upnp:album",  "d.ALBUM",   "ALBUM",   PROP_ESCAPED },
+	{ "upnp:genre",  "d.GENRE",   NULL,      PROP_ESCAPED },
+	{ "dc:date",     "d.DATE",    NULL,      PROP_ESCAPED },
+	{ "@id",         "OBJECT_ID", NULL,      0 },
+	{ "@refID",      "REF_ID",    NULL,      0 },
+	{ "@parentID",   "PARENT_ID", NULL,      PROP_PARENT },
+	{ NULL }
+};
+
+enum search_op {
+	SEARCH_AND,
+	SEARCH_OR,
+	SEARCH_EQ,
+	SEARCH_NE,
+	SEARCH_LE,
+	SEARCH_LT,
+	SEARCH_GE,
+	SEARCH_GT,
+	SEARCH_CONTAINS,
+	SEARCH_NOT_CONTAINS,
+	SEARCH_DERIVED,
+	SEARCH_STARTS,
+	SEARCH_EXISTS
+};
+
+static const struct search_opname {
+	const char *name;
+	enum search_op op;
+	const char *sql;
+} search_ops[] = {
+	{ "=",              SEARCH_EQ,           "=" },
+	{ "!=",             SEARCH_NE,           "!=" },
+	{ "<=",             SEARCH_LE,           "<=" },
+	{ "<",              SEARCH_LT,           "<" },
+	{ ">=",             SEARCH_GE,           ">=" },
+	{ ">",              SEARCH_GT,           ">" },
+	{ "contains",       SEARCH_CONTAINS,     "like" },
+	{ "doesNotContain", SEARCH_NOT_CONTAINS, "not like" },
+	{ "derivedfrom",    SEARCH_DERIVED,      "like" },
+	{ "startsWith",     SEARCH_STARTS,       "like" },
+	{ "exists",         SEARCH_EXISTS,       NULL },
+	{ NULL }
+};
+
+struct search_node {
+	enum search_op op;
+	const struct search_prop *prop;
+	char *value;		/* the literal, unescaped */
+	int exists;		/* "exists true" */
+	struct search_node *left, *right;
+};
+
+struct search_parser {
+	const char *s;
+	int depth;
+	int terms;
+	int values;
+};
+
+struct search_query {
+	char *criteria;
+	int fts;
+	char *where;		/* NULL if the criteria didn't parse */
+	char **values;		/* bound to the parameters of where, in order */
+	int nvalues;
+	int parent;		/* compares @parentID */
+	unsigned int used;
+};
+
+static struct search_query search_queries[SEARCH_QUERIES];
+static unsigned int search_clock;
+
+static void
+free_search_node(struct search_node *n)
+{
+	if (!n)
 		return;
+	free_search_node(n->left);
+	free_search_node(n->right);
+	free(n->value);
+	free(n);
+}
+
+/* The criteria as the client sent it, without the XML escaping of the
+ * SOAP body */
+static char *
+search_unescape(const char *str)
+{
+	static const struct {
+		const char *entity;
+		char c;
+	} entities[] = {
+		{ "&quot;", '"' },
+		{ "&apos;", '\'' },
+		{ "&lt;", '<' },
+		{ "&gt;", '>' },
+		{ "&amp;", '&' },
+		{ NULL }
+	};
+	char *ret, *d;
+	int i;
+
+	ret = d = malloc(strlen(str) + 1);
+	if (!ret)
+		return NULL;
+	while (*str)
+	{
+		for (i = 0; *str == '&' && entities[i].entity; i++)
+		{
+			if (strncmp(str, entities[i].entity, strlen(entities[i].entity)) == 0)
+				break;
+		}
+		if (*str == '&' && entities[i].entity)
+		{
+			*d++ = entities[i].c;
+			str += strlen(entities[i].entity);
+		}
+		else
+			*d++ = *str++;
 	}
-	str->data[str->off] = c;
-	str->off += 1;
+	*d = '\0';
+
+	return ret;
 }
 
-static inline char *
-parse_search_criteria(const char *str, char *sep)
+/* Match a keyword or operator, which must not run on into the next token */
+static int
+search_keyword(struct search_parser *p, const char *word)
 {
-	struct string_s criteria;
-	int len;
-	int literal = 0, like = 0;
-	const char *s;
+	const char *s = p->s;
+	size_t len = strlen(word);
 
-	if (!str)
-		return strdup("1 = 1");
+	while (isspace(*s))
+		s++;
+	if (strncasecmp(s, word, len) != 0)
+		return 0;
+	if (isalpha(word[len-1]) && (isalnum(s[len]) || (s[len] && strchr(":@_", s[len]))))
+		return 0;
+	p->s = s + len;
 
-	len = strlen(str) + 32;
-	criteria.data = malloc(len);
-	criteria.size = len;
-	criteria.off = 0;
+	return 1;
+}
 
-	s = str;
+static const struct search_prop *
+search_property(struct search_parser *p)
+{
+	const char *s = p->s;
+	size_t len;
+	int i;
 
 	while (isspace(*s))
 		s++;
+	len = strcspn(s, " \t\r\n()\"=!<>");
+	for (i = 0; search_props[i].name; i++)
+	{
+		if (strlen(search_props[i].name) == len &&
+		    strncmp(s, search_props[i].name, len) == 0)
+		{
+			p->s = s + len;
+			return &search_props[i];
+		}
+	}
+
+	return NULL;
+}
 
-	while (*s)
+/* A quoted string, with \" and \\ escaped */
+static char *
+search_literal(struct search_parser *p)
+{
+	const char *s = p->s;
+	char *value, *v;
+
+	while (isspace(*s))
+		s++;
+	if (*s != '"')
+		return NULL;
+	value = v = malloc(strlen(s));
+	if (!value)
+		return NULL;
+	for (s++; *s != '"'; s++)
 	{
-		if (literal)
+		if (*s == '\\' && (s[1] == '"' || s[1] == '\\'))
+			s++;
+		if (!*s)
 		{
-			switch (*s) {
-			case '&':
-				if (strncmp(s, "&quot;", 6) == 0)
-					s += 5;
-				else if (strncmp(s, "&apos;", 6) == 0)
-				{
-					strcatf(&criteria, "'");
-					s += 6;
-					continue;
-				}
-				else
-					break;
-			case '"':
-				literal = 0;
-				if (like)
-				{
-					charcat(&criteria, '%');
-					like--;
-				}
-				charcat(&criteria, '"');
-				break;
-			case '\\':
-				if (strncmp(s, "\\&quot;", 7) == 0)
-				{
-					strcatf(&criteria, "&amp;quot;");
-					s += 7;
-					continue;
-				}
-				break;
-			case 'o':
-				if (strncmp(s, "object.", 7) == 0)
-					s += 7;
-				else if (strncmp(s, "object\"", 7) == 0 ||
-				         strncmp(s, "object&quot;", 12) == 0)
-				{
-					s += 6;
-					continue;
-				}
-			default:
-				charcat(&criteria, *s);
-				break;
-			}
+			free(value);
+			return NULL;
 		}
-		else
+		*v++ = *s;
+	}
+	*v = '\0';
+	p->s = s + 1;
+
+	return value;
+}
+
+static struct search_node *search_expr(struct search_parser *p, enum search_op op);
+
+/* A comparison, or a parenthesized expression */
+static struct search_node *
+search_term(struct search_parser *p)
+{
+	struct search_node *n;
+	int i;
+
+	while (isspace(*p->s))
+		p->s++;
+	if (*p->s == '(')
+	{
+		if (++p->depth > SEARCH_DEPTH)
+			return NULL;
+		p->s++;
+		n = search_expr(p, SEARCH_OR);
+		if (n && !search_keyword(p, ")"))
 		{
-			switch (*s) {
-			case '\\':
-				if (strncmp(s, "\\&quot;", 7) == 0)
-				{
-					strcatf(&criteria, "&amp;quot;");
-					s += 7;
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case '"':
-				literal = 1;
-				charcat(&criteria, *s);
-				if (like == 2)
-				{
-					charcat(&criteria, '%');
-					like--;
-				}
-				break;
-			case '&':
-				if (strncmp(s, "&quot;", 6) == 0)
-				{
-					literal = 1;
-					strcatf(&criteria, "\"");
-					if (like == 2)
-					{
-						charcat(&criteria, '%');
-						like--;
-					}
-					s += 5;
-				}
-				else if (strncmp(s, "&apos;", 6) == 0)
-				{
-					strcatf(&criteria, "'");
-					s += 5;
-				}
-				else if (strncmp(s, "&lt;", 4) == 0)
-				{
-					strcatf(&criteria, "<");
-					s += 3;
-				}
-				else if (strncmp(s, "&gt;", 4) == 0)
-				{
-					strcatf(&criteria, ">");
-					s += 3;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case '@':
-				if (strncmp(s, "@refID", 6) == 0)
-				{
-					strcatf(&criteria, "REF_ID");
-					s += 6;
-					continue;
-				}
-				else if (strncmp(s, "@id", 3) == 0)
-				{
-					strcatf(&criteria, "OBJECT_ID");
-					s += 3;
-					continue;
-				}
-				else if (strncmp(s, "@parentID", 9) == 0)
-				{
-					strcatf(&criteria, "PARENT_ID");
-					s += 9;
-					strcpy(sep, "*");
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case 'c':
-				if (strncmp(s, "contains", 8) == 0)
-				{
-					strcatf(&criteria, "like");
-					s += 8;
-					like = 2;
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case 'd':
-				if (strncmp(s, "derivedfrom", 11) == 0)
-				{
-					strcatf(&criteria, "like");
-					s += 11;
-					like = 1;
-					continue;
-				}
-				else if (strncmp(s, "dc:date", 7) == 0)
-				{
-					strcatf(&criteria, "d.DATE");
-					s += 7;
-					continue;
-				}
-				else if (strncmp(s, "dc:title", 8) == 0)
-				{
-					strcatf(&criteria, "d.TITLE");
-					s += 8;
-					continue;
-				}
-				else if (strncmp(s, "dc:creator", 10) == 0)
-				{
-					strcatf(&criteria, "d.CREATOR");
-					s += 10;
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case 'e':
-				if (strncmp(s, "exists", 6) == 0)
-				{
-					s += 6;
-					while (isspace(*s))
-						s++;
-					if (strncmp(s, "true", 4) == 0)
-					{
-						strcatf(&criteria, "is not NULL");
-						s += 3;
-					}
-					else if (strncmp(s, "false", 5) == 0)
-					{
-						strcatf(&criteria, "is NULL");
-						s += 4;
-					}
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case 'u':
-				if (strncmp(s, "upnp:class", 10) == 0)
-				{
-					strcatf(&criteria, "o.CLASS");
-					s += 10;
-					continue;
-				}
-				else if (strncmp(s, "upnp:actor", 10) == 0)
-				{
-					strcatf(&criteria, "d.ARTIST");
-					s += 10;
-					continue;
-				}
-				else if (strncmp(s, "upnp:artist", 11) == 0)
-				{
-					strcatf(&criteria, "d.ARTIST");
-					s += 11;
-					continue;
-				}
-				else if (strncmp(s, "upnp:album", 10) == 0)
-				{
-					strcatf(&criteria, "d.ALBUM");
-					s += 10;
-					continue;
-				}
-				else if (strncmp(s, "upnp:genre", 10) == 0)
-				{
-					strcatf(&criteria, "d.GENRE");
-					s += 10;
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case '(':
-				if (s > str && !isspace(s[-1]))
-					charcat(&criteria, ' ');
-				charcat(&criteria, *s);
-				break;
-			case ')':
-				charcat(&criteria, *s);
-				if (!isspace(s[1]))
-					charcat(&criteria, ' ');
-				break;
-			default:
-				charcat(&criteria, *s);
-				break;
-			}
+			free_search_node(n);
+			n = NULL;
 		}
-		s++;
+		p->depth--;
+		return n;
 	}
-	charcat(&criteria, '\0');
+	if (++p->terms > SEARCH_TERMS)
+		return NULL;
 
-	return criteria.data;
+	n = calloc(1, sizeof(*n));
+	if (!n)
+		return NULL;
+	n->prop = search_property(p);
+	if (!n->prop)
+		goto bad;
+	for (i = 0; search_ops[i].name; i++)
+	{
+		if (search_keyword(p, search_ops[i].name))
+			break;
+	}
+	if (!search_ops[i].name)
+		goto bad;
+	n->op = search_ops[i].op;
+	if (n->op == SEARCH_EXISTS)
+	{
+		if (search_keyword(p, "true"))
+			n->exists = 1;
+		else if (!search_keyword(p, "false"))
+			goto bad;
+	}
+	else
+	{
+		n->value = search_literal(p);
+		if (!n->value)
+			goto bad;
+		p->values++;
+	}
+
+	return n;
+bad:
+	free_search_node(n);
+	return NULL;
+}
+
+/* Terms joined by "and", or those joined by "or", which binds looser */
+static struct search_node *
+search_expr(struct search_parser *p, enum search_op op)
+{
+	struct search_node *n, *right, *join;
+
+	n = (op == SEARCH_OR) ? search_expr(p, SEARCH_AND) : search_term(p);
+	while (n && search_keyword(p, (op == SEARCH_OR) ? "or" : "and"))
+	{
+		right = (op == SEARCH_OR) ? search_expr(p, SEARCH_AND) : search_term(p);
+		join = right ? calloc(1, sizeof(*join)) : NULL;
+		if (!join)
+		{
+			free_search_node(right);
+			free_search_node(n);
+			return NULL;
+		}
+		join->op = op;
+		join->left = n;
+		join->right = right;
+		n = join;
+	}
+
+	return n;
+}
+
+/* The value to bind for a comparison, in the form the column holds */
+static char *
+search_value(const struct search_node *n)
+{
+	const char *v = n->value;
+	char *esc = NULL, *ret;
+
+	if (n->prop->flags & PROP_CLASS)
+	{
+		if (strncmp(v, "object.", 7) == 0)
+			v += 7;
+		else if (strcmp(v, "object") == 0)
+			v += 6;
+	}
+	if ((n->prop->flags & PROP_ESCAPED) && (esc = escape_tag(v, 0)))
+		v = esc;
+	switch (n->op)
+	{
+	case SEARCH_CONTAINS:
+	case SEARCH_NOT_CONTAINS:
+		ret = sqlite3_mprintf("%%%s%%", v);
+		break;
+	case SEARCH_DERIVED:
+	case SEARCH_STARTS:
+		ret = sqlite3_mprintf("%s%%", v);
+		break;
+	default:
+		ret = sqlite3_mprintf("%s", v);
+		break;
+	}
+	free(esc);
+
+	return ret;
+}
+
+/* The SQL for a tree, collecting the values of its comparisons */
+static char *
+search_sql(const struct search_node *n, struct search_query *q)
+{
+	const struct search_prop *prop = n->prop;
+	char *left, *right, *value;
+	int i;
+
+	if (n->op == SEARCH_AND || n->op == SEARCH_OR)
+	{
+		left = search_sql(n->left, q);
+		right = left ? search_sql(n->right, q) : NULL;
+		if (!right)
+		{
+			sqlite3_free(left);
+			return NULL;
+		}
+		return sqlite3_mprintf("(%z %s %z)", left, (n->op == SEARCH_AND) ? "and" : "or", right);
+	}
+	if (prop->flags & PROP_PARENT)
+		q->parent = 1;
+	if (n->op == SEARCH_EXISTS)
+		return sqlite3_mprintf("%s is %sNULL", prop->column, n->exists ? "not " : "");
+
+	value = search_value(n);
+	if (!value)
+		return NULL;
+	q->values[q->nvalues++] = value;
+	/* A "contains" becomes a lookup in the index.  It filters on
+	 * o.DETAIL_ID so that the matches can drive the query instead of
+	 * a scan over OBJECTS.  Trigrams can't help with anything shorter. */
+	if (n->op == SEARCH_CONTAINS && q->fts && prop->fts && strlen(n->value) >= 3)
+		return sqlite3_mprintf("o.DETAIL_ID in (SELECT rowid from DETAILS_FTS"
+		                       " where %s like ?)", prop->fts);
+	for (i = 0; search_ops[i].op != n->op; i++)
+		continue;
+
+	return sqlite3_mprintf("%s %s ?", prop->column, search_ops[i].sql);
+}
+
+static void
+clear_search_query(struct search_query *q)
+{
+	int i;
+
+	for (i = 0; i < q->nvalues; i++)
+		sqlite3_free(q->values[i]);
+	free(q->values);
+	sqlite3_free(q->where);
+	free(q->criteria);
+	memset(q, 0, sizeof(*q));
+}
+
+static void
+compile_search_query(struct search_query *q)
+{
+	struct search_parser p;
+	struct search_node *tree;
+	char *str;
+
+	memset(&p, 0, sizeof(p));
+	p.s = str = search_unescape(q->criteria);
+	if (!str)
+		return;
+	while (isspace(*p.s))
+		p.s++;
+	if (*p.s == '*')
+		p.s++;
+	while (isspace(*p.s))
+		p.s++;
+	if (!*p.s)
+	{
+		q->where = sqlite3_mprintf("1 = 1");
+		free(str);
+		return;
+	}
+	tree = search_expr(&p, SEARCH_OR);
+	while (tree && isspace(*p.s))
+		p.s++;
+	if (tree && !*p.s)
+	{
+		q->values = calloc(p.values + 1, sizeof(char *));
+		if (q->values)
+			q->where = search_sql(tree, q);
+	}
+	free_search_node(tree);
+	free(str);
+}
+
+/* The compiled form of a SearchCriteria, from the cache if it's there.
+ * It stays valid until the next call. */
+static const struct search_query *
+get_search_query(const char *criteria, int fts)
+{
+	struct search_query *q, *victim = NULL;
+	int i;
+
+	if (!criteria)
+		criteria = "";
+	for (i = 0; i < SEARCH_QUERIES; i++)
+	{
+		q = &search_queries[i];
+		if (q->criteria && q->fts == fts && strcmp(q->criteria, criteria) == 0)
+		{
+			q->used = ++search_clock;
+			return q;
+		}
+		if (!victim || q->used < victim->used)
+			victim = q;
+	}
+
+	q = victim;
+	clear_search_query(q);
+	q->criteria = strdup(criteria);
+	if (!q->criteria)
+		return NULL;
+	q->fts = fts;
+	q->used = ++search_clock;
+	compile_search_query(q);
+
+	return q;
+}
+
+static void
+bind_search_values(sqlite3_stmt *stmt, int *col, const struct search_query *q)
+{
+	int i;
+
+	for (i = 0; i < q->nvalues; i++)
+		sqlite3_bind_text(stmt, (*col)++, q->values[i], -1, SQLITE_STATIC);
 }
 
 static void
@@ -1667,22 +2592,33 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 			"&lt;DIDL-Lite"
 			CONTENT_DIRECTORY_SCHEMAS;
 	struct magic_container_s *magic;
-	char *zErrMsg = NULL;
-	char *sql, *ptr;
+	sqlite3_stmt *stmt;
+	char *sql, *ptr, *seek = NULL, *key = NULL;
+	char *lower = NULL, *upper = NULL;
+	const char *scope;
+	const struct search_query *query;
 	struct Response args;
 	struct string_s str;
 	int totalMatches;
-	int ret;
+	int ret, i;
 	const char *ContainerID;
 	char *Filter, *SearchCriteria, *SortCriteria;
-	char *orderBy = NULL, *where = NULL, sep[] = "$*";
+	char *orderBy = NULL, *sortColumns = NULL;
 	char groupBy[] = "group by DETAIL_ID";
 	struct NameValueParserData data;
 	int RequestedCount = 0;
 	int StartingIndex = 0;
+	struct page_keys keys;
+	struct page_cursor *cursor = NULL;
+	struct page_mark *from = NULL, next;
+	pid_t worker = -1;
 
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
+	memset(&keys, 0, sizeof(keys));
+	memset(&next, 0, sizeof(next));
+	args.db = h->db;
+	args.h = h;
 
 	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
 
@@ -1706,12 +2642,20 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 		}
 	}
 
+	args.iface = h->iface;
+	args.filter = set_filter_flags(Filter, h);
+	args.client = h->req_client ? h->req_client->type->type : 0;
+	if( runtime_vars.resp_cache_kb > 0 )
+		key = sqlite3_mprintf("Search\n%s\n%s\n%x\n%s\n%d\n%d\n%d\n%d", ContainerID,
+		                      THISORNUL(SearchCriteria), args.filter, THISORNUL(SortCriteria),
+		                      StartingIndex, RequestedCount, args.client, args.iface);
+	if( send_cached_resp(h, key) )
+		goto search_error;
+
 	str.data = malloc(DEFAULT_RESP_SIZE);
 	str.size = DEFAULT_RESP_SIZE;
 	str.off = sprintf(str.data, "%s", resp0);
 	/* See if we need to include DLNA namespace reference */
-	args.iface = h->iface;
-	args.filter = set_filter_flags(Filter, h);
 	if( args.filter & FILTER_DLNA_NAMESPACE )
 	{
 		ret = strcatf(&str, DLNA_NAMESPACE);
@@ -1720,7 +2664,6 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 
 	args.returned = 0;
 	args.requested = RequestedCount;
-	args.client = h->req_client ? h->req_client->type->type : 0;
 	args.flags = h->req_client ? h->req_client->type->flags : 0;
 	args.str = &str;
 	DPRINTF(E_DEBUG, L_HTTP, "Searching ContentDirectory:\n"
@@ -1744,26 +2687,71 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	    GETFLAG(DLNA_STRICT_MASK) )
 		groupBy[0] = '\0';
 
-	where = parse_search_criteria(SearchCriteria, sep);
-	DPRINTF(E_DEBUG, L_HTTP, "Translated SearchCriteria: %s\n", where);
+	query = get_search_query(SearchCriteria, search_index_ready(h->db));
+	if( !query || !query->where )
+	{
+		SoapError(h, 708, "Unsupported or invalid search criteria");
+		goto search_error;
+	}
+	DPRINTF(E_DEBUG, L_HTTP, "Translated SearchCriteria: %s [%d values]\n",
+		query->where, query->nvalues);
+
+	/* Everything below the container is a range of IDs, which unlike a
+	 * glob pattern can be bound without forcing a recompile.  Criteria
+	 * on @parentID start the range at the container's own ID, as the
+	 * glob used to. */
+	if( *ContainerID == '*' )
+		scope = query->parent ? "1 = 1" : "OBJECT_ID glob '*$*'";
+	else
+	{
+		scope = "OBJECT_ID >= ? and OBJECT_ID < ?";
+		lower = sqlite3_mprintf("%s%s", ContainerID, query->parent ? "" : "$");
+		upper = sqlite3_mprintf("%s", lower);
+		if( !lower || !upper )
+		{
+			SoapError(h, 501, "Action Failed");
+			goto search_error;
+		}
+		if( *upper )
+			upper[strlen(upper)-1]++;
+	}
 
-	totalMatches = sql_get_int_field(db, "SELECT (select count(distinct DETAIL_ID)"
-	                                     " from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
-	                                     " where (OBJECT_ID glob '%q%s') and (%s))"
-	                                     " + "
-	                                     "(select count(*) from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
-	                                     " where (OBJECT_ID = '%q') and (%s))",
-	                                     ContainerID, sep, where, ContainerID, where);
+	sql = sqlite3_mprintf("SELECT (select count(distinct DETAIL_ID)"
+	                      " from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
+	                      " where %s and %s)%z",
+	                      scope, query->where,
+	                      (*ContainerID == '*') ? NULL :
+	                      sqlite3_mprintf(" + (select count(*)"
+	                                      " from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
+	                                      " where OBJECT_ID = ? and %s)", query->where));
+	stmt = sql_prepare_cached(h->db, sql);
+	sqlite3_free(sql);
+	totalMatches = -1;
+	if( stmt )
+	{
+		i = 1;
+		if( lower )
+		{
+			sqlite3_bind_text(stmt, i++, lower, -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt, i++, upper, -1, SQLITE_STATIC);
+		}
+		bind_search_values(stmt, &i, query);
+		if( *ContainerID != '*' )
+		{
+			sqlite3_bind_text(stmt, i++, ContainerID, -1, SQLITE_STATIC);
+			bind_search_values(stmt, &i, query);
+		}
+		totalMatches = sql_get_int64_cached(stmt);
+	}
 	if( totalMatches < 0 )
 	{
-		/* Must be invalid SQL, so most likely bad or unhandled search criteria. */
 		SoapError(h, 708, "Unsupported or invalid search criteria");
 		goto search_error;
 	}
 	/* Does the object even exist? */
 	if( !totalMatches )
 	{
-		if( !object_exists(ContainerID) )
+		if( !object_exists(h->db, ContainerID) )
 		{
 			SoapError(h, 710, "No such container");
 			goto search_error;
@@ -1779,37 +2767,107 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 		goto search_error;
 	}
 
-	sql = sqlite3_mprintf( SELECT_COLUMNS
-	                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-	                      " where OBJECT_ID glob '%q%s' and (%s) %s "
+	/* Grouped rows are told apart by DETAIL_ID.  Without a sort the
+	 * order is whatever the plan gives, so there is nothing to seek on. */
+	if( orderBy && init_page_keys(&keys, orderBy, groupBy[0] ? "o.DETAIL_ID" : "o.OBJECT_ID") )
+	{
+		sql = sqlite3_mprintf("%d\n%s\n%s\n%s\n%s", args.client, ContainerID,
+		                      query->criteria, groupBy, keys.order);
+		cursor = get_page_cursor(sql);
+		sqlite3_free(sql);
+		from = find_page_mark(cursor, StartingIndex, keys.nkeys);
+		if( from )
+			seek = page_seek_sql(&keys, from);
+		if( !seek )
+			from = NULL;
+		next.nkeys = keys.nkeys;
+		args.mark = &next;
+		args.mark_row = RequestedCount;
+	}
+
+	if( page_rows(totalMatches, StartingIndex, RequestedCount) > FORK_RESP_ROWS )
+	{
+		worker = ForkResp_upnphttp(h);
+		if( worker > 0 )
+			goto search_error;
+		args.db = h->db;
+	}
+
+	/* A sort that can't be paged still has to be in the projection for
+	 * the UNION ALL below to order by it */
+	if( !cursor && orderBy && *ContainerID != '*' )
+		sortColumns = order_columns(orderBy);
+
+	sql = sqlite3_mprintf( SELECT_COLUMNS "%s "
+	                      FROM_OBJECTS " where %s and %s%s %s "
 	                      "%z %s"
-	                      " limit %d, %d",
-	                      ContainerID, sep, where, groupBy,
+	                      " limit ?, ?",
+	                      cursor ? keys.columns : THISORNUL(sortColumns),
+	                      scope, query->where, THISORNUL(seek), groupBy,
 	                      (*ContainerID == '*') ? NULL :
-	                      sqlite3_mprintf("UNION ALL " SELECT_COLUMNS
-	                                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-	                                      " where OBJECT_ID = '%q' and (%s) ", ContainerID, where),
-	                      orderBy, StartingIndex, RequestedCount);
-	DPRINTF(E_DEBUG, L_HTTP, "Search SQL: %s\n", sql);
-	ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
-	if( (ret != SQLITE_OK) && (zErrMsg != NULL) )
+	                      sqlite3_mprintf("UNION ALL " SELECT_COLUMNS "%s "
+	                                      FROM_OBJECTS " where OBJECT_ID = ? and %s%s ",
+	                                      cursor ? keys.columns : THISORNUL(sortColumns),
+	                                      query->where, THISORNUL(seek)),
+	                      cursor ? keys.order : THISORNUL(orderBy));
+	DPRINTF(E_DEBUG, L_HTTP, "Search SQL: %s [%s, %d, %d]%s\n", sql, ContainerID,
+		StartingIndex, RequestedCount, from ? " from a cursor" : "");
+	stmt = sql_prepare_cached(h->db, sql);
+	if( stmt )
+	{
+		i = 1;
+		if( lower )
+		{
+			sqlite3_bind_text(stmt, i++, lower, -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt, i++, upper, -1, SQLITE_STATIC);
+		}
+		bind_search_values(stmt, &i, query);
+		if( from )
+			page_seek_bind(stmt, &i, &keys, from);
+		if( *ContainerID != '*' )
+		{
+			sqlite3_bind_text(stmt, i++, ContainerID, -1, SQLITE_STATIC);
+			bind_search_values(stmt, &i, query);
+			if( from )
+				page_seek_bind(stmt, &i, &keys, from);
+		}
+		sqlite3_bind_int(stmt, i++, from ? StartingIndex - from->index : StartingIndex);
+		sqlite3_bind_int(stmt, i++, RequestedCount);
+		ret = sql_exec_cached(stmt, callback, (void *) &args);
+	}
+	else
+		ret = SQLITE_ERROR;
+	if( ret != SQLITE_OK )
+		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", sqlite3_errmsg(h->db), sql);
+	else if( cursor && args.returned == RequestedCount )
 	{
-		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", zErrMsg, sql);
-		sqlite3_free(zErrMsg);
+		next.index = StartingIndex + RequestedCount;
+		store_page_mark(cursor, &next);
 	}
 	sqlite3_free(sql);
-	ret = strcatf(&str, "&lt;/DIDL-Lite&gt;</Result>\n"
-	                    "<NumberReturned>%u</NumberReturned>\n"
-	                    "<TotalMatches>%u</TotalMatches>\n"
-	                    "<UpdateID>%u</UpdateID>"
-	                    "</u:SearchResponse>",
-	                    args.returned, totalMatches, updateID);
-	BuildSendAndCloseSoapResp(h, str.data, str.off);
+	strcatf(&str, "&lt;/DIDL-Lite&gt;</Result>\n"
+	              "<NumberReturned>%u</NumberReturned>\n"
+	              "<TotalMatches>%u</TotalMatches>\n"
+	              "<UpdateID>%u</UpdateID>"
+	              "</u:SearchResponse>",
+	              args.returned, totalMatches, updateID);
+	/* A failed query still answers with what it got, but isn't kept */
+	if( ret == SQLITE_OK && !(h->respflags & FLAG_STREAMED) )
+		store_resp(key, &str);
+	SendAndCloseSoapResp(h, &str);
 search_error:
 	ClearNameValueList(&data);
+	sqlite3_free(key);
+	clear_page_mark(&next);
+	free(keys.copy);
+	free(seek);
 	free(orderBy);
-	free(where);
+	free(sortColumns);
+	sqlite3_free(lower);
+	sqlite3_free(upper);
 	free(str.data);
+	if( worker == 0 )
+		_exit(0);
 }
 
 /*
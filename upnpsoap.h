@@ -22,7 +22,10 @@
 #define __UPNPSOAP_H__
 
 #define DEFAULT_RESP_SIZE 131072
-#define MAX_RESPONSE_SIZE 2097152
+/* Pages of more results than about fit in DEFAULT_RESP_SIZE are sent
+ * from a worker process, since writing one out can take as long as the
+ * client cares to take reading it */
+#define FORK_RESP_ROWS 128
 
 #define CONTENT_DIRECTORY_SCHEMAS \
 	" xmlns:dc=\"http://purl.org/dc/elements/1.1/\"" \
@@ -33,9 +36,16 @@
 #define PV_NAMESPACE \
 	" xmlns:pv=\"http://www.pv.com/pvns/\""
 
+struct didl_template;
+struct page_mark;
+struct sqlite3;
+
 struct Response
 {
 	struct string_s *str;
+	struct sqlite3 *db;			/* the request's connection */
+	struct upnphttp *h;			/* where full buffers are flushed */
+	const struct didl_template *tpl;	/* filled in on the first row */
 	int start;
 	int returned;
 	int requested;
@@ -43,7 +53,19 @@ struct Response
 	uint32_t filter;
 	uint32_t flags;
 	enum client_types client;
+	struct page_mark *mark;			/* takes the sort key of row mark_row */
+	int mark_row;
+};
+
+/* Browse and Search requests answered from the response cache, and
+ * those that had to be built, with what the cache currently holds */
+struct resp_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	size_t bytes;
+	int entries;
 };
+extern struct resp_cache_stats resp_cache_stats;
 
 /* ExecuteSoapAction():
  * this method executes the requested Soap Action */
@@ -0,0 +1,328 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+#include "log.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+#define URING_BUFFERS     4
+#define URING_BUFFER_SIZE (256*1024)
+
+/* user_data layout: buffer index in the upper bits, operation in bit 0 */
+#define URING_OP_READ     0
+#define URING_OP_SEND     1
+
+enum buf_state {
+	BUF_FREE,
+	BUF_READING,
+	BUF_READY,
+	BUF_SENDING
+};
+
+struct uring_buf {
+	enum buf_state state;
+	off_t offset;
+	size_t len;
+	size_t filled;
+	size_t sent;
+};
+
+static int uring_supported = 0;
+
+void
+uring_probe(void)
+{
+	struct io_uring ring;
+	struct io_uring_probe *probe;
+	int ret;
+
+	ret = io_uring_queue_init(2, &ring, 0);
+	if (ret < 0)
+	{
+		DPRINTF(E_INFO, L_GENERAL, "io_uring is not available [%s]\n", strerror(-ret));
+		return;
+	}
+	probe = io_uring_get_probe_ring(&ring);
+	if (probe &&
+	    io_uring_opcode_supported(probe, IORING_OP_READ_FIXED) &&
+	    io_uring_opcode_supported(probe, IORING_OP_SEND))
+		uring_supported = 1;
+	else
+		DPRINTF(E_INFO, L_GENERAL, "io_uring lacks fixed reads or sends\n");
+	free(probe);
+	io_uring_queue_exit(&ring);
+
+	if (uring_supported)
+		DPRINTF(E_INFO, L_GENERAL, "Using io_uring for file streaming\n");
+}
+
+static void
+queue_op(struct io_uring *ring, int op, int idx, int fd, void *data, size_t len, off_t offset)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(ring);
+	if (op == URING_OP_READ)
+		io_uring_prep_read_fixed(sqe, fd, data, len, offset, idx);
+	else
+		io_uring_prep_send(sqe, fd, data, len, MSG_NOSIGNAL);
+	io_uring_sqe_set_data(sqe, (void *)(uintptr_t)((idx << 1) | op));
+}
+
+struct uring_stream {
+	struct io_uring ring;
+	struct iovec iov[URING_BUFFERS];
+	void *mem;
+	int sock;
+	int sendfd;
+};
+
+struct uring_stream *
+uring_open(int sock, int sendfd)
+{
+	struct uring_stream *s;
+	int i, ret;
+
+	if (!uring_supported)
+	{
+		errno = ENOSYS;
+		return NULL;
+	}
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->sock = sock;
+	s->sendfd = sendfd;
+	ret = io_uring_queue_init(URING_BUFFERS * 2, &s->ring, 0);
+	if (ret < 0)
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "io_uring_queue_init: %s\n", strerror(-ret));
+		free(s);
+		errno = ENOSYS;
+		return NULL;
+	}
+	if (posix_memalign(&s->mem, 4096, URING_BUFFERS * URING_BUFFER_SIZE) != 0)
+	{
+		io_uring_queue_exit(&s->ring);
+		free(s);
+		errno = ENOSYS;
+		return NULL;
+	}
+	for (i = 0; i < URING_BUFFERS; i++)
+	{
+		s->iov[i].iov_base = (char *)s->mem + i * URING_BUFFER_SIZE;
+		s->iov[i].iov_len = URING_BUFFER_SIZE;
+	}
+	/* Registering pins the pages, which may exceed RLIMIT_MEMLOCK */
+	ret = io_uring_register_buffers(&s->ring, s->iov, URING_BUFFERS);
+	if (ret < 0)
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "io_uring_register_buffers: %s\n", strerror(-ret));
+		io_uring_queue_exit(&s->ring);
+		free(s->mem);
+		free(s);
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	return s;
+}
+
+void
+uring_close(struct uring_stream *s)
+{
+	if (!s)
+		return;
+	io_uring_unregister_buffers(&s->ring);
+	io_uring_queue_exit(&s->ring);
+	free(s->mem);
+	free(s);
+}
+
+int
+uring_send_file(struct uring_stream *s, off_t *offset, off_t end_offset)
+{
+	struct io_uring *ring = &s->ring;
+	struct iovec *iov = s->iov;
+	int sock = s->sock, sendfd = s->sendfd;
+	struct io_uring_cqe *cqe;
+	struct uring_buf bufs[URING_BUFFERS];
+	struct uring_buf *b;
+	char *data;
+	off_t read_offset = *offset;
+	int next_read = 0, next_send = 0;
+	int inflight = 0, err = 0;
+	uintptr_t tag;
+	int i, ret;
+
+	memset(bufs, 0, sizeof(bufs));
+
+	for (;;)
+	{
+		/* Keep every free buffer busy reading ahead of the socket */
+		while (bufs[next_read].state == BUF_FREE && read_offset <= end_offset)
+		{
+			b = &bufs[next_read];
+			b->state = BUF_READING;
+			b->offset = read_offset;
+			b->len = ((end_offset - read_offset) < URING_BUFFER_SIZE) ?
+			         (end_offset - read_offset + 1) : URING_BUFFER_SIZE;
+			b->filled = 0;
+			b->sent = 0;
+			queue_op(ring, URING_OP_READ, next_read, sendfd,
+			         iov[next_read].iov_base, b->len, b->offset);
+			inflight++;
+			read_offset += b->len;
+			next_read = (next_read + 1) % URING_BUFFERS;
+		}
+		/* Only one send may be outstanding, or the stream could be reordered */
+		b = &bufs[next_send];
+		if (b->state == BUF_READY)
+		{
+			b->state = BUF_SENDING;
+			data = iov[next_send].iov_base;
+			queue_op(ring, URING_OP_SEND, next_send, sock,
+			         data + b->sent, b->len - b->sent, 0);
+			inflight++;
+		}
+		if (!inflight)
+			break;
+
+		ret = io_uring_submit_and_wait(ring, 1);
+		if (ret < 0)
+		{
+			if (ret == -EINTR)
+				continue;
+			err = -ret;
+			break;
+		}
+		while (io_uring_peek_cqe(ring, &cqe) == 0)
+		{
+			tag = (uintptr_t)io_uring_cqe_get_data(cqe);
+			ret = cqe->res;
+			io_uring_cqe_seen(ring, cqe);
+			inflight--;
+			i = tag >> 1;
+			b = &bufs[i];
+			data = iov[i].iov_base;
+
+			if ((tag & 1) == URING_OP_SEND)
+			{
+				if (ret < 0)
+				{
+					if (ret != -EAGAIN && ret != -EINTR)
+						err = -ret;
+					b->state = BUF_READY;
+					continue;
+				}
+				b->sent += ret;
+				*offset += ret;
+				if (b->sent < b->len)
+					b->state = BUF_READY;
+				else
+				{
+					b->state = BUF_FREE;
+					next_send = (next_send + 1) % URING_BUFFERS;
+				}
+			}
+			else
+			{
+				if (ret < 0)
+				{
+					if (ret != -EAGAIN && ret != -EINTR)
+					{
+						err = -ret;
+						continue;
+					}
+				}
+				else if (ret == 0)
+				{
+					/* The file got shorter underneath us */
+					err = EIO;
+					continue;
+				}
+				else
+					b->filled += ret;
+				if (b->filled < b->len)
+				{
+					queue_op(ring, URING_OP_READ, i, sendfd, data + b->filled,
+					         b->len - b->filled, b->offset + b->filled);
+					inflight++;
+				}
+				else
+					b->state = BUF_READY;
+			}
+		}
+		if (err)
+			break;
+	}
+
+	/* Reap anything still in flight, so the buffers are free again */
+	if (inflight)
+		io_uring_submit(ring);
+	while (inflight > 0 && io_uring_wait_cqe(ring, &cqe) == 0)
+	{
+		io_uring_cqe_seen(ring, cqe);
+		inflight--;
+	}
+
+	if (err)
+	{
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+#else
+
+void
+uring_probe(void)
+{
+}
+
+struct uring_stream *
+uring_open(int sock, int sendfd)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void
+uring_close(struct uring_stream *s)
+{
+}
+
+int
+uring_send_file(struct uring_stream *s, off_t *offset, off_t end_offset)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif /* HAVE_LIBURING */
@@ -0,0 +1,43 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/types.h>
+
+/* Probe the running kernel for io_uring support.  Called once from the
+ * main process so that forked children inherit the result. */
+void uring_probe(void);
+
+struct uring_stream;
+
+/* Set up a ring and its registered buffers for streaming sendfd to
+ * sock.  Returns NULL with errno set to ENOSYS if io_uring is
+ * unavailable.  One ring serves every slice of a transfer, so paced and
+ * scheduled streams don't pay for the setup again on each one. */
+struct uring_stream *uring_open(int sock, int sendfd);
+void uring_close(struct uring_stream *s);
+
+/* Stream the file range [*offset, end_offset] using io_uring.
+ * File reads are queued ahead of the socket sends into a small set of
+ * registered buffers, so the socket always has data waiting.
+ * Returns 0 once the whole range has been sent, or -1 with errno set.
+ * The caller may then fall back to regular I/O starting at *offset,
+ * which is kept up to date with the number of bytes actually sent. */
+int uring_send_file(struct uring_stream *s, off_t *offset, off_t end_offset);
+
+#endif /* __URING_H__ */
@@ -25,6 +25,7 @@
 #define __UTILS_H__
 
 #include <stdarg.h>
+#include <string.h>
 #include <dirent.h>
 #include <sys/param.h>
 
@@ -51,6 +52,38 @@ strcatf(struct string_s *str, const char *fmt, ...)
 
 	return ret;
 }
+/* Plain appends for hot paths, truncating the same way strcatf does */
+static inline void
+strcatn(struct string_s *str, const char *s, size_t len)
+{
+	if (str->off >= str->size)
+		return;
+	if (len > str->size - str->off)
+		len = str->size - str->off;
+	memcpy(str->data + str->off, s, len);
+	str->off += len;
+}
+#define strcatl(str, lit) strcatn(str, "" lit "", sizeof(lit) - 1)
+static inline void
+strcats(struct string_s *str, const char *s)
+{
+	strcatn(str, s, strlen(s));
+}
+static inline void
+strcati(struct string_s *str, long val)
+{
+	char buf[24];
+	char *p = buf + sizeof(buf);
+	unsigned long v = (val < 0) ? -(unsigned long)val : (unsigned long)val;
+
+	do {
+		*--p = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	if (val < 0)
+		*--p = '-';
+	strcatn(str, p, buf + sizeof(buf) - p);
+}
 static inline void strncpyt(char *dst, const char *src, size_t len)
 {
 	strncpy(dst, src, len);